@@ -0,0 +1,201 @@
+/* arena.c
+ * Allocates memory for a connection in blocks that are freed together.
+ *
+ * Notes: Everything a session keeps while it runs (its network
+ * buffer, the recipients of a message, the list of messages of a
+ * mailbox) is taken from an arena owned by the session. Allocations
+ * are carved one after the other from large blocks, so they cost a
+ * pointer increment instead of a call to malloc, and are never freed
+ * one by one: the session goes back to an earlier position (e.g., at
+ * the end of each SMTP transaction) or destroys the arena when the
+ * client disconnects. Long-lived processes serving many sessions
+ * then get a few large blocks from the heap instead of many small,
+ * scattered allocations.
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+struct arena_block {
+  struct arena_block *prev;
+  size_t size;
+  size_t used;
+  char data[] __attribute__ ((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+  struct arena_block *current;
+  size_t block_size;
+  void *last;
+  struct arena_stats stats;
+};
+
+/** Internal function that rounds a size up to the arena alignment.
+ */
+static size_t aligned_size(size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+/** Creates a new, empty arena. No block is allocated until the first
+ *  allocation.
+ *
+ *  Parameters: block_size: Size of the blocks taken from the heap;
+ *                          larger allocations get a block of their
+ *                          own.
+ *
+ *  Returns: An arena_t object, or NULL if out of memory.
+ */
+arena_t arena_create(size_t block_size) {
+
+  arena_t arena = calloc(1, sizeof(struct arena));
+  if (arena)
+    arena->block_size = block_size;
+  return arena;
+}
+
+/** Allocates memory from an arena. The memory is not initialized, and
+ *  stays valid until the arena is reset to a position before it or
+ *  destroyed.
+ *
+ *  Parameters: arena: Arena to allocate from.
+ *              size: Number of bytes to be allocated.
+ *
+ *  Returns: Pointer to the allocated memory, or NULL if out of memory.
+ */
+void *arena_alloc(arena_t arena, size_t size) {
+
+  struct arena_block *block = arena->current;
+  size = aligned_size(size ? size : 1);
+
+  if (!block || block->size - block->used < size) {
+    size_t block_size = size > arena->block_size ? size : arena->block_size;
+    block = malloc(sizeof(struct arena_block) + block_size);
+    if (!block) return NULL;
+    block->prev = arena->current;
+    block->size = block_size;
+    block->used = 0;
+    arena->current = block;
+    arena->stats.blocks++;
+  }
+
+  void *ptr = block->data + block->used;
+  block->used += size;
+  arena->last = ptr;
+  arena->stats.allocations++;
+  arena->stats.bytes += size;
+  return ptr;
+}
+
+/** Changes the size of memory allocated from an arena. If it is the
+ *  most recent allocation and there is room in its block, it is
+ *  extended in place; otherwise its contents are copied to a new
+ *  allocation (the old one is only reclaimed when the arena is reset).
+ *
+ *  Parameters: arena: Arena the memory was allocated from.
+ *              ptr: Memory to be resized, or NULL for a new allocation.
+ *              old_size: Size of ptr when it was allocated.
+ *              size: New size.
+ *
+ *  Returns: Pointer to the resized memory, or NULL if out of memory
+ *           (in which case ptr is left unchanged).
+ */
+void *arena_realloc(arena_t arena, void *ptr, size_t old_size, size_t size) {
+
+  struct arena_block *block = arena->current;
+
+  if (ptr && ptr == arena->last &&
+      (char *) ptr + aligned_size(size) <= block->data + block->size) {
+    size_t old_end = block->used;
+    block->used = (char *) ptr - block->data + aligned_size(size);
+    arena->stats.bytes += block->used - old_end;
+    return ptr;
+  }
+
+  void *new_ptr = arena_alloc(arena, size);
+  if (new_ptr && ptr)
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+  return new_ptr;
+}
+
+/** Copies a string into memory allocated from an arena.
+ *
+ *  Parameters: arena: Arena to allocate from.
+ *              str: String to be copied.
+ *
+ *  Returns: The copy, or NULL if out of memory.
+ */
+char *arena_strdup(arena_t arena, const char *str) {
+
+  size_t len = strlen(str) + 1;
+  char *copy = arena_alloc(arena, len);
+  if (copy)
+    memcpy(copy, str, len);
+  return copy;
+}
+
+/** Returns the current position of an arena, to be used with
+ *  arena_reset. Allocations made before this call are kept by the
+ *  reset.
+ */
+struct arena_mark arena_mark(arena_t arena) {
+
+  return (struct arena_mark) { .block = arena->current,
+			       .used = arena->current ? arena->current->used : 0 };
+}
+
+/** Frees, in one step, everything allocated from an arena after a
+ *  position obtained with arena_mark. Blocks no longer needed are
+ *  returned to the heap, except for the first one, which is kept for
+ *  later allocations.
+ *
+ *  Parameters: arena: Arena to be reset.
+ *              mark: Position to go back to.
+ */
+void arena_reset(arena_t arena, struct arena_mark mark) {
+
+  while (arena->current && arena->current != mark.block) {
+    struct arena_block *block = arena->current;
+    if (!block->prev && !mark.block) {
+      block->used = 0;
+      break;
+    }
+    arena->current = block->prev;
+    free(block);
+  }
+
+  if (arena->current && arena->current == mark.block)
+    arena->current->used = mark.used;
+  arena->last = NULL;
+  arena->stats.resets++;
+}
+
+/** Retrieves the counters of an arena: number of allocations and
+ *  bytes allocated (including those since freed by a reset), blocks
+ *  taken from the heap and number of resets.
+ *
+ *  Parameters: arena: Arena to be assessed.
+ *              stats: Receives the counters.
+ */
+void arena_stats(arena_t arena, struct arena_stats *stats) {
+
+  *stats = arena->stats;
+}
+
+/** Frees an arena and everything allocated from it.
+ *
+ *  Parameters: arena: Arena to be freed.
+ */
+void arena_destroy(arena_t arena) {
+
+  if (!arena) return;
+  while (arena->current) {
+    struct arena_block *block = arena->current;
+    arena->current = block->prev;
+    free(block);
+  }
+  free(arena);
+}
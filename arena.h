@@ -0,0 +1,34 @@
+/* arena.h
+ * Allocates memory for a connection in blocks that are freed together.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+typedef struct arena *arena_t;
+
+// Position in an arena, see arena_mark
+struct arena_mark {
+  void *block;
+  size_t used;
+};
+
+struct arena_stats {
+  size_t allocations;
+  size_t bytes;
+  size_t blocks;
+  size_t resets;
+};
+
+arena_t arena_create(size_t block_size);
+void *arena_alloc(arena_t arena, size_t size);
+void *arena_realloc(arena_t arena, void *ptr, size_t old_size, size_t size);
+char *arena_strdup(arena_t arena, const char *str);
+struct arena_mark arena_mark(arena_t arena);
+void arena_reset(arena_t arena, struct arena_mark mark);
+void arena_stats(arena_t arena, struct arena_stats *stats);
+void arena_destroy(arena_t arena);
+
+#endif
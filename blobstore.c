@@ -0,0 +1,212 @@
+/* blobstore.c
+ * Content-addressed, single-instance storage for message bodies.
+ *
+ * Notes: Every distinct message body is stored once, as a file in
+ * the blob directory named after a hash of its contents. Mailbox
+ * entries are hard links to that file, so the file system link count
+ * doubles as the reference count: a blob whose link count drops to
+ * one is referenced by no mailbox and can be removed.
+ */
+
+#include "blobstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define BLOB_READ_CHUNK 65536
+#define BLOB_MAX_COLLISIONS 16
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+/** Computes a 64-bit FNV-1a hash of the entire contents of a file.
+ *  The file offset is not used or modified. Like all functions in this
+ *  file, it may be called from several threads at once.
+ *
+ *  Parameters: fd: Descriptor of a file open for reading.
+ *
+ *  Returns: Hash of the file contents.
+ */
+uint64_t blob_hash_file(int fd) {
+
+  char buf[BLOB_READ_CHUNK];
+  uint64_t hash = FNV_OFFSET_BASIS;
+  off_t offset = 0;
+  ssize_t rv;
+
+  while ((rv = pread(fd, buf, sizeof(buf), offset)) > 0) {
+    for (ssize_t i = 0; i < rv; i++) {
+      hash ^= (unsigned char) buf[i];
+      hash *= FNV_PRIME;
+    }
+    offset += rv;
+  }
+  return hash;
+}
+
+/** Builds the path of a blob file, given its name.
+ *
+ *  Parameters: basedir: Base directory of the mail storage.
+ *              blob_name: Name of the blob, as returned by blob_store.
+ *              path: Buffer with at least PATH_MAX bytes where the
+ *                    path will be stored.
+ */
+void blob_path(const char *basedir, const char *blob_name, char *path) {
+  snprintf(path, PATH_MAX, "%s/" BLOB_DIRECTORY "/%s", basedir, blob_name);
+}
+
+/** Internal function that checks if an existing blob has exactly the
+ *  same contents as an open file. Used to rule out hash collisions
+ *  before sharing a blob.
+ */
+static int same_contents(int fd, off_t size, const char *path) {
+
+  char buf1[BLOB_READ_CHUNK], buf2[BLOB_READ_CHUNK];
+  struct stat st;
+  int rv = 0;
+
+  int blob_fd = open(path, O_RDONLY);
+  if (blob_fd < 0) return 0;
+
+  if (fstat(blob_fd, &st) == 0 && st.st_size == size) {
+    off_t offset = 0;
+    ssize_t n1, n2;
+    rv = 1;
+    while (rv && (n1 = pread(fd, buf1, sizeof(buf1), offset)) > 0) {
+      n2 = pread(blob_fd, buf2, n1, offset);
+      rv = n2 == n1 && !memcmp(buf1, buf2, n1);
+      offset += n1;
+    }
+  }
+
+  close(blob_fd);
+  return rv;
+}
+
+/** Internal function that copies a file into a new temporary file in
+ *  a directory. Used when the source file is in a different file
+ *  system than the blob directory, so it cannot be hard-linked.
+ *
+ *  Returns: zero on success, -1 on failure.
+ */
+static int copy_to_directory(int fd, const char *dir, char *tmp) {
+
+  char buf[BLOB_READ_CHUNK];
+  off_t offset = 0;
+  ssize_t rv;
+
+  if (snprintf(tmp, PATH_MAX, "%s/.tmpXXXXXX", dir) >= PATH_MAX) {
+    tmp[0] = 0;
+    return -1;
+  }
+  int tmp_fd = mkstemp(tmp);
+  if (tmp_fd < 0) return -1;
+
+  while ((rv = pread(fd, buf, sizeof(buf), offset)) > 0) {
+    if (write(tmp_fd, buf, rv) != rv) {
+      rv = -1;
+      break;
+    }
+    offset += rv;
+  }
+
+  close(tmp_fd);
+  if (rv < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/** Stores the contents of a file in the blob store. If a blob with
+ *  identical contents already exists, it is reused and no data is
+ *  written; otherwise the file is hard-linked (or, if it is in a
+ *  different file system, copied) into the blob directory. The
+ *  source file is not modified and may be removed by the caller
+ *  after mailbox links have been created.
+ *
+ *  Parameters: basedir: Base directory of the mail storage.
+ *              basefile: Name of the file with the message contents.
+ *              blob_name: Buffer where the name of the blob will be
+ *                         stored.
+ *
+ *  Returns: zero on success, -1 if the blob could not be stored.
+ */
+int blob_store(const char *basedir, const char *basefile, char blob_name[BLOB_NAME_MAX]) {
+
+  char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX] = "";
+  const char *source = basefile;
+  struct stat st;
+  int rv = -1;
+
+  int fd = open(basefile, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  uint64_t hash = blob_hash_file(fd);
+
+  // Create blob directory if it doesn't exist yet (error ignored)
+  snprintf(dir, sizeof(dir), "%s/" BLOB_DIRECTORY, basedir);
+  mkdir(dir, 0777);
+
+  for (int n = 0; n < BLOB_MAX_COLLISIONS; n++) {
+
+    if (n)
+      snprintf(blob_name, BLOB_NAME_MAX, "%016llx-%d", (unsigned long long) hash, n);
+    else
+      snprintf(blob_name, BLOB_NAME_MAX, "%016llx", (unsigned long long) hash);
+    blob_path(basedir, blob_name, path);
+
+    if (link(source, path) == 0) {
+      rv = 0;
+      break;
+    }
+
+    // Source file in another file system, copy it next to the blobs and retry
+    if (errno == EXDEV && !tmp[0]) {
+      if (copy_to_directory(fd, dir, tmp) < 0) break;
+      source = tmp;
+      n--;
+      continue;
+    }
+
+    if (errno != EEXIST) break;
+
+    // Same hash: share the existing blob, unless this is a collision
+    if (same_contents(fd, st.st_size, path)) {
+      rv = 0;
+      break;
+    }
+  }
+
+  if (tmp[0]) unlink(tmp);
+  close(fd);
+  return rv;
+}
+
+/** Drops a reference to a blob. Should be called after a mailbox link
+ *  to the blob has been removed. If no mailbox refers to the blob any
+ *  longer, the blob itself is removed.
+ *
+ *  Parameters: basedir: Base directory of the mail storage.
+ *              blob_name: Name of the blob, as returned by blob_store.
+ */
+void blob_release(const char *basedir, const char *blob_name) {
+
+  char path[PATH_MAX];
+  struct stat st;
+
+  blob_path(basedir, blob_name, path);
+  if (stat(path, &st) == 0 && st.st_nlink == 1)
+    unlink(path);
+}
@@ -0,0 +1,18 @@
+/* blobstore.h
+ * Content-addressed, single-instance storage for message bodies.
+ */
+
+#ifndef _BLOBSTORE_H_
+#define _BLOBSTORE_H_
+
+#include <stdint.h>
+
+#define BLOB_DIRECTORY ".blobs"
+#define BLOB_NAME_MAX 32
+
+uint64_t blob_hash_file(int fd);
+int blob_store(const char *basedir, const char *basefile, char blob_name[BLOB_NAME_MAX]);
+void blob_path(const char *basedir, const char *blob_name, char *path);
+void blob_release(const char *basedir, const char *blob_name);
+
+#endif
@@ -0,0 +1,208 @@
+/* changelog.c
+ * Ordered log of changes to the mailboxes, shipped to a standby.
+ *
+ * Notes: When replication is enabled (MAIL_REPLICA_HOST is set), every
+ * message delivered to local mailboxes and every mailbox file removed
+ * is recorded in a change log in the mail storage, which the shipper
+ * (see replica.c) streams to a standby server. Records are lines of
+ * text with the kind of change, the time it was made and its details,
+ * each appended with a single write to a file opened in append mode;
+ * their order in the file is the order in which the standby applies
+ * them, and the offset after a record identifies the state of the
+ * storage once it has been applied.
+ *
+ * A delivery is recorded before its first mailbox link is created,
+ * so a client removing the message always finds it recorded before
+ * its own change; recipients the message could not be delivered to
+ * are recorded as removed afterwards. Records the standby has applied
+ * are punched out of the file (see changelog_trim); the header holds
+ * the offset of the first record left, and a random identifier of the
+ * log, so a standby never applies records of another server.
+ */
+
+#define _GNU_SOURCE
+
+#include "changelog.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define CHANGELOG_MAGIC 0x474f4c45474e4843ULL
+
+/** Returns non-zero if changes are recorded for a standby (i.e.,
+ *  MAIL_REPLICA_HOST is set).
+ */
+int changelog_enabled(void) {
+  return config_string("MAIL_REPLICA_HOST", NULL) != NULL;
+}
+
+/** Internal function that returns the current time in milliseconds.
+ */
+static uint64_t now_ms(void) {
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/** Internal function that opens the change log, creating it if it
+ *  doesn't exist yet, and maps its header into memory. The descriptor
+ *  (open for appending) and the mapping are kept for the lifetime of
+ *  the process (and inherited by forked children).
+ *
+ *  Returns: the header, or NULL if the log cannot be opened.
+ */
+static struct changelog_header *open_log(int *log_fd) {
+
+  static struct changelog_header *header = NULL;
+  static int fd = -1;
+  static int failed = 0;
+  struct changelog_header initial;
+
+  *log_fd = fd;
+  if (header || failed) return header;
+  failed = 1;
+
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  int setup_fd = open(CHANGELOG_FILE_NAME, O_RDWR | O_CREAT, 0666);
+  if (setup_fd < 0) return NULL;
+
+  // Serialize creation between processes starting at the same time
+  flock(setup_fd, LOCK_EX);
+  if (pread(setup_fd, &initial, sizeof(initial), 0) != sizeof(initial) ||
+      initial.magic != CHANGELOG_MAGIC) {
+    initial = (struct changelog_header) {
+      .magic = CHANGELOG_MAGIC,
+      .log_id = (now_ms() << 20 ^ (uint64_t) getpid() << 4 ^ (uint64_t) random()) | 1,
+      .start = CHANGELOG_HEADER_SIZE,
+      .acked = CHANGELOG_HEADER_SIZE
+    };
+    if (ftruncate(setup_fd, 0) < 0 || ftruncate(setup_fd, CHANGELOG_HEADER_SIZE) < 0 ||
+	pwrite(setup_fd, &initial, sizeof(initial), 0) != sizeof(initial)) {
+      close(setup_fd);
+      return NULL;
+    }
+  }
+
+  void *map = mmap(NULL, CHANGELOG_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, setup_fd, 0);
+  fd = open(CHANGELOG_FILE_NAME, O_RDWR | O_APPEND);
+  flock(setup_fd, LOCK_UN);
+  close(setup_fd);
+
+  if (map == MAP_FAILED || fd < 0) {
+    if (map != MAP_FAILED) munmap(map, CHANGELOG_HEADER_SIZE);
+    if (fd >= 0) close(fd);
+    fd = -1;
+    return NULL;
+  }
+
+  header = map;
+  failed = 0;
+  *log_fd = fd;
+  return header;
+}
+
+/** Internal function that appends a record to the change log with a
+ *  single write. A record only partly written (e.g., if the disk is
+ *  full) is terminated, so it doesn't swallow the next record.
+ */
+static void append_record(const char *record, size_t length) {
+
+  int fd;
+  if (!open_log(&fd)) return;
+
+  ssize_t rv = write(fd, record, length);
+  if (rv > 0 && rv != length)
+    rv = write(fd, "\n", 1);
+}
+
+/** Records that a message is about to be delivered to a list of
+ *  recipients, if replication is enabled (see save_user_mail).
+ *
+ *  Parameters: uid: Unique ID of the message.
+ *              blob_name: Name of the message blob.
+ *              info: Message information, as returned by spool_info.
+ *              users: List of recipients.
+ */
+void changelog_delivery(const char *uid, const char *blob_name, const char *info, user_list_t users) {
+
+  if (!changelog_enabled()) return;
+
+  size_t length = 32 + strlen(uid) + strlen(blob_name) + strlen(info);
+  for (user_list_t user = users; user; user = get_next_user(user))
+    length += strlen(get_user_name(user)) + 1;
+
+  char *record = malloc(length);
+  if (!record) return;
+
+  char *p = record + sprintf(record, "%c %llu %s %s %s", CHANGELOG_DELIVERY,
+			     (unsigned long long) now_ms(), uid, blob_name, info);
+  for (user_list_t user = users; user; user = get_next_user(user))
+    p += sprintf(p, " %s", get_user_name(user));
+  *p++ = '\n';
+
+  append_record(record, p - record);
+  free(record);
+}
+
+/** Records that a file was removed from a mailbox, if replication is
+ *  enabled (see destroy_mail_list).
+ *
+ *  Parameters: username: Owner of the mailbox.
+ *              file_name: Name of the file in the mailbox directory.
+ */
+void changelog_expunge(const char *username, const char *file_name) {
+
+  if (!changelog_enabled()) return;
+
+  char record[PATH_MAX + 64];
+  int n = snprintf(record, sizeof(record), "%c %llu %s %s\n", CHANGELOG_EXPUNGE,
+		   (unsigned long long) now_ms(), username, file_name);
+  if (n < sizeof(record))
+    append_record(record, n);
+}
+
+/** Returns the header of the change log, creating the log if needed.
+ *  Records can be read from the descriptor with pread, between the
+ *  start position in the header and the end of the file.
+ *
+ *  Parameters: fd: Receives a descriptor of the change log.
+ *
+ *  Returns: the header, mapped in shared memory, or NULL if the log
+ *           cannot be opened.
+ */
+struct changelog_header *changelog_header(int *fd) {
+  return open_log(fd);
+}
+
+/** Drops the records before a position (which must be the end of a
+ *  record), once they are no longer needed by the standby. Their
+ *  space is punched out of the file, so the log uses little disk
+ *  space even though its offsets only grow.
+ *
+ *  Parameters: position: Offset of the first record to be kept.
+ */
+void changelog_trim(uint64_t position) {
+
+  int fd;
+  struct changelog_header *header = open_log(&fd);
+  if (!header || position <= header->start) return;
+
+  __atomic_store_n(&header->start, position, __ATOMIC_RELEASE);
+
+  // Failure just wastes space
+  uint64_t hole_end = position & ~(uint64_t) (CHANGELOG_HEADER_SIZE - 1);
+  if (hole_end > CHANGELOG_HEADER_SIZE)
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, CHANGELOG_HEADER_SIZE,
+	      hole_end - CHANGELOG_HEADER_SIZE);
+}
@@ -0,0 +1,42 @@
+/* changelog.h
+ * Ordered log of changes to the mailboxes, shipped to a standby.
+ */
+
+#ifndef _CHANGELOG_H_
+#define _CHANGELOG_H_
+
+#include "mailuser.h"
+
+#include <stdint.h>
+
+// Kinds of records: a message delivered to a list of recipients (the
+// message ID, blob name, message information and recipients follow
+// the time), or a mailbox file removed (user and file name follow)
+#define CHANGELOG_DELIVERY 'D'
+#define CHANGELOG_EXPUNGE  'X'
+
+#define CHANGELOG_FILE_NAME MAIL_BASE_DIRECTORY "/.changelog"
+#define CHANGELOG_HEADER_SIZE 4096
+
+// Header of the change log, also holding the state of the shipper
+// (see replica.c); positions are offsets in the log
+struct changelog_header {
+  uint64_t magic;
+  uint64_t log_id;
+  uint64_t start;
+  uint64_t acked;
+  uint64_t acked_at_ms;
+  uint64_t last_lag_ms;
+  uint64_t max_lag_ms;
+  uint64_t batches;
+  uint64_t records;
+  uint64_t connected;
+};
+
+int changelog_enabled(void);
+void changelog_delivery(const char *uid, const char *blob_name, const char *info, user_list_t users);
+void changelog_expunge(const char *username, const char *file_name);
+struct changelog_header *changelog_header(int *fd);
+void changelog_trim(uint64_t position);
+
+#endif
@@ -0,0 +1,43 @@
+/* config.c
+ * Reads run-time settings for the mail servers from the environment.
+ *
+ * Notes: Settings are plain environment variables (e.g.,
+ * MAIL_COMPRESS=0), so they are inherited by forked children and
+ * can be set per process by whatever starts the servers.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+/** Returns the integer value of a setting.
+ *
+ *  Parameters: name: Name of the environment variable.
+ *              default_value: Value used if the variable is not set
+ *                             or is not a valid integer.
+ *
+ *  Returns: Value of the setting.
+ */
+long config_long(const char *name, long default_value) {
+
+  const char *value = getenv(name);
+  char *end;
+
+  if (!value || !*value) return default_value;
+  long rv = strtol(value, &end, 0);
+  return *end ? default_value : rv;
+}
+
+/** Returns the string value of a setting.
+ *
+ *  Parameters: name: Name of the environment variable.
+ *              default_value: Value used if the variable is not set
+ *                             or is empty.
+ *
+ *  Returns: Value of the setting. Should not be modified by the caller.
+ */
+const char *config_string(const char *name, const char *default_value) {
+
+  const char *value = getenv(name);
+  return value && *value ? value : default_value;
+}
@@ -0,0 +1,11 @@
+/* config.h
+ * Reads run-time settings for the mail servers from the environment.
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+long config_long(const char *name, long default_value);
+const char *config_string(const char *name, const char *default_value);
+
+#endif
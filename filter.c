@@ -0,0 +1,396 @@
+/* filter.c
+ * Content filters applied to received messages before delivery.
+ *
+ * Notes: Filters are plain C functions listed in the table below; a
+ * new one only needs a check function (see struct filter in
+ * filter.h) and an entry in the table. MAIL_FILTERS selects which
+ * filters run, as a comma-separated list of names (all of them by
+ * default), and MAIL_FILTER_MODE when:
+ *
+ *  - "reply" (default): in the SMTP session, before the reply to
+ *    DATA, so rejected messages are refused to the client, at the
+ *    cost of making the client wait for the filters;
+ *  - "queue": in the delivery workers (see queue.c), which filter
+ *    each batch of queued messages before delivering them, so
+ *    sessions don't wait; since the client was already told the
+ *    message was accepted, rejected messages are kept in the
+ *    quarantine directory (see filter_quarantine) instead of being
+ *    delivered;
+ *  - "off": not at all.
+ *
+ * Every message rejected or deferred is logged to standard error,
+ * with the filter and its reason.
+ *
+ * The spool file is mapped into memory, so filters scan the message
+ * where it is instead of copying it. Compressed messages (see
+ * spool.c) are inflated into memory first.
+ *
+ * Built-in filters:
+ *
+ *  - header: rejects messages whose header has NUL bytes, more than
+ *    MAIL_FILTER_MAX_HOPS (50) Received lines, a sign of a mail loop,
+ *    or lines longer than MAIL_FILTER_MAX_HEADER_LINE characters
+ *    (zero, the default, for no limit: the 998 allowed by RFC 5322
+ *    are often exceeded by real mail);
+ *  - size: rejects messages larger than MAIL_FILTER_MAX_BYTES (zero,
+ *    the default, for no limit);
+ *  - rules: applies the rules in the file named by MAIL_FILTER_RULES
+ *    (filter.rules), one per line: "reject" or "tempfail", then where
+ *    to look ("header", "body" or "message"), then the text to look
+ *    for, which is matched ignoring case. Empty lines and lines
+ *    starting with # are ignored.
+ */
+
+#include "filter.h"
+#include "spool.h"
+#include "config.h"
+#include "mailuser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define FILTER_MAX_RULES 256
+
+#define RULE_HEADER  1
+#define RULE_BODY    2
+#define RULE_MESSAGE (RULE_HEADER | RULE_BODY)
+
+struct filter_rule {
+  int action;
+  int where;
+  size_t length;
+  char *text;
+};
+
+static int header_check(const struct filter_message *message, struct filter_verdict *verdict);
+static int size_check(const struct filter_message *message, struct filter_verdict *verdict);
+static int rules_init(void);
+static int rules_check(const struct filter_message *message, struct filter_verdict *verdict);
+
+static const struct filter filters[] = {
+  { "header", NULL, header_check },
+  { "size", NULL, size_check },
+  { "rules", rules_init, rules_check },
+};
+
+#define FILTER_COUNT (sizeof(filters) / sizeof(filters[0]))
+
+// Filters enabled in this process, set up on first use (see load_filters)
+static const struct filter *enabled[FILTER_COUNT];
+static int enabled_count = -1;
+
+// Rules of the rules filter, loaded once per process
+static struct filter_rule rules[FILTER_MAX_RULES];
+static int rule_count = 0;
+
+/** Returns when messages are filtered, as set by MAIL_FILTER_MODE:
+ *  FILTER_MODE_REPLY, FILTER_MODE_QUEUE or FILTER_MODE_OFF.
+ */
+int filter_mode(void) {
+
+  const char *mode = config_string("MAIL_FILTER_MODE", "reply");
+  if (!strcmp(mode, "queue")) return FILTER_MODE_QUEUE;
+  if (!strcmp(mode, "off")) return FILTER_MODE_OFF;
+  return FILTER_MODE_REPLY;
+}
+
+/** Internal function that sets the reason of a verdict and returns
+ *  its action, so filters can do both in their return statement.
+ */
+static int verdict_of(struct filter_verdict *verdict, int action, const char *reason) {
+
+  snprintf(verdict->reason, sizeof(verdict->reason), "%s", reason);
+  return action;
+}
+
+/** Internal function that finds text in a memory area, ignoring case.
+ *  The text must be lowercase.
+ *
+ *  Returns: non-zero if the text is found.
+ */
+static int contains(const char *data, size_t size, const char *text, size_t length) {
+
+  if (length == 0) return 1;
+  if (length > size) return 0;
+
+  // Candidates are found by their first character, in either case; each
+  // case is searched for again only once the previous one is passed
+  const char *end = data + size - length + 1;
+  int chars[2] = { (unsigned char) text[0], toupper((unsigned char) text[0]) };
+  const char *next[2] = { NULL, chars[1] != chars[0] ? NULL : end };
+
+  for (const char *p = data; p < end; ) {
+    for (int k = 0; k < 2; k++)
+      if (next[k] != end && (!next[k] || next[k] < p))
+	if (!(next[k] = memchr(p, chars[k], end - p)))
+	  next[k] = end;
+
+    const char *candidate = next[0] < next[1] ? next[0] : next[1];
+    if (candidate == end) return 0;
+    if (!strncasecmp(candidate, text, length)) return 1;
+    p = candidate + 1;
+  }
+  return 0;
+}
+
+/** Internal function implementing the header filter.
+ */
+static int header_check(const struct filter_message *message, struct filter_verdict *verdict) {
+
+  const char *data = message->data, *end = data + message->header_size;
+  long max_hops = config_long("MAIL_FILTER_MAX_HOPS", 50);
+  long max_line = config_long("MAIL_FILTER_MAX_HEADER_LINE", 0);
+  long hops = 0;
+
+  if (memchr(data, 0, message->header_size))
+    return verdict_of(verdict, FILTER_REJECT, "Message header contains NUL characters");
+
+  for (const char *line = data; line < end; ) {
+    const char *eol = memchr(line, '\n', end - line);
+    size_t length = (eol ? eol : end) - line;
+    if (max_line > 0 && length > max_line + 1)
+      return verdict_of(verdict, FILTER_REJECT, "Message header line too long");
+    if (length >= 9 && !strncasecmp(line, "Received:", 9) && ++hops > max_hops)
+      return verdict_of(verdict, FILTER_REJECT, "Too many hops, possible mail loop");
+    line = eol ? eol + 1 : end;
+  }
+  return FILTER_ACCEPT;
+}
+
+/** Internal function implementing the size filter.
+ */
+static int size_check(const struct filter_message *message, struct filter_verdict *verdict) {
+
+  long max_bytes = config_long("MAIL_FILTER_MAX_BYTES", 0);
+  if (max_bytes > 0 && message->size > max_bytes)
+    return verdict_of(verdict, FILTER_REJECT, "Message exceeds fixed maximum message size");
+  return FILTER_ACCEPT;
+}
+
+/** Internal function that loads the rules of the rules filter.
+ *
+ *  Returns: zero if rules were loaded, -1 if there are none (which
+ *           disables the filter).
+ */
+static int rules_init(void) {
+
+  char line[1024], action[16], where[16];
+  int offset;
+
+  FILE *file = fopen(config_string("MAIL_FILTER_RULES", "filter.rules"), "r");
+  if (!file) return -1;
+
+  while (rule_count < FILTER_MAX_RULES && fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (line[0] == '#' || sscanf(line, "%15s %15s %n", action, where, &offset) != 2 || !line[offset])
+      continue;
+
+    struct filter_rule *rule = &rules[rule_count];
+    rule->action = !strcmp(action, "reject") ? FILTER_REJECT :
+      !strcmp(action, "tempfail") ? FILTER_TEMPFAIL : FILTER_ACCEPT;
+    rule->where = !strcmp(where, "header") ? RULE_HEADER :
+      !strcmp(where, "body") ? RULE_BODY : !strcmp(where, "message") ? RULE_MESSAGE : 0;
+    if (rule->action == FILTER_ACCEPT || !rule->where || !(rule->text = strdup(line + offset)))
+      continue;
+
+    for (char *p = rule->text; *p; p++)
+      *p = tolower((unsigned char) *p);
+    rule->length = strlen(rule->text);
+    rule_count++;
+  }
+
+  fclose(file);
+  return rule_count ? 0 : -1;
+}
+
+/** Internal function implementing the rules filter. Rules are applied
+ *  in order, and the first one that matches decides.
+ */
+static int rules_check(const struct filter_message *message, struct filter_verdict *verdict) {
+
+  const char *body = message->data + message->header_size;
+  size_t body_size = message->size - message->header_size;
+
+  for (int i = 0; i < rule_count; i++) {
+    struct filter_rule *rule = &rules[i];
+    if (((rule->where & RULE_HEADER) &&
+	 contains(message->data, message->header_size, rule->text, rule->length)) ||
+	((rule->where & RULE_BODY) && contains(body, body_size, rule->text, rule->length)))
+      return verdict_of(verdict, rule->action, rule->action == FILTER_REJECT ?
+			"Message content rejected" : "Message content deferred, try again later");
+  }
+  return FILTER_ACCEPT;
+}
+
+/** Internal function that sets up the filters enabled by MAIL_FILTERS
+ *  in this process, calling their init functions.
+ */
+static void load_filters(void) {
+
+  const char *names = config_string("MAIL_FILTERS", NULL);
+
+  enabled_count = 0;
+  for (int i = 0; i < FILTER_COUNT; i++) {
+    size_t length = strlen(filters[i].name);
+    int selected = !names;
+    for (const char *p = names; p && *p; p += strcspn(p, ",")) {
+      p += *p == ',';
+      if (!strncmp(p, filters[i].name, length) && (p[length] == ',' || !p[length]))
+	selected = 1;
+    }
+    if (selected && (!filters[i].init || filters[i].init() == 0))
+      enabled[enabled_count++] = &filters[i];
+  }
+}
+
+/** Internal function that inflates a compressed spool file into
+ *  memory, since a compressed message cannot be scanned in place.
+ *
+ *  Returns: the message, to be freed by the caller, or NULL on error.
+ */
+static char *inflate_message(int fd, size_t size) {
+
+  char *data = malloc(size ? size : 1);
+  gzFile gz = data ? gzdopen(dup(fd), "rb") : NULL;
+  size_t got = 0;
+  int rv = 0;
+
+  while (gz && got < size && (rv = gzread(gz, data + got, size - got)) > 0)
+    got += rv;
+  if (gz) gzclose(gz);
+
+  if (got != size) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+/** Runs the enabled filters on a received message, until one of them
+ *  doesn't accept it.
+ *
+ *  Parameters: file_name: Spool file of the message.
+ *              info: Message information (see spool_info).
+ *              verdict: Receives the verdict, and the reason given by
+ *                       the filter that didn't accept the message.
+ *
+ *  Returns: The verdict: FILTER_ACCEPT, FILTER_TEMPFAIL (including if
+ *           the message cannot be read) or FILTER_REJECT.
+ */
+int filter_message(const char *file_name, const char *info, struct filter_verdict *verdict) {
+
+  struct filter_message message;
+  struct stat st;
+  void *map = MAP_FAILED;
+  char *copy = NULL;
+
+  verdict->action = FILTER_ACCEPT;
+  verdict->reason[0] = 0;
+
+  if (enabled_count < 0)
+    load_filters();
+  if (enabled_count == 0)
+    return FILTER_ACCEPT;
+
+  const char *size_field = strstr(info, SPOOL_INFO_SIZE);
+  const char *header_field = strstr(info, SPOOL_INFO_HEADER_SIZE);
+  message.size = size_field ? strtoull(size_field + strlen(SPOOL_INFO_SIZE), NULL, 10) : 0;
+  message.header_size = header_field ? strtoull(header_field + strlen(SPOOL_INFO_HEADER_SIZE), NULL, 10) : 0;
+
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) close(fd);
+    verdict->action = verdict_of(verdict, FILTER_TEMPFAIL, "Unable to read message");
+    return verdict->action;
+  }
+
+  if (strstr(info, SPOOL_INFO_COMPRESSED)) {
+    message.data = copy = inflate_message(fd, message.size);
+  } else {
+    message.size = st.st_size;
+    map = message.size ? mmap(NULL, message.size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    message.data = map != MAP_FAILED ? map : message.size ? NULL : "";
+    if (map != MAP_FAILED)
+      madvise(map, message.size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  if (!message.data) {
+    verdict->action = verdict_of(verdict, FILTER_TEMPFAIL, "Unable to read message");
+    return verdict->action;
+  }
+  if (message.header_size > message.size)
+    message.header_size = message.size;
+
+  for (int i = 0; i < enabled_count && verdict->action == FILTER_ACCEPT; i++) {
+    verdict->action = enabled[i]->check(&message, verdict);
+    if (verdict->action != FILTER_ACCEPT && !verdict->reason[0])
+      verdict_of(verdict, verdict->action, verdict->action == FILTER_REJECT ?
+		 "Message rejected by content filter" : "Message deferred by content filter");
+    if (verdict->action != FILTER_ACCEPT)
+      fprintf(stderr, "filter[%d]: %s %s by %s filter: %s\n", (int) getpid(), file_name,
+	      verdict->action == FILTER_REJECT ? "rejected" : "deferred", enabled[i]->name, verdict->reason);
+  }
+
+  if (map != MAP_FAILED)
+    munmap(map, message.size);
+  free(copy);
+  return verdict->action;
+}
+
+/** Keeps a message rejected by the filters after the client was told
+ *  it was accepted (i.e., in the delivery workers), so it is not lost
+ *  if the filters were wrong. The message file is linked into the
+ *  quarantine directory as <id>.msg, next to <id>.txt, which holds the
+ *  reason, the message information and the recipients; a message is
+ *  released by hand, or removed once it has been looked at.
+ *
+ *  Parameters: file_name: File of the message (e.g., a queue entry).
+ *              info: Message information (see spool_info).
+ *              verdict: Verdict of the filters.
+ *              users: Recipients the message was for.
+ *
+ *  Returns: zero on success, -1 if the message could not be kept.
+ */
+int filter_quarantine(const char *file_name, const char *info, const struct filter_verdict *verdict,
+		      user_list_t users) {
+
+  static unsigned int counter = 0;
+  char id[64], message[PATH_MAX], details[PATH_MAX];
+
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  mkdir(FILTER_QUARANTINE_DIRECTORY, 0777);
+
+  snprintf(id, sizeof(id), "%lx-%x-%x", (unsigned long) time(NULL), (unsigned int) getpid(), counter++);
+  snprintf(message, sizeof(message), FILTER_QUARANTINE_DIRECTORY "/%s.msg", id);
+  snprintf(details, sizeof(details), FILTER_QUARANTINE_DIRECTORY "/%s.txt", id);
+  if (link(file_name, message) < 0)
+    return -1;
+
+  FILE *file = fopen(details, "w");
+  if (!file) {
+    unlink(message);
+    return -1;
+  }
+  fprintf(file, "%s\n%s\n", verdict->reason, info);
+  for (user_list_t user = users; user; user = get_next_user(user))
+    fprintf(file, "%s\n", get_user_name(user));
+  if (fclose(file) != 0) {
+    unlink(details);
+    unlink(message);
+    return -1;
+  }
+
+  fprintf(stderr, "filter[%d]: %s quarantined as %s\n", (int) getpid(), file_name, id);
+  return 0;
+}
@@ -0,0 +1,54 @@
+/* filter.h
+ * Content filters applied to received messages before delivery.
+ */
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include "mailuser.h"
+
+#include <stddef.h>
+
+// Verdicts of a filter
+#define FILTER_ACCEPT   0
+#define FILTER_TEMPFAIL 1
+#define FILTER_REJECT   2
+
+// When filters run (see filter_mode)
+#define FILTER_MODE_OFF   0
+#define FILTER_MODE_REPLY 1
+#define FILTER_MODE_QUEUE 2
+
+#define FILTER_REASON_MAX 128
+
+#define FILTER_QUARANTINE_DIRECTORY MAIL_BASE_DIRECTORY "/quarantine"
+
+// Message being filtered, as stored in its spool file (CRLF line
+// endings, dot-stuffed); data is read-only and not NUL-terminated
+struct filter_message {
+  const char *data;
+  size_t size;
+  size_t header_size;
+};
+
+struct filter_verdict {
+  int action;
+  char reason[FILTER_REASON_MAX];
+};
+
+// A filter: init is called once per process before the first message
+// (and may be NULL); a negative return disables the filter. check
+// returns one of the verdicts above and, unless accepting, may set a
+// reason to be sent to the client.
+struct filter {
+  const char *name;
+  int (*init)(void);
+  int (*check)(const struct filter_message *message, struct filter_verdict *verdict);
+};
+
+int filter_mode(void);
+int filter_message(const char *file_name, const char *info, struct filter_verdict *verdict);
+int filter_quarantine(const char *file_name, const char *info, const struct filter_verdict *verdict,
+		      user_list_t users);
+
+#endif
@@ -0,0 +1,429 @@
+/* journal.c
+ * Write-ahead journal of deliveries to local mailboxes.
+ *
+ * Notes: Before a message is linked into its recipients' mailboxes,
+ * a begin record naming the delivering process (its ID and start
+ * time, so a process ID reused after a restart is not mistaken for
+ * the one that began the delivery), the message ID, the
+ * blob, the message information and the recipients is appended to a
+ * journal file in the mail storage; once all links and usage counters
+ * are in place, an end record with the message ID follows. Records
+ * are lines of text, each appended with a single write to a file
+ * opened in append mode, so records of concurrent deliveries never
+ * interleave. Records are only forced to disk if MAIL_JOURNAL_SYNC is
+ * set, since the failures guarded against are crashes of server
+ * processes, not of the machine.
+ *
+ * The journal header holds a checkpoint: the offset before which
+ * every delivery has ended. Recovery reads only the records after it,
+ * and undoes deliveries whose process is gone without having ended
+ * them (see journal_recover); their clients were never told the
+ * message was accepted, so it will be sent (or taken from the queue)
+ * again. The work done on restart depends on the number of deliveries
+ * in progress at the time of the crash, not on the size of the
+ * storage. Whenever the records after the checkpoint grow past
+ * MAIL_JOURNAL_COMPACT_BYTES, the process ending a delivery moves the
+ * checkpoint forward and punches the space before it out of the file,
+ * so the journal uses little disk space even though its offsets only
+ * grow.
+ */
+
+#define _GNU_SOURCE
+
+#include "journal.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define JOURNAL_FILE_NAME MAIL_BASE_DIRECTORY "/.journal"
+#define JOURNAL_MAGIC 0x4c414e52554f4a4cULL
+#define JOURNAL_HEADER_SIZE 4096
+#define JOURNAL_DEFAULT_COMPACT_BYTES (1 << 20)
+
+#define JOURNAL_BEGIN 'B'
+#define JOURNAL_END   'E'
+
+struct journal_header {
+  uint64_t magic;
+  uint64_t checkpoint;
+};
+
+// A delivery found without its end record while reading the journal
+struct journal_pending {
+  size_t offset;
+  size_t length;
+  int dead;
+};
+
+struct journal_scan {
+  char *data;
+  size_t start;
+  size_t size;
+  struct journal_pending *pending;
+  size_t count;
+  size_t capacity;
+};
+
+/** Internal function that returns the start time of a process, in
+ *  clock ticks since the system booted (field 22 of /proc/<pid>/stat).
+ *
+ *  Returns: the start time, or zero if it cannot be read (e.g., the
+ *           process is gone, or the system has no /proc).
+ */
+static unsigned long long process_start_time(int pid) {
+
+  char path[64], buf[1024];
+  unsigned long long start = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return 0;
+  buf[n] = 0;
+
+  // Process name (field 2) may contain spaces and parentheses, so fields are counted from its end
+  char *p = strrchr(buf, ')');
+  if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+		   &start) != 1)
+    return 0;
+  return start;
+}
+
+/** Internal function that checks if the process named in a begin
+ *  record ("pid/start", or just the ID in older records) is gone.
+ */
+static int process_gone(const char *process) {
+
+  char *end;
+  int pid = strtol(process, &end, 10);
+  if (pid <= 0) return 0;
+  if (kill(pid, 0) < 0 && errno == ESRCH) return 1;
+
+  // Same ID, but a different process started since
+  unsigned long long start = *end == '/' ? strtoull(end + 1, NULL, 10) : 0;
+  unsigned long long current = start ? process_start_time(pid) : 0;
+  return current && current != start;
+}
+
+/** Internal function that reads and checks the journal header.
+ *
+ *  Returns: zero on success, -1 if the header is missing or invalid.
+ */
+static int read_header(int fd, struct journal_header *header) {
+
+  return pread(fd, header, sizeof(*header), 0) == sizeof(*header) &&
+    header->magic == JOURNAL_MAGIC && header->checkpoint >= JOURNAL_HEADER_SIZE ? 0 : -1;
+}
+
+/** Internal function that opens the journal for appending, creating
+ *  it if it doesn't exist yet. The descriptor is kept for the lifetime
+ *  of the process (and inherited by forked children).
+ *
+ *  Returns: the descriptor, or -1 if the journal cannot be opened.
+ */
+static int journal_fd(void) {
+
+  static int fd = -1;
+  static int failed = 0;
+  struct journal_header header;
+
+  if (fd >= 0 || failed) return fd;
+  failed = 1;
+
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  int setup_fd = open(JOURNAL_FILE_NAME, O_RDWR | O_CREAT, 0666);
+  if (setup_fd < 0) return -1;
+
+  // Serialize creation between processes starting at the same time
+  flock(setup_fd, LOCK_EX);
+  if (read_header(setup_fd, &header) < 0) {
+    header = (struct journal_header) { .magic = JOURNAL_MAGIC, .checkpoint = JOURNAL_HEADER_SIZE };
+    if (ftruncate(setup_fd, 0) < 0 || ftruncate(setup_fd, JOURNAL_HEADER_SIZE) < 0 ||
+	pwrite(setup_fd, &header, sizeof(header), 0) != sizeof(header)) {
+      close(setup_fd);
+      return -1;
+    }
+  }
+  fd = open(JOURNAL_FILE_NAME, O_RDWR | O_APPEND);
+  flock(setup_fd, LOCK_UN);
+  close(setup_fd);
+
+  if (fd >= 0) failed = 0;
+  return fd;
+}
+
+/** Internal function that appends a record to the journal with a
+ *  single write. A record only partly written (e.g., if the disk is
+ *  full) is terminated, so it doesn't swallow the next record.
+ *
+ *  Returns: zero on success, -1 on failure.
+ */
+static int append_record(const char *record, size_t length) {
+
+  int fd = journal_fd();
+  if (fd < 0) return -1;
+
+  ssize_t rv = write(fd, record, length);
+  if (rv != length) {
+    if (rv > 0 && write(fd, "\n", 1) < 0) return -1;
+    return -1;
+  }
+  if (config_long("MAIL_JOURNAL_SYNC", 0))
+    fdatasync(fd);
+  return 0;
+}
+
+/** Records that a message is about to be delivered to a list of
+ *  recipients (see save_user_mail). Must be followed by journal_end
+ *  once every link to the message is in place.
+ *
+ *  Parameters: uid: Unique ID of the message.
+ *              blob_name: Name of the message blob.
+ *              info: Message information, as returned by spool_info.
+ *              users: List of recipients.
+ *
+ *  Returns: zero on success, -1 if the record could not be written.
+ */
+int journal_begin(const char *uid, const char *blob_name, const char *info, user_list_t users) {
+
+  static unsigned long long start = 0;
+  if (!start) start = process_start_time(getpid());
+
+  size_t length = 64 + strlen(uid) + strlen(blob_name) + strlen(info);
+  for (user_list_t user = users; user; user = get_next_user(user))
+    length += strlen(get_user_name(user)) + 1;
+
+  char *record = malloc(length);
+  if (!record) return -1;
+
+  char *p = record + sprintf(record, "%c %d/%llu %s %s %s", JOURNAL_BEGIN, (int) getpid(),
+			     start, uid, blob_name, info);
+  for (user_list_t user = users; user; user = get_next_user(user))
+    p += sprintf(p, " %s", get_user_name(user));
+  *p++ = '\n';
+
+  int rv = append_record(record, p - record);
+  free(record);
+  return rv;
+}
+
+/** Internal function that appends an end record for a message.
+ */
+static void append_end(const char *uid, size_t uid_length) {
+
+  char record[256];
+  if (uid_length + 3 > sizeof(record)) return;
+
+  int n = sprintf(record, "%c %.*s\n", JOURNAL_END, (int) uid_length, uid);
+  append_record(record, n);
+}
+
+/** Internal function that returns the message ID field of a record,
+ *  and its length.
+ */
+static const char *record_uid(const char *record, size_t length, size_t *uid_length) {
+
+  const char *end = record + length, *uid = record + 2;
+
+  // Begin records have the process ID before the message ID
+  if (record[0] == JOURNAL_BEGIN) {
+    uid = memchr(uid, ' ', end - uid);
+    if (!uid) uid = end;
+    else uid++;
+  }
+  const char *uid_end = memchr(uid, ' ', end - uid);
+  if (!uid_end) uid_end = end;
+  *uid_length = uid_end - uid;
+  return uid;
+}
+
+/** Internal function that reads the records between two offsets into
+ *  the scan buffer, and keeps track of deliveries begun but not ended.
+ *  Only complete records are read.
+ *
+ *  Returns: zero on success, -1 on failure.
+ */
+static int scan_records(int fd, struct journal_scan *scan, size_t end) {
+
+  size_t from = scan->start + scan->size;
+  if (end <= from) return 0;
+
+  char *data = realloc(scan->data, end - scan->start);
+  if (!data) return -1;
+  scan->data = data;
+
+  ssize_t rv = pread(fd, data + scan->size, end - from, from);
+  if (rv < 0) return -1;
+
+  // A record still being written is left for the next scan
+  char *last = memrchr(data + scan->size, '\n', rv);
+  if (!last) return 0;
+  size_t size = last + 1 - data;
+
+  for (size_t pos = scan->size; pos < size; ) {
+    char *record = data + pos;
+    size_t length = (char *) memchr(record, '\n', size - pos) - record;
+
+    if (length > 2 && record[1] == ' ' && record[0] == JOURNAL_BEGIN) {
+      if (scan->count == scan->capacity) {
+	size_t capacity = scan->capacity ? 2 * scan->capacity : 64;
+	struct journal_pending *pending = realloc(scan->pending, capacity * sizeof(*pending));
+	if (!pending) return -1;
+	scan->pending = pending;
+	scan->capacity = capacity;
+      }
+      scan->pending[scan->count++] = (struct journal_pending) { .offset = pos, .length = length };
+
+    } else if (length > 2 && record[1] == ' ' && record[0] == JOURNAL_END) {
+      // Deliveries usually end soon after they begin, so the search starts from the newest
+      size_t uid_length, n;
+      const char *uid = record_uid(record, length, &uid_length);
+      for (size_t i = scan->count; i-- > 0; ) {
+	const char *pending = record_uid(data + scan->pending[i].offset, scan->pending[i].length, &n);
+	if (n == uid_length && !memcmp(pending, uid, n)) {
+	  memmove(&scan->pending[i], &scan->pending[i + 1], (scan->count - i - 1) * sizeof(*scan->pending));
+	  scan->count--;
+	  break;
+	}
+      }
+    }
+    pos += length + 1;
+  }
+
+  scan->size = size;
+  return 0;
+}
+
+/** Internal function that undoes a delivery whose process is gone,
+ *  and appends its end record.
+ */
+static void undo_delivery(char *record, size_t length, journal_undo_t undo) {
+
+  user_list_t users = NULL;
+  char *fields[5];
+  int n = 0;
+
+  record[length] = 0;
+  char *p = record;
+  while (n < 5 && (fields[n] = strsep(&p, " ")))
+    n++;
+  if (n < 5) return;
+
+  for (char *user; p && (user = strsep(&p, " ")); )
+    if (*user) add_user_to_list(&users, user, NULL);
+
+  undo(fields[2], fields[3], fields[4], users);
+  destroy_user_list(users);
+  append_end(fields[2], strlen(fields[2]));
+}
+
+/** Internal function that reads the journal from the checkpoint,
+ *  undoes the deliveries whose process is gone without ending them,
+ *  and moves the checkpoint to the oldest delivery still in progress.
+ *
+ *  Returns: number of deliveries undone, or -1 on failure (including
+ *           another process already doing the same, unless waiting).
+ */
+static int compact_journal(journal_undo_t undo, int wait) {
+
+  struct journal_header header;
+  struct journal_scan scan = { NULL };
+  struct stat st;
+  int undone = 0;
+
+  if (journal_fd() < 0) return -1;
+
+  // A descriptor of its own, so the lock is not shared with forked processes
+  int fd = open(JOURNAL_FILE_NAME, O_RDWR);
+  if (fd < 0) return -1;
+  if (flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) < 0 ||
+      read_header(fd, &header) < 0 || fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  scan.start = header.checkpoint;
+  if (scan_records(fd, &scan, st.st_size) < 0)
+    goto done;
+
+  // A process may end its delivery and exit after being read, so its end record is looked for again
+  for (size_t i = 0; i < scan.count; i++)
+    scan.pending[i].dead = process_gone(scan.data + scan.pending[i].offset + 2);
+  if (fstat(fd, &st) < 0 || scan_records(fd, &scan, st.st_size) < 0)
+    goto done;
+
+  size_t checkpoint = scan.start + scan.size;
+  for (size_t i = 0; i < scan.count; i++) {
+    if (scan.pending[i].dead) {
+      undo_delivery(scan.data + scan.pending[i].offset, scan.pending[i].length, undo);
+      undone++;
+    } else if (scan.start + scan.pending[i].offset < checkpoint) {
+      checkpoint = scan.start + scan.pending[i].offset;
+    }
+  }
+
+  header.checkpoint = checkpoint;
+  if (pwrite(fd, &header, sizeof(header), 0) == sizeof(header)) {
+    // Blocks before the checkpoint are not read again (failure just wastes space)
+    size_t hole_end = checkpoint & ~(size_t) (JOURNAL_HEADER_SIZE - 1);
+    if (hole_end > JOURNAL_HEADER_SIZE)
+      fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, JOURNAL_HEADER_SIZE,
+		hole_end - JOURNAL_HEADER_SIZE);
+  }
+
+ done:
+  free(scan.data);
+  free(scan.pending);
+  close(fd);
+  return undone;
+}
+
+/** Records that a message has been delivered to all its recipients
+ *  (see journal_begin). If the journal has grown enough since the
+ *  checkpoint, it is compacted; deliveries of processes that are gone
+ *  found while compacting are undone.
+ *
+ *  Parameters: uid: Unique ID of the message.
+ *              undo: Function that undoes a delivery.
+ */
+void journal_end(const char *uid, journal_undo_t undo) {
+
+  struct journal_header header;
+  struct stat st;
+
+  append_end(uid, strlen(uid));
+
+  int fd = journal_fd();
+  long limit = config_long("MAIL_JOURNAL_COMPACT_BYTES", JOURNAL_DEFAULT_COMPACT_BYTES);
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size - JOURNAL_HEADER_SIZE >= limit &&
+      read_header(fd, &header) == 0 && st.st_size - header.checkpoint >= limit)
+    compact_journal(undo, 0);
+}
+
+/** Recovers from a crash of delivering processes: reads the journal
+ *  from its checkpoint and undoes every delivery begun by a process
+ *  that is gone without ending it (see the notes at the top of the
+ *  file). Meant to be called when a server starts.
+ *
+ *  Parameters: undo: Function that undoes a delivery; it is given the
+ *                    message ID, blob name, message information and
+ *                    recipients of the delivery.
+ *
+ *  Returns: number of deliveries undone, or -1 if the journal could
+ *           not be read.
+ */
+int journal_recover(journal_undo_t undo) {
+  return compact_journal(undo, 1);
+}
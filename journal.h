@@ -0,0 +1,18 @@
+/* journal.h
+ * Write-ahead journal of deliveries to local mailboxes.
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "mailuser.h"
+
+// Undoes a delivery that was interrupted (see journal_recover)
+typedef void (*journal_undo_t)(const char *uid, const char *blob_name, const char *info,
+			       user_list_t users);
+
+int journal_begin(const char *uid, const char *blob_name, const char *info, user_list_t users);
+void journal_end(const char *uid, journal_undo_t undo);
+int journal_recover(journal_undo_t undo);
+
+#endif
@@ -0,0 +1,274 @@
+#include "mailuser.h"
+#include "shmcache.h"
+#include "rcptcache.h"
+#include "queue.h"
+#include "replica.h"
+#include "shard.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//mailadm performs maintenance on the mail storage, and is run from the same directory as the servers
+//it is safe to run while mysmtpd and mypopd are running
+
+static void usage(const char *name);
+static void printStats(const char *name, struct shmcache_stats *stats);
+static int printRebalance(shard_ring_t from, shard_ring_t to);
+
+int main(int argc, char *argv[]) {
+    
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    //==============================================================================================================
+    
+    //migrate: move mailboxes into the layout set by MAIL_STORE_LAYOUT (one user, or all users)
+    if (strcmp(argv[1], "migrate") == 0 && argc <= 3) {
+        int moved = argc == 3 ? migrate_user_mail(argv[2]) : migrate_mail_store();
+        if (moved < 0) {
+            fprintf(stderr, "%s: unable to create mailbox directory\n", argv[0]);
+            return 1;
+        }
+        printf("%d message(s) moved\n", moved);
+        return 0;
+    }
+    
+    //==============================================================================================================
+    
+    //reconcile: recompute mailbox usage counters from the mail storage (meant to be run periodically, e.g. from cron)
+    if (strcmp(argv[1], "reconcile") == 0 && argc <= 3) {
+        int fixed = argc == 3 ? reconcile_user_usage(argv[2]) : reconcile_mail_store();
+        if (fixed < 0) {
+            fprintf(stderr, "%s: unable to update usage counters\n", argv[0]);
+            return 1;
+        }
+        printf("%d user(s) corrected\n", fixed);
+        return 0;
+    }
+    
+    //==============================================================================================================
+    
+    //stats: print counters of the caches shared by the servers
+    if (strcmp(argv[1], "stats") == 0 && argc == 2) {
+        struct shmcache_stats stats;
+        
+        if (get_listing_cache_stats(&stats) < 0) {
+            printf("listing cache: disabled\n");
+        } else {
+            printStats("listing cache", &stats);
+        }
+        
+        if (get_message_cache_stats(&stats) < 0) {
+            printf("message cache: disabled\n");
+        } else {
+            printStats("message cache", &stats);
+        }
+        
+        struct rcptcache_stats rcpt;
+        if (get_recipient_cache_stats(&rcpt) < 0) {
+            printf("recipient cache: disabled\n");
+        } else {
+            unsigned long long lookups = rcpt.filter_rejects + rcpt.hits + rcpt.misses;
+            printf("recipient cache: %llu lookup(s), %llu rejected by filter, %llu hit(s), %llu miss(es), %.1f%% answered without the users file\n",
+                   lookups, (unsigned long long) rcpt.filter_rejects, (unsigned long long) rcpt.hits,
+                   (unsigned long long) rcpt.misses,
+                   lookups ? 100.0 * (rcpt.filter_rejects + rcpt.hits) / lookups : 0.0);
+            printf("recipient cache: %llu user(s) in a %llu-bit filter, %llu rebuild(s), %llu store(s), %llu eviction(s), %llu of %llu entries used\n",
+                   (unsigned long long) rcpt.users, (unsigned long long) rcpt.filter_bits,
+                   (unsigned long long) rcpt.rebuilds, (unsigned long long) rcpt.stores,
+                   (unsigned long long) rcpt.evictions, (unsigned long long) rcpt.entries_used,
+                   (unsigned long long) rcpt.entry_count);
+        }
+        return 0;
+    }
+    
+    //==============================================================================================================
+    
+    //queue: print the state of the delivery queue
+    if (strcmp(argv[1], "queue") == 0 && argc == 2) {
+        struct queue_stats stats;
+        
+        if (queue_stats(&stats) < 0) {
+            printf("queue: not found\n");
+            return 0;
+        }
+        
+        printf("queue: %llu message(s) waiting, %llu deferred, oldest queued %llu second(s) ago\n",
+               (unsigned long long) stats.depth, (unsigned long long) stats.deferred,
+               (unsigned long long) stats.oldest_age);
+        printf("queue: %llu delivered, %llu retried, %llu failed, %llu rejected by filters, delivery lag %.1f ms average, %llu ms max\n",
+               (unsigned long long) stats.delivered, (unsigned long long) stats.retries,
+               (unsigned long long) stats.failed, (unsigned long long) stats.rejected,
+               stats.delivered ? (double) stats.lag_total_ms / stats.delivered : 0.0,
+               (unsigned long long) stats.lag_max_ms);
+        return 0;
+    }
+    
+    //==============================================================================================================
+    
+    //recover: undo deliveries interrupted by a crash and remove leftover spool files (also done when mysmtpd starts)
+    if (strcmp(argv[1], "recover") == 0 && argc == 2) {
+        int recovered = recover_deliveries();
+        if (recovered < 0) {
+            fprintf(stderr, "%s: unable to read the delivery journal\n", argv[0]);
+            return 1;
+        }
+        printf("%d interrupted delivery(ies) and spool file(s) cleaned up\n", recovered);
+        return 0;
+    }
+    
+    //==============================================================================================================
+    
+    //replication: show the state of replication, on the primary (change log shipped to the standby) and on the standby
+    if (strcmp(argv[1], "replication") == 0 && argc == 2) {
+        struct replica_stats stats;
+        replica_stats(&stats);
+        if (!stats.shipping && stats.role == REPLICA_ROLE_NONE) {
+            printf("replication is not in use\n");
+            return 0;
+        }
+        if (stats.shipping) {
+            printf("primary: standby %s, %llu of %llu log bytes acknowledged (%llu behind)\n",
+                   stats.connected ? "connected" : "not connected", (unsigned long long) stats.acked,
+                   (unsigned long long) stats.log_end,
+                   (unsigned long long) (stats.log_end > stats.acked ? stats.log_end - stats.acked : 0));
+            printf("primary: %llu batch(es), %llu change(s) shipped, oldest unacknowledged change %llu ms old, last acknowledgement %llu ms ago\n",
+                   (unsigned long long) stats.batches, (unsigned long long) stats.records,
+                   (unsigned long long) stats.pending_age_ms, (unsigned long long) stats.acked_age_ms);
+            printf("primary: replication lag %llu ms last, %llu ms max\n",
+                   (unsigned long long) stats.last_lag_ms, (unsigned long long) stats.max_lag_ms);
+        }
+        if (stats.role != REPLICA_ROLE_NONE) {
+            printf("%s: applied up to log byte %llu, %llu batch(es), %llu change(s), last change made %llu ms ago\n",
+                   stats.role == REPLICA_ROLE_STANDBY ? "standby" : "promoted standby",
+                   (unsigned long long) stats.position, (unsigned long long) stats.applied_batches,
+                   (unsigned long long) stats.applied_records, (unsigned long long) stats.applied_age_ms);
+        }
+        return 0;
+    }
+    
+    //==============================================================================================================
+    
+    //standby: receive changes from the primary (which has MAIL_REPLICA_HOST pointing to this port) until promoted
+    //listens at MAIL_REPLICA_LISTEN, and both sides must have the same MAIL_REPLICA_SECRET
+    if (strcmp(argv[1], "standby") == 0 && argc == 3) {
+        if (replica_serve(argv[2]) < 0) {
+            fprintf(stderr, "%s: unable to run as a standby (MAIL_REPLICA_SECRET not set, promoted already, another receiver running, or port in use)\n", argv[0]);
+            return 1;
+        }
+        return 0;
+    }
+    
+    //==============================================================================================================
+    
+    //promote: make a standby the primary, stopping its receiver, so the servers can run on it
+    if (strcmp(argv[1], "promote") == 0 && argc == 2) {
+        if (replica_promote() < 0) {
+            fprintf(stderr, "%s: mail storage is not a standby\n", argv[0]);
+            return 1;
+        }
+        printf("standby promoted\n");
+        return 0;
+    }
+    
+    //==============================================================================================================
+    
+    //shard: print the storage node owning the mailbox of a user, in the cluster set by MAIL_SHARD_NODES
+    if (strcmp(argv[1], "shard") == 0 && argc == 3) {
+        const struct shard_node *node = shard_lookup(argv[2]);
+        if (node == NULL) {
+            fprintf(stderr, "%s: MAIL_SHARD_NODES is not set, or invalid\n", argv[0]);
+            return 1;
+        }
+        printf("%s: node %s (%s)\n", argv[2], node->name, node->address);
+        return 0;
+    }
+    
+    //==============================================================================================================
+    
+    //rebalance: list the users whose mailboxes must move when the cluster changes from the given nodes to MAIL_SHARD_NODES
+    if (strcmp(argv[1], "rebalance") == 0 && argc == 3) {
+        shard_ring_t from = shard_ring_create(argv[2]);
+        shard_ring_t to = shard_ring_create(config_string("MAIL_SHARD_NODES", ""));
+        if (from == NULL || to == NULL) {
+            fprintf(stderr, "%s: invalid node list (expected name=address,...), or MAIL_SHARD_NODES not set\n", argv[0]);
+            shard_ring_destroy(from);
+            shard_ring_destroy(to);
+            return 1;
+        }
+        int rv = printRebalance(from, to);
+        shard_ring_destroy(from);
+        shard_ring_destroy(to);
+        return rv;
+    }
+    
+    //==============================================================================================================
+    
+    //deliver: deliver the messages in the queue that are due, e.g. while the servers are stopped
+    if (strcmp(argv[1], "deliver") == 0 && argc == 2) {
+        printf("%d message(s) delivered\n", queue_run());
+        return 0;
+    }
+    
+    //==============================================================================================================
+    
+    usage(argv[0]);
+    return 1;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Invalid arguments. Expected one of:\n");
+    fprintf(stderr, "  %s migrate [<username>]\n", name);
+    fprintf(stderr, "  %s reconcile [<username>]\n", name);
+    fprintf(stderr, "  %s stats\n", name);
+    fprintf(stderr, "  %s queue\n", name);
+    fprintf(stderr, "  %s deliver\n", name);
+    fprintf(stderr, "  %s recover\n", name);
+    fprintf(stderr, "  %s replication\n", name);
+    fprintf(stderr, "  %s standby <port>\n", name);
+    fprintf(stderr, "  %s promote\n", name);
+    fprintf(stderr, "  %s shard <username>\n", name);
+    fprintf(stderr, "  %s rebalance <old-node-list>\n", name);
+}
+
+//printStats prints the counters of one shared cache, including the share of lookups answered from the cache
+void printStats(const char *name, struct shmcache_stats *stats) {
+    
+    unsigned long long lookups = stats->hits + stats->misses;
+    
+    printf("%s: %llu hit(s), %llu miss(es), %.1f%% hit ratio, %llu bytes served from cache\n", name,
+           (unsigned long long) stats->hits, (unsigned long long) stats->misses,
+           lookups ? 100.0 * stats->hits / lookups : 0.0, (unsigned long long) stats->bytes_served);
+    printf("%s: %llu store(s), %llu eviction(s), %llu of %llu entries used, %llu bytes per entry\n", name,
+           (unsigned long long) stats->stores, (unsigned long long) stats->evictions,
+           (unsigned long long) stats->entries_used, (unsigned long long) stats->entry_count,
+           (unsigned long long) stats->entry_size);
+}
+
+//printRebalance prints each user of users.txt whose owner differs between two clusters, then how many users move
+//mailboxes are not moved here: each one listed is copied from its old node to its new node by the administrator
+int printRebalance(shard_ring_t from, shard_ring_t to) {
+    
+    arena_t arena = arena_create(4096);
+    user_list_t users = load_user_names(arena);
+    
+    int total = 0, moved = 0;
+    for (user_list_t user = users; user != NULL; user = get_next_user(user)) {
+        const struct shard_node *oldNode = shard_ring_lookup(from, get_user_name(user));
+        const struct shard_node *newNode = shard_ring_lookup(to, get_user_name(user));
+        
+        total++;
+        if (strcmp(oldNode->name, newNode->name) != 0) {
+            printf("%s: %s (%s) -> %s (%s)\n", get_user_name(user), oldNode->name, oldNode->address, newNode->name, newNode->address);
+            moved++;
+        }
+    }
+    
+    printf("%d of %d user(s) move (%.1f%%)\n", moved, total, total ? 100.0 * moved / total : 0.0);
+    arena_destroy(arena);
+    return total > 0 ? 0 : 1;
+}
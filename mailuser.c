@@ -5,6 +5,14 @@
  */
 
 #include "mailuser.h"
+#include "blobstore.h"
+#include "spool.h"
+#include "config.h"
+#include "usage.h"
+#include "shmcache.h"
+#include "rcptcache.h"
+#include "journal.h"
+#include "changelog.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,10 +24,31 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #define USER_FILE_NAME "users.txt"
-#define MAIL_BASE_DIRECTORY "mail.store"
 #define MAIL_FILE_SUFFIX ".mail"
+#define MAIL_BLOB_TAG "B="
+#define MAIL_UID_MAX 64
+
+#define MAIL_LISTING_CACHE_FILE MAIL_BASE_DIRECTORY "/.listcache"
+#define MAIL_DELIVERY_LOCK_FILE MAIL_BASE_DIRECTORY "/.delivery"
+#define MAIL_MESSAGE_CACHE_FILE MAIL_BASE_DIRECTORY "/.msgcache"
+#define MAIL_RECIPIENT_CACHE_FILE MAIL_BASE_DIRECTORY "/.rcptcache"
+
+#define MAIL_DELIVERY_MAX_THREADS 32
+
+// Mailbox directory layouts: mail.store/<user> or mail.store/ab/cd/<user>
+#define MAIL_LAYOUT_FLAT   0
+#define MAIL_LAYOUT_HASHED 1
+
+// Length added to a mailbox path by the hashed layout ("/ab/cd")
+#define MAIL_LAYOUT_EXTRA 6
 
 struct user_list {
   char *user;
@@ -27,14 +56,43 @@ struct user_list {
 };
 
 struct mail_item {
-  char file_name[NAME_MAX];
+  char *file_name;
+  char uid[MAIL_UID_MAX];
   size_t file_size;
+  size_t header_size;
   unsigned int deleted:1;
+  unsigned int compressed:1;
+  unsigned int wire_format:1;
+};
+
+// A message being delivered to its recipients (see save_user_mail)
+struct mail_recipient {
+  const char *user;
+  uint32_t hash;
+  int result;
+};
+
+struct mail_delivery {
+  const char *info;
+  int replica;
+  char uid[MAIL_UID_MAX];
+  char blob_name[BLOB_NAME_MAX];
+  char blob_file[PATH_MAX];
+  size_t count;
+  struct mail_recipient *recipients;
+};
+
+struct mail_delivery_range {
+  const struct mail_delivery *job;
+  size_t start;
+  size_t end;
 };
 
 struct mail_list {
-  struct mail_item item;
-  struct mail_list *next;
+  unsigned int count;
+  unsigned int capacity;
+  struct mail_item *items;
+  arena_t arena;
 };
 
 /** Internal function that opens the users file list. If file has been
@@ -52,6 +110,46 @@ static FILE *user_file_list(void) {
   return file_ptr;
 }
 
+/** Internal function that returns the cache of user name lookups
+ *  shared by all processes (see rcptcache.c). The number of lookups
+ *  kept is set by MAIL_RCPT_CACHE_ENTRIES (zero disables the cache)
+ *  and the size of the Bloom filter of valid users by
+ *  MAIL_RCPT_FILTER_BYTES.
+ *
+ *  Returns: the cache, or NULL if it is disabled or not available.
+ */
+static rcptcache_t recipient_cache(void) {
+  
+  static rcptcache_t cache = NULL;
+  static int opened = 0;
+  
+  if (!opened) {
+    opened = 1;
+    cache = rcptcache_open(MAIL_RECIPIENT_CACHE_FILE, config_long("MAIL_RCPT_CACHE_ENTRIES", 8192),
+			   config_long("MAIL_RCPT_FILTER_BYTES", 128 << 10));
+  }
+  return cache;
+}
+
+/** Internal function that reads the users file one user name at a
+ *  time, to rebuild the recipient cache.
+ *
+ *  Parameters: context: Address of a file pointer, set to the users
+ *                       file on the first call.
+ *
+ *  Returns: the next user name, or NULL at the end of the file.
+ */
+static const char *next_user_name(void *context) {
+  
+  static char user_file[MAX_USERNAME_SIZE+1];
+  char pw_file[MAX_PASSWORD_SIZE+1];
+  FILE **file_ptr = context;
+  
+  if (!*file_ptr && !(*file_ptr = user_file_list()))
+    return NULL;
+  return fscanf(*file_ptr, "%255s%255s", user_file, pw_file) == 2 ? user_file : NULL;
+}
+
 /** Checks if the user name is valid. If password is informed, also
  *  checks if the password matches the user name.
  *  
@@ -65,18 +163,52 @@ static FILE *user_file_list(void) {
  */
 int is_valid_user(const char *username, const char *password) {
   
+  // Recipients are checked in the shared cache first, so unknown users cost no file scan
+  rcptcache_t cache = password ? NULL : recipient_cache();
+  if (cache) {
+    FILE *reader_file = NULL;
+    rcptcache_refresh(cache, USER_FILE_NAME, next_user_name, &reader_file);
+    int cached = rcptcache_lookup(cache, username);
+    if (cached >= 0) return cached;
+  }
+  
   FILE *file_ptr = user_file_list();
     if (!file_ptr) return 0;
   
   char user_file[MAX_USERNAME_SIZE+1];
   char pw_file[MAX_PASSWORD_SIZE+1];
+  int valid = 0;
   
   while (fscanf(file_ptr, "%s%s", user_file, pw_file) == 2) {
-    if (!strcasecmp(username, user_file))
-      return password == NULL || !strcmp(password, pw_file);
+    if (!strcasecmp(username, user_file)) {
+      valid = password == NULL || !strcmp(password, pw_file);
+      break;
+    }
   }
+  
+  if (cache)
+    rcptcache_store(cache, username, valid, valid ? config_long("MAIL_RCPT_CACHE_TTL", 300) :
+		    config_long("MAIL_RCPT_CACHE_NEGATIVE_TTL", 60));
+  return valid;
+}
 
-  return 0;
+/** Reads the names of all users in the users file.
+ *
+ *  Parameters: arena: Arena the list is allocated from, or NULL to
+ *                     allocate it from the heap.
+ *
+ *  Returns: a list with every user (in reverse order of the file),
+ *           empty if the file cannot be read.
+ */
+user_list_t load_user_names(arena_t arena) {
+  
+  user_list_t list = create_user_list();
+  FILE *reader_file = NULL;
+  const char *name;
+  
+  while ((name = next_user_name(&reader_file)) != NULL)
+    add_user_to_list(&list, name, arena);
+  return list;
 }
 
 /** Creates a new, empty, list of users.
@@ -94,15 +226,21 @@ user_list_t create_user_list(void) {
  *                        be copied to a new buffer, so the caller is
  *                        free to use a string that will be modified
  *                        later.
+ *              arena: Arena the list is allocated from, or NULL to
+ *                     allocate it from the heap. All users of a list
+ *                     must be added the same way.
  */
-void add_user_to_list(user_list_t *list, const char *username) {
-  user_list_t new_list = malloc(sizeof(struct user_list));
-  new_list->user = strdup(username);
+void add_user_to_list(user_list_t *list, const char *username, arena_t arena) {
+  user_list_t new_list = arena ? arena_alloc(arena, sizeof(struct user_list)) :
+    malloc(sizeof(struct user_list));
+  new_list->user = arena ? arena_strdup(arena, username) : strdup(username);
   new_list->next = *list;
   *list = new_list;
 }
 
-/** Frees all memory used by a list of users.
+/** Frees all memory used by a list of users. Lists allocated from an
+ *  arena are freed with the arena instead, and must not be passed to
+ *  this function.
  *
  * Parameters: list: list of users to be freed.
  */
@@ -115,62 +253,647 @@ void destroy_user_list(user_list_t list) {
   }
 }
 
-/** Saves a new email message into the mail storage for a list of
- *  users. This function uses hard links to create the files based on
- *  an existing temporary file. It assumes the temporary file is in
- *  the same file system as the newly created files. Typically, saving
- *  the temporary file in a local directory (where the executable is
- *  running) is enough for this to work.
+/** Returns the name of the first user in a list of users.
  *
- *  Parameters: basefile: Name of a temporary file containing the
- *                        contents of the email message.
- *              users: List of recipient users to the message.
+ *  Parameters: list: Non-empty list of users.
+ */
+const char *get_user_name(user_list_t list) {
+  return list->user;
+}
+
+/** Returns the rest of a list of users, after its first user (an
+ *  empty list if there are no more users).
+ *
+ *  Parameters: list: Non-empty list of users.
+ */
+user_list_t get_next_user(user_list_t list) {
+  return list->next;
+}
+
+/** Internal function that finds a field in the name of a mailbox
+ *  file. File names have the form <id>,<field>,<field>...mail, where
+ *  the id is a unique message ID (or, for older files, a number), and
+ *  each field is either a flag (e.g., Z) or a key followed by a value
+ *  (e.g., S=1234).
+ *
+ *  Parameters: file_name: Name (or path) of the mailbox file.
+ *              key: Flag, or key including the trailing '='.
+ *              len: If not NULL, receives the length of the value.
+ *
+ *  Returns: Pointer to the value of the field (or to the end of the
+ *           flag) within file_name, or NULL if the field is not found.
+ */
+static const char *mail_file_field(const char *file_name, const char *key, size_t *len) {
+  
+  const char *p = strrchr(file_name, '/');
+  size_t keylen = strlen(key);
+  
+  // Skip the message ID; fields end at a comma or at the file suffix
+  p = p ? p + 1 : file_name;
+  p += strcspn(p, ",.");
+  while (*p == ',') {
+    size_t n = strcspn(++p, ",.");
+    if (n >= keylen && !strncmp(p, key, keylen) && (n == keylen || key[keylen - 1] == '=')) {
+      if (len) *len = n - keylen;
+      return p + keylen;
+    }
+    p += n;
+  }
+  return NULL;
+}
+
+/** Internal function that retrieves the name of the blob holding the
+ *  contents of a mailbox file (see save_user_mail).
+ *
+ *  Returns: zero on success, -1 if the file name has no blob name
+ *           (i.e., it was saved before the blob store existed).
+ */
+static int mail_file_blob(const char *file_name, char blob_name[BLOB_NAME_MAX]) {
+  
+  size_t len;
+  const char *tag = mail_file_field(file_name, MAIL_BLOB_TAG, &len);
+  if (!tag || len == 0 || len >= BLOB_NAME_MAX) return -1;
+  
+  memcpy(blob_name, tag, len);
+  blob_name[len] = 0;
+  return 0;
+}
+
+/** Internal function that returns the mailbox directory layout used
+ *  for new deliveries, based on the MAIL_STORE_LAYOUT setting ("flat"
+ *  or "hashed"). Mailboxes in the other layout are still read, so a
+ *  store can be migrated while the servers are running.
+ */
+static int store_layout(void) {
+  return strcasecmp(config_string("MAIL_STORE_LAYOUT", "hashed"), "flat") ?
+    MAIL_LAYOUT_HASHED : MAIL_LAYOUT_FLAT;
+}
+
+/** Internal function that returns the 32-bit FNV-1a hash of the
+ *  lowercase user name, which selects its mailbox directory in the
+ *  hashed layout.
+ */
+static uint32_t user_hash(const char *username) {
+  
+  uint32_t hash = 0x811c9dc5;
+  for (const char *p = username; *p; p++) {
+    hash ^= (unsigned char) tolower((unsigned char) *p);
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
+/** Internal function that builds the path of the mailbox directory of
+ *  a user in a specific layout. In the hashed layout, users are spread
+ *  over 65536 directories (two levels of 256) based on a hash of the
+ *  lowercase user name, so no single directory grows too large.
+ */
+static void user_directory(const char *username, int layout, char *path) {
+  
+  if (layout == MAIL_LAYOUT_FLAT) {
+    snprintf(path, PATH_MAX, MAIL_BASE_DIRECTORY "/%s", username);
+    return;
+  }
+  
+  uint32_t hash = user_hash(username);
+  snprintf(path, PATH_MAX, MAIL_BASE_DIRECTORY "/%02x/%02x/%s",
+	   hash >> 24, (hash >> 16) & 0xff, username);
+}
+
+/** Internal function that creates the mailbox directory of a user in
+ *  the current layout, including any intermediate directories. Errors
+ *  are ignored, since directories may already exist.
+ */
+static void make_user_directory(const char *username, char *path) {
+  
+  user_directory(username, store_layout(), path);
+  for (char *p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+    *p = 0;
+    mkdir(path, 0777);
+    *p = '/';
+  }
+  mkdir(path, 0777);
+}
+
+/** Internal function that extracts the user name from the path of a
+ *  message file, which is <base>/<user>/<file> or
+ *  <base>/ab/cd/<user>/<file>.
+ *
+ *  Returns: pointer to the file part of the path (starting with a
+ *           slash), or NULL if the path is not a message file path.
+ */
+static const char *mail_file_user(const char *file_name, char username[NAME_MAX + 1]) {
+  
+  const char *file = strrchr(file_name, '/');
+  const char *user = file;
+  while (user && user > file_name && user[-1] != '/') user--;
+  if (!file || user == file_name || file - user > NAME_MAX) return NULL;
+  
+  memcpy(username, user, file - user);
+  username[file - user] = 0;
+  return file;
+}
+
+/** Internal function that looks for a message file that was moved to
+ *  another directory layout after the list was loaded (see
+ *  migrate_user_mail). If found, the item is updated to the new path.
+ *
+ *  Returns: zero if the file was found, -1 otherwise.
+ */
+static int relocate_mail_item(mail_item_t item) {
+  
+  char username[NAME_MAX + 1], path[PATH_MAX];
+  const char *file = mail_file_user(item->file_name, username);
+  if (!file) return -1;
+  
+  for (int layout = MAIL_LAYOUT_FLAT; layout <= MAIL_LAYOUT_HASHED; layout++) {
+    user_directory(username, layout, path);
+    strncat(path, file, sizeof(path) - strlen(path) - 1);
+    // Names are allocated with room for the longer (hashed) path, see new_mail_name
+    if (strcmp(path, item->file_name) && strlen(path) <= strlen(item->file_name) + MAIL_LAYOUT_EXTRA &&
+	access(path, F_OK) == 0) {
+      strcpy(item->file_name, path);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/** Internal function that creates a new unique message ID, based on
+ *  the current time, process ID and a per-process counter. IDs contain
+ *  only hexadecimal digits and dashes, so they can be used as the
+ *  first field of a mailbox file name and as POP3 unique IDs.
+ */
+static void new_message_uid(char uid[MAIL_UID_MAX]) {
+  
+  static unsigned int counter = 0;
+  struct timeval tv;
+  
+  gettimeofday(&tv, NULL);
+  snprintf(uid, MAIL_UID_MAX, "%lx-%05lx-%x-%x", (unsigned long) tv.tv_sec,
+	   (unsigned long) tv.tv_usec, (unsigned int) getpid(), counter++);
+}
+
+/** Internal function that delivers a message to one recipient,
+ *  creating a hard link to the message blob in the recipient's
+ *  mailbox directory. Only uses its arguments and the file system, so
+ *  several recipients can be delivered at the same time by different
+ *  threads. Replicated messages keep the file name they have in the
+ *  primary server, so finding it taken means the change was already
+ *  applied.
+ *
+ *  Returns: zero on success, or the errno value of the failure
+ *           (ENOENT if the blob was removed before it was linked,
+ *           EEXIST if a replicated message is already there).
+ */
+static int deliver_to_user(const struct mail_delivery *job, const char *username) {
+  
+  char mail_dir[PATH_MAX];
+  char mail_file[PATH_MAX];
+  
+  // Create recipient directory if it doesn't exist yet (error ignored)
+  int i = 0;
+  make_user_directory(username, mail_dir);
+  
+  // Tries to create a file called <uid>,<info>,B=<blob>.mail, if it exists tries <uid>_1,<info>,B=<blob>.mail, and so on
+  int rv = -1;
+  do {
+    char file_uid[MAIL_UID_MAX + 16];
+    if (i)
+      sprintf(file_uid, "%s_%d", job->uid, i);
+    else
+      strcpy(file_uid, job->uid);
+    i++;
+    
+    if (snprintf(mail_file, sizeof(mail_file), "%s/%s,%s," MAIL_BLOB_TAG "%s" MAIL_FILE_SUFFIX,
+		 mail_dir, file_uid, job->info, job->blob_name) >= sizeof(mail_file)) {
+      errno = ENAMETOOLONG;
+      break;
+    }
+  } while ((rv = link(job->blob_file, mail_file)) < 0 && errno == EEXIST && !job->replica);
+  
+  return rv == 0 ? 0 : errno;
+}
+
+/** Internal thread function that delivers a message to a range of
+ *  recipients (see deliver_in_parallel).
+ */
+static void *deliver_range(void *arg) {
+  
+  struct mail_delivery_range *range = arg;
+  for (size_t i = range->start; i < range->end; i++)
+    range->job->recipients[i].result = deliver_to_user(range->job, range->job->recipients[i].user);
+  return NULL;
+}
+
+/** Internal function that orders recipients by mailbox shard (see
+ *  user_directory), so recipients sharing parent directories are
+ *  delivered by the same thread.
+ */
+static int compare_recipients(const void *a, const void *b) {
+  
+  const struct mail_recipient *ra = a, *rb = b;
+  if (ra->hash != rb->hash) return ra->hash < rb->hash ? -1 : 1;
+  return strcasecmp(ra->user, rb->user);
+}
+
+/** Internal function that takes delivery slots shared by all server
+ *  processes. Each slot is a byte of the delivery lock file, locked
+ *  with a non-blocking record lock, so a slot is given back when the
+ *  file is closed or its process dies.
+ *
+ *  Returns: number of slots taken (up to wanted); *lock_fd receives
+ *           the descriptor to be closed to release them, or -1.
+ */
+static int take_delivery_slots(int wanted, int *lock_fd) {
+  
+  long slots = config_long("MAIL_DELIVERY_WORKERS", 8);
+  int taken = 0;
+  
+  *lock_fd = open(MAIL_DELIVERY_LOCK_FILE, O_RDWR | O_CREAT, 0666);
+  if (*lock_fd < 0) return 0;
+  
+  for (long slot = 0; slot < slots && taken < wanted; slot++) {
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = slot, .l_len = 1 };
+    if (fcntl(*lock_fd, F_SETLK, &lock) == 0)
+      taken++;
+  }
+  return taken;
+}
+
+/** Internal function that delivers a message to all recipients using
+ *  a pool of threads. Recipients are sorted by mailbox shard and split
+ *  into contiguous ranges, one per thread. Besides the calling thread,
+ *  each thread needs a delivery slot (see take_delivery_slots), which
+ *  caps the number of deliveries running at the same time across all
+ *  sessions; if no slots are free, the calling thread delivers to
+ *  everyone.
+ */
+static void deliver_in_parallel(struct mail_delivery *job) {
+  
+  long threads = config_long("MAIL_DELIVERY_THREADS", 4);
+  if (threads > MAIL_DELIVERY_MAX_THREADS) threads = MAIL_DELIVERY_MAX_THREADS;
+  if (threads > job->count) threads = job->count;
+  
+  int lock_fd = -1;
+  int workers = threads > 1 ? 1 + take_delivery_slots(threads - 1, &lock_fd) : 1;
+  pthread_t tid[MAIL_DELIVERY_MAX_THREADS];
+  struct mail_delivery_range ranges[MAIL_DELIVERY_MAX_THREADS];
+  int started[MAIL_DELIVERY_MAX_THREADS] = { 0 };
+  
+  qsort(job->recipients, job->count, sizeof(struct mail_recipient), compare_recipients);
+  
+  for (int t = 0; t < workers; t++) {
+    ranges[t] = (struct mail_delivery_range) { .job = job,
+					       .start = job->count * t / workers,
+					       .end = job->count * (t + 1) / workers };
+    // First range is delivered by the calling thread, as is any range whose thread didn't start
+    if (t > 0)
+      started[t] = pthread_create(&tid[t], NULL, deliver_range, &ranges[t]) == 0;
+  }
+  
+  deliver_range(&ranges[0]);
+  for (int t = 1; t < workers; t++) {
+    if (started[t])
+      pthread_join(tid[t], NULL);
+    else
+      deliver_range(&ranges[t]);
+  }
+  
+  if (lock_fd >= 0)
+    close(lock_fd);
+}
+
+/** Internal function that removes a file from a user's mailbox, in
+ *  whichever directory layout it is (both are used while the storage
+ *  is being migrated).
+ *
+ *  Returns: zero if the file was removed, -1 otherwise.
+ */
+static int remove_user_file(const char *username, const char *file_name) {
+  
+  char path[PATH_MAX];
+  int rv = -1;
+  
+  for (int layout = MAIL_LAYOUT_FLAT; layout <= MAIL_LAYOUT_HASHED; layout++) {
+    user_directory(username, layout, path);
+    if (strlen(path) + strlen(file_name) + 1 < sizeof(path)) {
+      strcat(path, "/");
+      strcat(path, file_name);
+      if (unlink(path) == 0) rv = 0;
+    }
+  }
+  return rv;
+}
+
+/** Internal function that checks if a file is in a user's mailbox, in
+ *  either directory layout.
+ *
+ *  Returns: non-zero if the file exists.
  */
-void save_user_mail(const char *basefile, user_list_t users) {
+static int user_file_exists(const char *username, const char *file_name) {
   
-  char mail_file[NAME_MAX + 1];
+  char path[PATH_MAX];
+  struct stat st;
+  
+  for (int layout = MAIL_LAYOUT_FLAT; layout <= MAIL_LAYOUT_HASHED; layout++) {
+    user_directory(username, layout, path);
+    if (strlen(path) + strlen(file_name) + 1 < sizeof(path)) {
+      strcat(path, "/");
+      strcat(path, file_name);
+      if (stat(path, &st) == 0) return 1;
+    }
+  }
+  return 0;
+}
+
+/** Internal function that builds the name of the mailbox file of a
+ *  message (see deliver_to_user), without any suffix added to the
+ *  message ID.
+ *
+ *  Returns: zero on success, -1 if the name is too long.
+ */
+static int mail_file_name(char file_name[PATH_MAX], const char *uid, const char *info,
+			  const char *blob_name) {
+  return snprintf(file_name, PATH_MAX, "%s,%s," MAIL_BLOB_TAG "%s" MAIL_FILE_SUFFIX,
+		  uid, info, blob_name) < PATH_MAX ? 0 : -1;
+}
+
+/** Internal function that undoes a delivery interrupted by a crash
+ *  (see journal.c): removes the mailbox files it may have created,
+ *  corrects the usage counters of recipients that had one, and drops
+ *  the blob if nothing else refers to it.
+ */
+static void roll_back_delivery(const char *uid, const char *blob_name, const char *info,
+			       user_list_t users) {
+  
+  char file_name[PATH_MAX];
+  
+  for (user_list_t user = users; user; user = user->next) {
+    if (mail_file_name(file_name, uid, info, blob_name) == 0 &&
+	remove_user_file(user->user, file_name) == 0) {
+      reconcile_user_usage(user->user);
+      changelog_expunge(user->user, file_name);
+    }
+  }
+  
+  blob_release(MAIL_BASE_DIRECTORY, blob_name);
+}
+
+/** Internal function that saves a message into the mail storage for
+ *  a list of users (see save_user_mail), under a new message ID or,
+ *  for replicated messages, the given one.
+ */
+static int store_user_mail(const char *basefile, const char *uid, const char *info,
+			   user_list_t users, user_list_t *failed) {
+  
+  struct mail_delivery job = { .info = info, .replica = uid != NULL };
   
   // Create base directory if it doesn't exist yet (error ignored)
   mkdir(MAIL_BASE_DIRECTORY, 0777);
   
-  for (; users; users = users->next) {
+  if (blob_store(MAIL_BASE_DIRECTORY, basefile, job.blob_name) < 0)
+    return -1;
+  blob_path(MAIL_BASE_DIRECTORY, job.blob_name, job.blob_file);
+  
+  // Uncompressed size, for usage accounting
+  const char *size_field = strstr(info, SPOOL_INFO_SIZE);
+  int64_t size = size_field ? strtoll(size_field + strlen(SPOOL_INFO_SIZE), NULL, 10) : 0;
+  
+  // Unique ID of the message, kept for as long as the message exists
+  if (uid)
+    snprintf(job.uid, sizeof(job.uid), "%s", uid);
+  else
+    new_message_uid(job.uid);
+  
+  // Recipients that already have a replicated message (the change is applied again) are left out,
+  // so undoing the delivery never removes a file it didn't create
+  user_list_t missing = create_user_list();
+  if (job.replica) {
+    char file_name[PATH_MAX];
+    if (mail_file_name(file_name, job.uid, info, job.blob_name) == 0)
+      for (user_list_t user = users; user; user = user->next)
+	if (!user_file_exists(user->user, file_name))
+	  add_user_to_list(&missing, user->user, NULL);
+    users = missing;
+    if (!users) {
+      blob_release(MAIL_BASE_DIRECTORY, job.blob_name);
+      return 0;
+    }
+  }
+  
+  // Nothing is linked unless the delivery can be undone after a crash
+  if (journal_begin(job.uid, job.blob_name, info, users) < 0) {
+    blob_release(MAIL_BASE_DIRECTORY, job.blob_name);
+    destroy_user_list(missing);
+    return -1;
+  }
+  changelog_delivery(job.uid, job.blob_name, info, users);
+  
+  for (user_list_t user = users; user; user = user->next)
+    job.count++;
+  job.recipients = malloc(job.count * sizeof(struct mail_recipient));
+  
+  if (job.recipients && job.count >= config_long("MAIL_DELIVERY_PARALLEL", 64)) {
+    size_t i = 0;
+    for (user_list_t user = users; user; user = user->next, i++)
+      job.recipients[i] = (struct mail_recipient) { .user = user->user, .hash = user_hash(user->user) };
+    deliver_in_parallel(&job);
+    
+  } else {
+    // Few recipients (or out of memory), delivered one after another
+    free(job.recipients);
+    job.recipients = NULL;
+  }
+  
+  int delivered = 0;
+  size_t i = 0;
+  for (user_list_t user = users; user; user = user->next, i++) {
+    const char *username = job.recipients ? job.recipients[i].user : user->user;
+    int rv = job.recipients ? job.recipients[i].result : deliver_to_user(&job, username);
     
-    // Create recipient directory if it doesn't exist yet (error ignored)
-    int i = 0;
-    sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s", users->user);
-    mkdir(mail_file, 0777);
+    // Blob released by a concurrent expunge between store and link, store it again
+    if (rv == ENOENT &&
+	blob_store(MAIL_BASE_DIRECTORY, basefile, job.blob_name) == 0)
+      rv = deliver_to_user(&job, username);
     
-    // Tries to create a file called 0.mail, if it exists tries 1.mail, and so on
-    do {
-      sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s/%d" MAIL_FILE_SUFFIX, users->user, i++);
-    } while (link(basefile, mail_file) < 0 && errno == EEXIST);
+    if (rv == 0) {
+      usage_add(username, size, 1);
+      delivered++;
+    } else if (rv != EEXIST || !job.replica) {
+      // Recorded as delivered to everyone (see changelog_delivery)
+      char file_name[PATH_MAX];
+      if (mail_file_name(file_name, job.uid, info, job.blob_name) == 0)
+	changelog_expunge(username, file_name);
+      if (failed)
+	add_user_to_list(failed, username, NULL);
+    }
   }
+  
+  free(job.recipients);
+  journal_end(job.uid, roll_back_delivery);
+  destroy_user_list(missing);
+  return delivered;
 }
 
-/** Creates a list of email messages for a username, based on existing
- *  email files created using save_user_mail (or equivalent). These
- *  messages only load the file names and sizes, the messages
- *  themselves are not kept in memory. If the user does not exist or
- *  does not have any messages, an empty list is returned.
+/** Saves a new email message into the mail storage for a list of
+ *  users. The message contents are stored once in the blob store
+ *  (see blobstore.c), shared with any earlier message with identical
+ *  contents, and each recipient's mailbox receives a hard link to
+ *  that blob. The message information and the blob name are kept in
+ *  the mailbox file name, so the message can be listed without
+ *  opening it and the blob reference dropped when it is deleted.
+ *  Each recipient's usage counters (see usage.c) are updated.
  *
- *  Parameters: username: Name of the user whose email messages should
- *                        be retrieved.
+ *  Messages with many recipients (see MAIL_DELIVERY_PARALLEL) are
+ *  delivered by several threads at once (see deliver_in_parallel);
+ *  the results are then gathered and accounted by the calling thread.
  *
- *  Returns: A mail_list_t object containing a list of email messages
- *           available for the provided username.
+ *  The delivery is recorded in the delivery journal (see journal.c)
+ *  before the first link is created and after the last counter is
+ *  updated, so a delivery interrupted by a crash can be undone (see
+ *  recover_deliveries). It is also recorded in the change log for
+ *  the standby server, if there is one (see changelog.c).
+ *
+ *  Parameters: basefile: Name of a temporary file containing the
+ *                        contents of the email message, as written
+ *                        by the spool functions.
+ *              info: Message information, as returned by spool_info.
+ *              users: List of recipient users to the message.
+ *              failed: If not NULL, receives a list (to be freed with
+ *                      destroy_user_list) of the recipients the
+ *                      message could not be delivered to, if it was
+ *                      stored.
+ *
+ *  Returns: Number of recipients the message was delivered to, or -1
+ *           if the message could not be stored.
+ */
+int save_user_mail(const char *basefile, const char *info, user_list_t users, user_list_t *failed) {
+  return store_user_mail(basefile, NULL, info, users, failed);
+}
+
+/** Saves a message received from the primary server into the mail
+ *  storage of a standby (see replica.c), under the same message ID
+ *  and file names it has in the primary. Recipients that already have
+ *  the message (i.e., the change is applied again) are skipped, and
+ *  left out of the delivery journal, so their file is kept if this
+ *  delivery is undone.
+ *
+ *  Parameters: basefile: Name of a temporary file containing the
+ *                        message, as stored in the primary's blob.
+ *              uid: Unique ID of the message.
+ *              info: Message information.
+ *              users: List of recipient users to the message.
+ *
+ *  Returns: Number of recipients the message was delivered to, or -1
+ *           if the message could not be stored.
+ */
+int replicate_user_mail(const char *basefile, const char *uid, const char *info, user_list_t users) {
+  return store_user_mail(basefile, uid, info, users, NULL);
+}
+
+/** Recovers the mail storage after a crash of a server: undoes the
+ *  deliveries interrupted by the crash (see journal_recover) and
+ *  removes spool files left behind (see spool_cleanup). Only the end
+ *  of the delivery journal and the spool directory are read, so it
+ *  takes the same time however large the storage is.
+ *
+ *  Returns: Number of deliveries undone and spool files removed, or
+ *           -1 if the delivery journal could not be read.
  */
-mail_list_t load_user_mail(const char *username) {
+int recover_deliveries(void) {
   
-  char filename[NAME_MAX + 1];
-  sprintf(filename, MAIL_BASE_DIRECTORY "/%s", username);
+  int undone = journal_recover(roll_back_delivery);
+  int removed = spool_cleanup();
+  return undone < 0 ? -1 : undone + removed;
+}
+
+/** Internal function that appends a new, empty, message to a list
+ *  of messages. Messages are kept in an array, so a message can be
+ *  found by its position without walking the list. The message only
+ *  becomes part of the list once the count is incremented.
+ *
+ *  Returns: the new message, or NULL if out of memory.
+ */
+static struct mail_item *new_mail_item(mail_list_t list) {
+  
+  if (list->count == list->capacity) {
+    unsigned int capacity = list->capacity ? 2 * list->capacity : 16;
+    struct mail_item *items = list->arena ?
+      arena_realloc(list->arena, list->items, list->capacity * sizeof(struct mail_item),
+		    capacity * sizeof(struct mail_item)) :
+      realloc(list->items, capacity * sizeof(struct mail_item));
+    if (!items) return NULL;
+    list->items = items;
+    list->capacity = capacity;
+  }
+  return &list->items[list->count];
+}
+
+/** Internal function that allocates a copy of the path of a message
+ *  file for a list of messages, from the list's arena if it has one.
+ *  The copy has room for the path of the same file in the hashed
+ *  layout, so it can be updated in place (see relocate_mail_item).
+ *
+ *  Returns: the copy, or NULL if out of memory.
+ */
+static char *new_mail_name(mail_list_t list, const char *path) {
+  
+  size_t size = strlen(path) + 1 + MAIL_LAYOUT_EXTRA;
+  char *name = list->arena ? arena_alloc(list->arena, size) : malloc(size);
+  if (name) strcpy(name, path);
+  return name;
+}
+
+/** Internal function that removes all messages from a list, freeing
+ *  their names unless they are allocated from an arena.
+ */
+static void clear_mail_list(mail_list_t list) {
+  
+  if (!list->arena)
+    for (unsigned int i = 0; i < list->count; i++)
+      free(list->items[i].file_name);
+  list->count = 0;
+}
+
+/** Internal function that fills in the information about a message
+ *  that is kept in its file name. The file name and size must already
+ *  be set.
+ */
+static void parse_mail_item(struct mail_item *item) {
+  
+  const char *name = strrchr(item->file_name, '/');
+  name = name ? name + 1 : item->file_name;
+  
+  // Unique ID is the first field of the file name (the message number for older files)
+  size_t uid_len = strcspn(name, ",.");
+  if (uid_len >= MAIL_UID_MAX) uid_len = MAIL_UID_MAX - 1;
+  memcpy(item->uid, name, uid_len);
+  item->uid[uid_len] = 0;
+  
+  item->compressed = mail_file_field(name, SPOOL_INFO_COMPRESSED, NULL) != NULL;
+  
+  // Stored exactly as sent by RETR if the wire size matches the stored size
+  const char *wire_size = mail_file_field(name, SPOOL_INFO_WIRE_SIZE, NULL);
+  item->wire_format = wire_size && strtoul(wire_size, NULL, 10) == item->file_size;
+  
+  const char *header_size = mail_file_field(name, SPOOL_INFO_HEADER_SIZE, NULL);
+  item->header_size = header_size ? strtoul(header_size, NULL, 10) : 0;
+  item->deleted = 0;
+}
+
+/** Internal function that adds the email messages found in a mailbox
+ *  directory to a list of messages.
+ */
+static void scan_user_directory(const char *dirname, mail_list_t list) {
   
-  DIR *dir = opendir(filename);
-  if (!dir) return NULL;
+  DIR *dir = opendir(dirname);
+  if (!dir) return;
   
+  char path[PATH_MAX];
   struct stat file_stat;
   struct dirent *dir_entry;
   const size_t suflen = strlen(MAIL_FILE_SUFFIX);
-  struct mail_list *list = NULL;
   
   while ((dir_entry = readdir(dir)) != NULL) {
     
@@ -178,38 +901,454 @@ mail_list_t load_user_mail(const char *username) {
 	strlen(dir_entry->d_name) > suflen &&
 	!strcmp(dir_entry->d_name + strlen(dir_entry->d_name) - suflen, MAIL_FILE_SUFFIX)) {
       
-      struct mail_list *item = malloc(sizeof(struct mail_list));
-      sprintf(item->item.file_name, MAIL_BASE_DIRECTORY "/%s/%s", username, dir_entry->d_name);
+      if (snprintf(path, sizeof(path), "%s/%s", dirname, dir_entry->d_name) >= sizeof(path))
+	continue;
       
-      if (stat(item->item.file_name, &file_stat) < 0) {
-	free(item);
+      // Message size is part of the file name, except for files saved by older versions
+      const char *size = mail_file_field(dir_entry->d_name, SPOOL_INFO_SIZE, NULL);
+      size_t file_size;
+      if (size) {
+	file_size = strtoul(size, NULL, 10);
+      } else if (stat(path, &file_stat) == 0) {
+	file_size = file_stat.st_size;
+      } else {
 	continue;
       }
       
-      item->item.file_size = file_stat.st_size;
-      item->item.deleted = 0;
-      item->next = list;
-      list = item;
+      struct mail_item *item = new_mail_item(list);
+      if (!item || !(item->file_name = new_mail_name(list, path))) break;
+      item->file_size = file_size;
+      parse_mail_item(item);
+      list->count++;
     }
   }
   
   closedir(dir);
+}
+
+/** Internal function that returns the cache of mailbox listings shared
+ *  by all processes (see shmcache.c), keyed by user name and tagged
+ *  with the mailbox generation (see usage_generation). Its size is set
+ *  by MAIL_CACHE_BYTES (zero disables it) and MAIL_CACHE_ENTRY_BYTES,
+ *  which limits the size of the mailboxes that can be cached.
+ *
+ *  Returns: the cache, or NULL if it is disabled or not available.
+ */
+static shmcache_t listing_cache(void) {
+  
+  static shmcache_t cache = NULL;
+  static int opened = 0;
+  
+  if (!opened) {
+    opened = 1;
+    cache = shmcache_open(MAIL_LISTING_CACHE_FILE, config_long("MAIL_CACHE_BYTES", 8 << 20),
+			  config_long("MAIL_CACHE_ENTRY_BYTES", 64 << 10));
+  }
+  return cache;
+}
+
+/** Internal function that returns the cache of message contents shared
+ *  by all processes (see shmcache.c), keyed by blob name. Since a blob
+ *  never changes, a cached message is valid for as long as it exists.
+ *  Its size is set by MAIL_MESSAGE_CACHE_BYTES (zero disables it) and
+ *  MAIL_MESSAGE_CACHE_ENTRY_BYTES, which limits the size of the
+ *  messages that can be cached.
+ *
+ *  Returns: the cache, or NULL if it is disabled or not available.
+ */
+static shmcache_t message_cache(void) {
+  
+  static shmcache_t cache = NULL;
+  static int opened = 0;
+  
+  if (!opened) {
+    opened = 1;
+    cache = shmcache_open(MAIL_MESSAGE_CACHE_FILE, config_long("MAIL_MESSAGE_CACHE_BYTES", 16 << 20),
+			  config_long("MAIL_MESSAGE_CACHE_ENTRY_BYTES", 32 << 10));
+  }
+  return cache;
+}
+
+/** Internal function that converts a list of messages into the form
+ *  kept in the listing cache: for each message, its
+ *  size followed by its nul-terminated file name. Everything else is
+ *  recovered from the file name.
+ *
+ *  Returns: the encoded listing, to be freed by the caller, or NULL if
+ *           out of memory.
+ */
+static char *encode_mail_list(mail_list_t list, size_t *length) {
+  
+  size_t len = 0;
+  for (unsigned int i = 0; i < list->count; i++)
+    len += sizeof(uint64_t) + strlen(list->items[i].file_name) + 1;
+  
+  char *data = malloc(len + 1);
+  if (!data) return NULL;
+  
+  char *p = data;
+  for (unsigned int i = 0; i < list->count; i++) {
+    uint64_t size = list->items[i].file_size;
+    memcpy(p, &size, sizeof(size));
+    p += sizeof(size);
+    p = stpcpy(p, list->items[i].file_name) + 1;
+  }
+  
+  *length = len;
+  return data;
+}
+
+/** Internal function that adds the messages in a listing encoded with
+ *  encode_mail_list to a list of messages.
+ *
+ *  Returns: zero on success, -1 if the listing is malformed or out of
+ *           memory.
+ */
+static int decode_mail_list(const char *data, size_t length, mail_list_t list) {
+  
+  const char *end = data + length;
+  
+  while (data < end) {
+    uint64_t size;
+    const char *name = data + sizeof(size);
+    const char *name_end = name < end ? memchr(name, 0, end - name) : NULL;
+    struct mail_item *item = name_end && name_end - name < PATH_MAX ? new_mail_item(list) : NULL;
+    if (!item) return -1;
+    
+    if (!(item->file_name = new_mail_name(list, name))) return -1;
+    memcpy(&size, data, sizeof(size));
+    item->file_size = size;
+    parse_mail_item(item);
+    list->count++;
+    data = name_end + 1;
+  }
+  return 0;
+}
+
+/** Internal function that loads the list of email messages for a
+ *  username (see load_user_mail), optionally bypassing the listing
+ *  cache.
+ */
+static mail_list_t load_mail_list(const char *username, int use_cache, arena_t arena) {
+  
+  char dirname[PATH_MAX];
+  int layout = store_layout();
+  struct mail_list *list = arena ? arena_alloc(arena, sizeof(struct mail_list)) :
+    malloc(sizeof(struct mail_list));
+  if (!list) return NULL;
+  *list = (struct mail_list) { .arena = arena };
+  
+  // Generation is read before the directories, so a listing cached while a message arrives is stale
+  uint64_t generation;
+  shmcache_t cache = use_cache ? listing_cache() : NULL;
+  int cacheable = cache && usage_generation(username, &generation) == 0;
+  size_t length;
+  char *data = cacheable ? shmcache_get(cache, username, generation, &length) : NULL;
+  
+  if (data && decode_mail_list(data, length, list) == 0) {
+    free(data);
+    
+  } else {
+    free(data);
+    clear_mail_list(list);
+    user_directory(username, !layout, dirname);
+    scan_user_directory(dirname, list);
+    user_directory(username, layout, dirname);
+    scan_user_directory(dirname, list);
+    
+    if (cacheable && (data = encode_mail_list(list, &length)) != NULL) {
+      shmcache_put(cache, username, generation, data, length);
+      free(data);
+    }
+  }
+  
+  // Empty mailbox is represented by an empty (NULL) list
+  if (!list->count) {
+    if (!arena) {
+      free(list->items);
+      free(list);
+    }
+    return NULL;
+  }
   return list;
 }
 
-/** Frees all memory used by a list of emails. Also deletes any files
- *  marked to be deleted.
+/** Creates a list of email messages for a username, based on existing
+ *  email files created using save_user_mail (or equivalent). These
+ *  messages only load the file names and sizes, the messages
+ *  themselves are not kept in memory. If the user does not exist or
+ *  does not have any messages, an empty list is returned. Messages
+ *  in both the flat and the hashed directory layouts are included.
+ *  Listings are kept in a cache shared by all processes (see
+ *  shmcache.c), so loading a mailbox that has not changed since it
+ *  was last loaded does not read the mailbox directories.
+ *
+ *  Parameters: username: Name of the user whose email messages should
+ *                        be retrieved.
+ *              arena: Arena the list is allocated from, or NULL to
+ *                     allocate it from the heap.
+ *
+ *  Returns: A mail_list_t object containing a list of email messages
+ *           available for the provided username.
+ */
+mail_list_t load_user_mail(const char *username, arena_t arena) {
+  return load_mail_list(username, 1, arena);
+}
+
+/** Moves all messages of a user into the mailbox directory of the
+ *  current layout (see MAIL_STORE_LAYOUT). Messages are renamed one by
+ *  one, so deliveries and POP3 sessions may proceed during the move;
+ *  sessions that loaded the old file names will find the messages in
+ *  the new location (see open_mail_item).
+ *
+ *  Parameters: username: Name of the user to be migrated.
+ *
+ *  Returns: Number of messages moved, or -1 if the new mailbox
+ *           directory could not be created.
+ */
+int migrate_user_mail(const char *username) {
+  
+  char old_dir[PATH_MAX], new_dir[PATH_MAX];
+  char old_file[PATH_MAX], new_file[PATH_MAX];
+  struct dirent *dir_entry;
+  struct stat st;
+  int rv = 0;
+  
+  user_directory(username, !store_layout(), old_dir);
+  DIR *dir = opendir(old_dir);
+  if (!dir) return 0;
+  
+  make_user_directory(username, new_dir);
+  if (stat(new_dir, &st) < 0) {
+    closedir(dir);
+    return -1;
+  }
+  
+  while ((dir_entry = readdir(dir)) != NULL) {
+    
+    if (dir_entry->d_type != DT_REG ||
+	snprintf(old_file, sizeof(old_file), "%s/%s", old_dir, dir_entry->d_name) >= sizeof(old_file) ||
+	snprintf(new_file, sizeof(new_file), "%s/%s", new_dir, dir_entry->d_name) >= sizeof(new_file))
+      continue;
+    
+    // Keep the message ID and information, adding a suffix to the ID if the name is taken
+    int uid_len = strcspn(dir_entry->d_name, ",.");
+    const char *info = dir_entry->d_name + uid_len;
+    for (int i = 1; link(old_file, new_file) < 0; i++) {
+      if (errno != EEXIST ||
+	  snprintf(new_file, sizeof(new_file), "%s/%.*s_%d%s", new_dir,
+		   uid_len, dir_entry->d_name, i, info) >= sizeof(new_file)) {
+	new_file[0] = 0;
+	break;
+      }
+    }
+    
+    if (new_file[0] && unlink(old_file) == 0)
+      rv++;
+  }
+  
+  closedir(dir);
+  rmdir(old_dir);
+  
+  // Cached listings of the mailbox (see listing_cache) refer to the old file names
+  if (rv > 0)
+    usage_add(username, 0, 0);
+  return rv;
+}
+
+/** Internal function that checks if a directory entry is one of the
+ *  two-hex-digit shard directories of the hashed layout.
+ */
+static int is_shard_directory(const struct dirent *dir_entry) {
+  return dir_entry->d_type == DT_DIR && strlen(dir_entry->d_name) == 2 &&
+    isxdigit((unsigned char) dir_entry->d_name[0]) &&
+    isxdigit((unsigned char) dir_entry->d_name[1]);
+}
+
+/** Internal function that calls a function for every user mailbox
+ *  found in a directory. Shard directories are visited recursively,
+ *  up to the depth of the hashed layout. A user with mailboxes in
+ *  both layouts is visited twice.
+ *
+ *  Returns: Sum of the non-negative values returned by the function.
+ */
+static int walk_directory(const char *dirname, int depth, int (*fn)(const char *username)) {
+  
+  char path[PATH_MAX];
+  struct dirent *dir_entry;
+  int rv = 0;
+  
+  DIR *dir = opendir(dirname);
+  if (!dir) return 0;
+  
+  while ((dir_entry = readdir(dir)) != NULL) {
+    
+    if (dir_entry->d_type != DT_DIR || dir_entry->d_name[0] == '.')
+      continue;
+    
+    if (depth < 2 && is_shard_directory(dir_entry)) {
+      if (snprintf(path, sizeof(path), "%s/%s", dirname, dir_entry->d_name) < sizeof(path))
+	rv += walk_directory(path, depth + 1, fn);
+    } else if (depth == 0 || depth == 2) {
+      int user_rv = fn(dir_entry->d_name);
+      if (user_rv > 0) rv += user_rv;
+    }
+  }
+  
+  closedir(dir);
+  return rv;
+}
+
+/** Moves the mailboxes of all users in the mail storage into the
+ *  current directory layout (see migrate_user_mail).
+ *
+ *  Returns: Total number of messages moved.
+ */
+int migrate_mail_store(void) {
+  return walk_directory(MAIL_BASE_DIRECTORY, 0, migrate_user_mail);
+}
+
+/** Checks if a user has reached the mailbox size limit set by
+ *  MAIL_QUOTA_BYTES (zero, the default, means no limit). Uses the
+ *  shared usage counters, so no mail files are read.
+ *
+ *  Parameters: username: Name of the user to check.
+ *
+ *  Returns: a non-zero value if the user is over quota, or zero
+ *           otherwise.
+ */
+int is_user_over_quota(const char *username) {
+  
+  int64_t bytes, messages;
+  long quota = config_long("MAIL_QUOTA_BYTES", 0);
+  
+  return quota > 0 && usage_get(username, &bytes, &messages) == 0 && bytes >= quota;
+}
+
+/** Returns the number of messages in a user's mailbox, taken from the
+ *  usage counters (see usage.c) without reading the mailbox. The
+ *  result may be off if the counters have drifted (see
+ *  reconcile_user_usage).
+ *
+ *  Parameters: username: Name of the user.
+ *
+ *  Returns: Number of messages, or -1 if the counters are not available
+ *           (including for users without counters yet), in which case
+ *           the mailbox must be read.
+ */
+int get_user_mail_count(const char *username) {
+  
+  int64_t bytes, messages;
+  if (usage_get(username, &bytes, &messages) < 0 || messages < 0)
+    return -1;
+  return messages;
+}
+
+/** Recomputes the usage counters of a user from the messages in the
+ *  mail storage, correcting any drift. If the counters change while
+ *  the mailbox is being read, they are left untouched.
+ *
+ *  Parameters: username: Name of the user to be reconciled.
+ *
+ *  Returns: 1 if the counters were corrected, 0 if they were already
+ *           correct, or -1 if they could not be updated.
+ */
+int reconcile_user_usage(const char *username) {
+  
+  // Users without counters yet start from zero (usage_set fails if the table is not available)
+  int64_t old_bytes, old_messages;
+  usage_get(username, &old_bytes, &old_messages);
+  
+  // Read from the mailbox directories, since a listing may be cached with the wrong counters
+  mail_list_t list = load_mail_list(username, 0, NULL);
+  int64_t bytes = get_mail_list_size(list);
+  int64_t messages = get_mail_count(list);
+  destroy_mail_list(list);
+  
+  if (bytes == old_bytes && messages == old_messages)
+    return 0;
+  return usage_set(username, old_bytes, old_messages, bytes, messages) == 0 ? 1 : -1;
+}
+
+/** Recomputes the usage counters of all users in the mail storage
+ *  (see reconcile_user_usage).
+ *
+ *  Returns: Number of users whose counters were corrected.
+ */
+int reconcile_mail_store(void) {
+  return walk_directory(MAIL_BASE_DIRECTORY, 0, reconcile_user_usage);
+}
+
+/** Internal function that drops the blob store reference held by a
+ *  mailbox file that has just been removed, and drops its contents
+ *  from the message cache. Files saved before the blob store existed
+ *  carry no blob name and are ignored.
+ */
+static void release_mail_blob(const char *file_name) {
+  
+  char blob_name[BLOB_NAME_MAX];
+  if (mail_file_blob(file_name, blob_name) < 0) return;
+  
+  blob_release(MAIL_BASE_DIRECTORY, blob_name);
+  if (message_cache())
+    shmcache_remove(message_cache(), blob_name);
+}
+
+/** Removes a file from a user's mailbox in the mail storage of a
+ *  standby (see replica.c), as it was removed in the primary server.
+ *  Files already removed (i.e., the change is applied again) are
+ *  skipped.
+ *
+ *  Parameters: username: Owner of the mailbox.
+ *              file_name: Name of the file in the mailbox directory.
+ *
+ *  Returns: 1 if the file was removed, 0 if it was not found.
+ */
+int replicate_expunge(const char *username, const char *file_name) {
+  
+  if (strchr(file_name, '/') || remove_user_file(username, file_name) < 0)
+    return 0;
+  
+  const char *size = mail_file_field(file_name, SPOOL_INFO_SIZE, NULL);
+  usage_add(username, size ? -strtoll(size, NULL, 10) : 0, -1);
+  changelog_expunge(username, file_name);
+  release_mail_blob(file_name);
+  return 1;
+}
+
+/** Frees all memory used by a list of emails (lists allocated from an
+ *  arena are freed with the arena). Also deletes any files marked to
+ *  be deleted, dropping their blob store references and updating the
+ *  owner's usage counters.
  *
  *  Parameters: list: List of emails to be deleted.
  */
 void destroy_mail_list(mail_list_t list) {
-  while (list) {
-    
-    if (list->item.deleted) unlink(list->item.file_name);
+  
+  if (!list) return;
+  
+  for (unsigned int i = 0; i < list->count; i++) {
+    struct mail_item *item = &list->items[i];
     
-    mail_list_t next = list->next;
+    if (item->deleted &&
+	(unlink(item->file_name) == 0 ||
+	 (errno == ENOENT && relocate_mail_item(item) == 0 &&
+	  unlink(item->file_name) == 0))) {
+      
+      char username[NAME_MAX + 1];
+      const char *file = mail_file_user(item->file_name, username);
+      if (file) {
+	usage_add(username, -(int64_t) item->file_size, -1);
+	changelog_expunge(username, file + 1);
+      }
+      release_mail_blob(item->file_name);
+    }
+  }
+  
+  clear_mail_list(list);
+  if (!list->arena) {
+    free(list->items);
     free(list);
-    list = next;
   }
 }
 
@@ -222,10 +1361,8 @@ void destroy_mail_list(mail_list_t list) {
  */
 unsigned int get_mail_count(mail_list_t list) {
   unsigned int rv = 0;
-  while (list) {
-    if (!list->item.deleted) rv++;
-    list = list->next;
-  }
+  for (unsigned int i = 0; list && i < list->count; i++)
+    if (!list->items[i].deleted) rv++;
   return rv;
 }
 
@@ -249,13 +1386,9 @@ unsigned int get_mail_count(mail_list_t list) {
  */
 mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
   
-  while (list) {
-    if (!pos--)
-      return list->item.deleted ? NULL : &list->item;
-    list = list->next;
-  }
-  
-  return NULL;
+  if (!list || pos >= list->count)
+    return NULL;
+  return list->items[pos].deleted ? NULL : &list->items[pos];
 }
 
 /** Returns the total amount of bytes in all email messages in a list
@@ -267,10 +1400,8 @@ mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
  */
 size_t get_mail_list_size(mail_list_t list) {
   size_t rv = 0;
-  while (list) {
-    rv += list->item.deleted ? 0 : list->item.file_size;
-    list = list->next;
-  }
+  for (unsigned int i = 0; list && i < list->count; i++)
+    rv += list->items[i].deleted ? 0 : list->items[i].file_size;
   return rv;
 }
 
@@ -284,6 +1415,143 @@ size_t get_mail_item_size(mail_item_t item) {
   return item->file_size;
 }
 
+/** Returns the length of the header block of an email message,
+ *  including the empty line that separates it from the body, as stored
+ *  in the message file. This allows the header to be read without
+ *  scanning the message for its end.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: Length of the header block, in bytes, or zero if unknown
+ *           (for messages saved by older versions, which have to be
+ *           scanned line by line; "mailadm migrate" keeps file names
+ *           as they are, so it doesn't add the field to them).
+ */
+size_t get_mail_item_header_size(mail_item_t item) {
+  return item->header_size;
+}
+
+/** Checks if the file containing an email message is compressed (see
+ *  spool.c). Compressed files can be read with zlib's gzread family.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: a non-zero value if the file is compressed, or zero otherwise.
+ */
+int is_mail_item_compressed(mail_item_t item) {
+  return item->compressed;
+}
+
+/** Checks if an email message is stored in wire format, i.e., with
+ *  CRLF line endings and dot-stuffed, so that its contents (once
+ *  decompressed, if compressed) can be sent to a POP3 client as is.
+ *  Messages saved by older versions may not be.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: a non-zero value if the message is in wire format, or zero
+ *           otherwise.
+ */
+int is_mail_item_wire_format(mail_item_t item) {
+  return item->wire_format;
+}
+
+/** Returns the unique ID of an email message, suitable for the POP3
+ *  UIDL command. The ID is assigned when the message is saved (see
+ *  save_user_mail) and is part of the file name, so it does not change
+ *  between sessions or when the message is moved to another directory
+ *  layout. Messages saved by older versions use their message number.
+ *  The string remains valid until the list of emails containing the
+ *  message is destroyed.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: Unique ID of the message.
+ */
+const char *get_mail_item_uid(mail_item_t item) {
+  return item->uid;
+}
+
+/** Opens the file containing the contents of an email message for
+ *  reading. Unlike opening the file returned by
+ *  get_mail_item_filename, this also finds messages moved to another
+ *  directory layout while the list was loaded.
+ *
+ *  Parameters: item: Email message to be opened.
+ *
+ *  Returns: A file descriptor open for reading, or -1 on error.
+ */
+int open_mail_item(mail_item_t item) {
+  
+  int fd = open(item->file_name, O_RDONLY);
+  if (fd < 0 && errno == ENOENT && relocate_mail_item(item) == 0)
+    fd = open(item->file_name, O_RDONLY);
+  return fd;
+}
+
+/** Reads the entire contents of a small email message, exactly as RETR
+ *  sends them (see is_mail_item_wire_format), decompressed if needed.
+ *  Messages are kept in a cache shared by all processes (see
+ *  message_cache), so a message retrieved over and over, e.g. from a
+ *  mailbox polled by many clients, is only read from its file once.
+ *  Only messages in wire format saved in the blob store and small
+ *  enough for the cache are handled; others should be read from their
+ *  file (see open_mail_item).
+ *
+ *  Parameters: item: Email message to be read.
+ *              length: Receives the length of the message.
+ *
+ *  Returns: The contents of the message, to be freed by the caller, or
+ *           NULL if the message is not handled or cannot be read.
+ */
+char *read_mail_item(mail_item_t item, size_t *length) {
+  
+  char blob_name[BLOB_NAME_MAX];
+  shmcache_t cache = message_cache();
+  if (!cache || !item->wire_format || item->file_size > shmcache_max_length(cache) ||
+      mail_file_blob(item->file_name, blob_name) < 0)
+    return NULL;
+  
+  char *data = shmcache_get(cache, blob_name, 0, length);
+  if (data) return data;
+  
+  int fd = open_mail_item(item);
+  if (fd < 0) return NULL;
+  gzFile file = gzdopen(fd, "r");
+  if (!file) {
+    close(fd);
+    return NULL;
+  }
+  
+  // Raw files are passed through unchanged by gzread
+  data = malloc(item->file_size + 1);
+  int rv = data ? gzread(file, data, item->file_size) : -1;
+  gzclose(file);
+  if (rv < 0 || rv != item->file_size) {
+    free(data);
+    return NULL;
+  }
+  
+  shmcache_put(cache, blob_name, 0, data, rv);
+  *length = rv;
+  return data;
+}
+
+/** Asks the operating system to start reading the file containing an
+ *  email message into memory in the background, so that opening and
+ *  sending it later does not have to wait for the disk. Errors are
+ *  ignored.
+ *
+ *  Parameters: item: Email message expected to be read soon.
+ */
+void prefetch_mail_item(mail_item_t item) {
+  
+  int fd = open_mail_item(item);
+  if (fd < 0) return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
 /** Returns the name of the file containing the contents of an email
  *  message. The name is returned as a string that should not be
  *  modified by the caller, as it is used in the internal
@@ -319,11 +1587,52 @@ unsigned int reset_mail_list_deleted_flag(mail_list_t list) {
   
   unsigned int rv = 0;
   
-  while (list) {
-    rv += list->item.deleted;
-    list->item.deleted = 0;
-    list = list->next;
+  for (unsigned int i = 0; list && i < list->count; i++) {
+    rv += list->items[i].deleted;
+    list->items[i].deleted = 0;
   }
   
   return rv;
 }
+
+/** Retrieves the counters of the cache of mailbox listings (see
+ *  load_user_mail).
+ *
+ *  Parameters: stats: Receives the counters.
+ *
+ *  Returns: zero on success, -1 if the cache is disabled or not available.
+ */
+int get_listing_cache_stats(struct shmcache_stats *stats) {
+  
+  if (!listing_cache()) return -1;
+  shmcache_stats(listing_cache(), stats);
+  return 0;
+}
+
+/** Retrieves the counters of the cache of message contents (see
+ *  read_mail_item).
+ *
+ *  Parameters: stats: Receives the counters.
+ *
+ *  Returns: zero on success, -1 if the cache is disabled or not available.
+ */
+int get_message_cache_stats(struct shmcache_stats *stats) {
+  
+  if (!message_cache()) return -1;
+  shmcache_stats(message_cache(), stats);
+  return 0;
+}
+
+/** Retrieves the counters of the cache of recipient lookups (see
+ *  is_valid_user).
+ *
+ *  Parameters: stats: Receives the counters.
+ *
+ *  Returns: zero on success, -1 if the cache is disabled or not available.
+ */
+int get_recipient_cache_stats(struct rcptcache_stats *stats) {
+  
+  if (!recipient_cache()) return -1;
+  rcptcache_stats(recipient_cache(), stats);
+  return 0;
+}
@@ -9,21 +9,41 @@
 
 #include <stdio.h>
 
+#include "arena.h"
+
 #define MAX_USERNAME_SIZE 255
 #define MAX_PASSWORD_SIZE 255
 
+#define MAIL_BASE_DIRECTORY "mail.store"
+
 typedef struct user_list *user_list_t;
 typedef struct mail_item *mail_item_t;
 typedef struct mail_list *mail_list_t;
 
+struct shmcache_stats;
+struct rcptcache_stats;
+
 int is_valid_user(const char *username, const char *password);
+user_list_t load_user_names(arena_t arena);
 
 user_list_t create_user_list(void);
-void add_user_to_list(user_list_t *list, const char *username);
+void add_user_to_list(user_list_t *list, const char *username, arena_t arena);
 void destroy_user_list(user_list_t list);
+const char *get_user_name(user_list_t list);
+user_list_t get_next_user(user_list_t list);
 
-void save_user_mail(const char *basefile, user_list_t users);
-mail_list_t load_user_mail(const char *username);
+int save_user_mail(const char *basefile, const char *info, user_list_t users, user_list_t *failed);
+int recover_deliveries(void);
+int replicate_user_mail(const char *basefile, const char *uid, const char *info, user_list_t users);
+int replicate_expunge(const char *username, const char *file_name);
+mail_list_t load_user_mail(const char *username, arena_t arena);
+int migrate_user_mail(const char *username);
+int migrate_mail_store(void);
+
+int is_user_over_quota(const char *username);
+int get_user_mail_count(const char *username);
+int reconcile_user_usage(const char *username);
+int reconcile_mail_store(void);
 
 void destroy_mail_list(mail_list_t list);
 unsigned int get_mail_count(mail_list_t list);
@@ -32,7 +52,18 @@ size_t get_mail_list_size(mail_list_t list);
 unsigned int reset_mail_list_deleted_flag(mail_list_t list);
 
 size_t get_mail_item_size(mail_item_t item);
+size_t get_mail_item_header_size(mail_item_t item);
 const char *get_mail_item_filename(mail_item_t item);
+const char *get_mail_item_uid(mail_item_t item);
+int open_mail_item(mail_item_t item);
+void prefetch_mail_item(mail_item_t item);
+char *read_mail_item(mail_item_t item, size_t *length);
+int is_mail_item_compressed(mail_item_t item);
+int is_mail_item_wire_format(mail_item_t item);
 void mark_mail_item_deleted(mail_item_t item);
 
+int get_listing_cache_stats(struct shmcache_stats *stats);
+int get_message_cache_stats(struct shmcache_stats *stats);
+int get_recipient_cache_stats(struct rcptcache_stats *stats);
+
 #endif
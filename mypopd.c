@@ -1,17 +1,80 @@
 #include "netbuffer.h"
 #include "mailuser.h"
 #include "server.h"
+#include "config.h"
+#include "protocol.h"
+#include "arena.h"
+#include "replica.h"
+#include "shard.h"
+#include "ratelimit.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/utsname.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <ctype.h>
+#include <zlib.h>
 
 #define MAX_LINE_LENGTH 1024
+#define NODE_TIMEOUT_SECONDS 30
+
+//everything a client connection needs is kept in the session, which is passed to the command handlers
+struct pop_session {
+    int fd;
+    net_buffer_t nb;
+    
+    //current represents current state
+    //N : None
+    //A : AUTHORIZATION
+    //T : TRANSACTION
+    //U : UPDATE
+    char current;
+    
+    //lastCommand represents last command that was issued
+    //N : None
+    //U : USER
+    //P : PASS
+    char lastCommand;
+    
+    //username of USER parameter is saved in the session
+    char username[256];
+    
+    //there must only be one instance of the mail list for any username
+    //it is only loaded once a command needs it (see loadMailbox)
+    mail_list_t mail_list;
+    int mailLoaded;
+    
+    //need to store pre-DELE count of mail for LIST and QUIT
+    int noOfMail;
+    
+    //last message retrieved, and number of messages already read ahead (see prefetchMessages)
+    int lastRetr;
+    int prefetched;
+    
+    //replies that depend on the command are built here, without allocating (see reply_start)
+    struct reply reply;
+    
+    //buffer and message list are allocated from the arena, which is freed when the client disconnects
+    arena_t arena;
+};
 
 static void handle_client(int fd);
-static int getParameter(char out[]);
+static void buildCommandTables(void);
+static int getParameter(const struct proto_command *cmd);
+static int getTopParameters(const struct proto_command *cmd, int *message, int *lines);
+static int sendMessage(int fd, int mail_fd, mail_item_t item);
+static int sendTop(int fd, int mail_fd, mail_item_t item, int lines);
+static int sendUidList(int fd, mail_list_t mail_list, int noOfMail);
+static void loadMailbox(struct pop_session *session);
+static void prefetchMessages(mail_list_t mail_list, int result, int noOfMail, int *prefetched);
+static void reportSession(arena_t arena);
+static int proxyToNode(struct pop_session *session, const struct shard_node *node);
+
+//one command table per state (AUTHORIZATION, TRANSACTION), so each verb is found in a single lookup
+//with the handler that applies in that state; built once before any client is accepted
+static struct proto_table tableAuthorization, tableTransaction;
 
 int main(int argc, char *argv[]) {
   
@@ -20,6 +83,13 @@ int main(int argc, char *argv[]) {
     return 1;
   }
   
+  if (replica_is_standby()) {
+    fprintf(stderr, "%s: mail storage is a replication standby, promote it first\n", argv[0]);
+    return 1;
+  }
+  
+  buildCommandTables();
+  set_connection_limit("-ERR Too many connections from your address, try again later\r\n");
   run_server(argv[1], handle_client);
   
   return 0;
@@ -27,42 +97,29 @@ int main(int argc, char *argv[]) {
 
 void handle_client(int fd) {
     
-    //current represents current state
-    //N : None
-    //A : AUTHORIZATION
-    //T : TRANSACTION
-    //U : UPDATE
-    char current = 'N';
-    
-    //lastCommand represents last command that was issued
-    //N : None
-    //U : USER
-    //P : PASS
-    char lastCommand = 'N';
-    
-    //username of USER parameter is saved as global variable
-    //password of PASS parameter is saved as global variable
-    char username[256] = "";
-    char password[256] = "";
-    
-    //there must only be one instance of the mail list for any username
-    mail_list_t mail_list;
+    struct pop_session session;
+    memset(&session, 0, sizeof(session));
+    session.fd = fd;
+    session.current = 'N';
+    session.lastCommand = 'N';
     
     //==============================================================================================================
     
     //send greeting (welcoming) message
-    send_string(fd, "+OK POP3 server ready\r\n");
-    current = 'A';
+    send_fixed(fd, "+OK POP3 server ready\r\n");
+    session.current = 'A';
     
     //==============================================================================================================
     
-    net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
+    session.arena = arena_create(MAX_LINE_LENGTH * 4);
+    net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH, session.arena);
+    session.nb = nb;
     
     //what client is sending
-    char out[MAX_LINE_LENGTH] = "";
+    char out[MAX_LINE_LENGTH + 1] = "";
     
-    //need to store pre-DELE count of mail globally for LIST and QUIT
-    int noOfMail;
+    //set while replies are being held back to be sent together (see PIPELINING below)
+    int batching = 0;
     
     //==============================================================================================================
     
@@ -71,458 +128,868 @@ void handle_client(int fd) {
         
         //==============================================================================================================
         
+        //PIPELINING: when the client sent several commands at once, their replies are held back
+        //and sent together once all of them are handled, right before waiting for more commands
+        if (batching && !nb_has_line(nb)) {
+            set_send_batching(fd, 0);
+            batching = 0;
+        }
+        
         int size = nb_read_line(nb, out);
         
-        //Properly replies with error if line is too long
-        if (size > MAX_LINE_LENGTH) {
-            if (send_string(fd, "-ERR command line too long\r\n") < 0) {
-                break;
-            }
-            
+        if (!batching && nb_has_line(nb)) {
+            set_send_batching(fd, 1);
+            batching = 1;
+        }
+        
         //Properly closes connection if read (or nb_read_line) returns <= 0
-        } else if (size <= 0) {
+        if (size <= 0) {
             break;
         }
         
-        //==============================================================================================================
+        //Properly replies with error if line is too long (no line terminator within the buffer)
+        if (size == MAX_LINE_LENGTH && out[size - 1] != '\n') {
+            //rest of the line is discarded, so it is not taken as another command
+            while (size == MAX_LINE_LENGTH && out[size - 1] != '\n' && (size = nb_read_line(nb, out)) > 0);
             
-        //if command is NOOP
-        if (strncasecmp(out, "NOOP", 4) == 0) {
-            if (current == 'T') {
-                if (send_string(fd, "+OK\r\n") < 0) {
-                    break;
-                }
-                
-            } else {
-                if (send_string(fd, "-ERR Need to complete AUTHORIZATION\r\n") < 0) {
-                    break;
-                }
+            if (size <= 0 || send_fixed(fd, "-ERR command line too long\r\n") < 0) {
+                break;
             }
+            continue;
+        }
         
         //==============================================================================================================
-            
-        //if command is USER
-        } else if (strncasecmp(out, "USER", 4) == 0) {
-            if (current == 'A') {
-                
-                //rejected if no parameter
-                if (strncasecmp(out, "USER\r\n", 6) == 0)  {
-                    if (send_string(fd, "-ERR No parameter detected\r\n") < 0) {
-                        break;
-                    }
-                    
-                } else {
-                    //get username of client
-                    strncpy(username, &out[5], strlen(out) - 7);
-
-                    //rejected if user is not in users.txt, otherwise proper reply
-                    if (is_valid_user(username, NULL) != 0) {
-                        if (send_string(fd, "+OK %s %s\r\n", username, "is a valid mailbox") < 0) {
-                            break;
-                        }
-
-                        //set last command to USER
-                        lastCommand = 'U';
-
-                    } else {
-                        if (send_string(fd, "-ERR never heard of %s\r\n", username) < 0) {
-                            break;
-                        }
-                    }
-                }
-                
-            } else {
-                if (send_string(fd, "-ERR Bad sequence of commands\r\n") < 0) {
-                    break;
-                }
-            }
-            
-        //==============================================================================================================
-            
-        //if command is PASS
-        } else if (strncasecmp(out, "PASS", 4) == 0) {
-            if (current == 'A' && lastCommand == 'U') {
-                
-                //rejected if no parameter
-                if (strncasecmp(out, "PASS\r\n", 6) == 0) {
-                    if (send_string(fd, "-ERR No parameter detected\r\n") < 0) {
-                        break;
-                    }
-                
-                } else {
-                    
-                    //get password of client
-                    strncpy(password, &out[5], strlen(out) - 7);
-                    
-                    //rejected if user/password not in users.txt, otherwise proper reply
-                    if (is_valid_user(username, password) != 0) {
-                        
-                        //load number of mail for user
-                        mail_list = load_user_mail(username);
-                        noOfMail = get_mail_count(mail_list);
-                        
-                        if (send_string(fd, "+OK %s%s %d %s\r\n", username, "'s maildrop has", noOfMail, "message(s)") < 0) {
-                            break;
-                        }
-                        
-                        //set last command to PASS
-                        //set current state to TRANSACTION
-                        lastCommand = 'P';
-                        current = 'T';
-                    
-                    } else {
-                        if (send_string(fd, "-ERR invalid password\r\n") < 0) {
-                            break;
-                        }
-                    }
-                }
-                
-            } else {
-                if (send_string(fd, "-ERR Must input USER first\r\n") < 0) {
-                    break;
-                }
-            }
-            
-            
-        //==============================================================================================================
-            
-        //if command is STAT
-        } else if (strncasecmp(out, "STAT", 4) == 0) {
-            if (current == 'T') {
-                
-                //rejected if parameter specified
-                if (strncasecmp(out, "STAT\r\n", 6) == 0) {
-                    
-                    //load number of mail for user
-                    int mail_count = get_mail_count(mail_list);
-                    
-                    //load total size of mail in bytes
-                    int mail_size = get_mail_list_size(mail_list);
-                    
-                    if (send_string(fd, "+OK %d %d\r\n", mail_count, mail_size) < 0) {
-                        break;
-                    }
-                
-                } else {
-                    if (send_string(fd, "-ERR Parameter specified\r\n") < 0) {
-                        break;
-                    }
-                }
-                
-            } else {
-                if (send_string(fd, "-ERR Need to complete AUTHORIZATION\r\n") < 0) {
-                    break;
-                }
-            }
-            
-        //==============================================================================================================
-            
-        //if command is LIST
-        } else if (strncasecmp(out, "LIST", 4) == 0) {
-            if (current == 'T') {
-                
-                //load number of mail for user
-                int mail_count = get_mail_count(mail_list);
-                
-                //load total size of mail in bytes
-                int mail_size = get_mail_list_size(mail_list);
-                
-                //if no parameter specified
-                if (strncasecmp(out, "LIST\r\n", 6) == 0) {
-                    
-                    if (send_string(fd, "+OK %d %s%d %s\r\n", mail_count, "message(s) (", mail_size, "octets)") < 0) {
-                        break;
-                    }
-                    
-                    //need to use old mail count to iterate through all elements
-                    for (int i = 0; i < noOfMail; i++) {
-                        //get size of mail item
-                        mail_item_t getItem = get_mail_item(mail_list, i);
-             
-                        //if item is not deleted
-                        if (getItem != NULL) {
-                            
-                            //get size of each individual mail
-                            int ind_mail_size = get_mail_item_size(getItem);
-                            
-                            if (send_string(fd, "+OK %d %d\r\n", i + 1, ind_mail_size) < 0) {
-                                break;
-                            }
-                        }
-                    }
-                    //to end multiline replies
-                    if (send_string(fd, ".\r\n") < 0) {
-                        break;
-                    }
-                    
-                //if parameter specified
-                } else {
-                    //get parameter of client
-                    int result = getParameter(out);
-                    
-                    //properly replies with single line reply containing number and size
-                    if (result != 0) {
-                            
-                            mail_item_t getItem = get_mail_item(mail_list, result - 1);
-                            
-                            //if item is deleted or non-existent
-                            if (getItem == NULL) {
-                                if (send_string(fd, "-ERR No such message\r\n") < 0) {
-                                    break;
-                                }
-                                
-                            } else {
-                                //get size of mail item
-                                int mail_size = get_mail_item_size(getItem);
-                                
-                                if (send_string(fd, "+OK %d %d\r\n", result, mail_size) < 0) {
-                                    break;
-                                }
-                            }
-                    } else {
-                        if (send_string(fd, "-ERR Invalid parameter specified\r\n") < 0) {
-                            break;
-                        }
-                    }
-                }
-                
-            //not in transaction stage
-            } else {
-                if (send_string(fd, "-ERR Need to complete AUTHORIZATION\r\n") < 0) {
-                    break;
-                }
-            }
-            
-        //==============================================================================================================
-            
-        //if command is DELE
-        } else if (strncasecmp(out, "DELE", 4) == 0) {
-            if (current == 'T') {
-                //if no parameter specified
-                if (strncasecmp(out, "DELE\r\n", 6) == 0) {
-                    if (send_string(fd, "-ERR No parameter detected\r\n") < 0) {
-                        break;
-                    }
-                    
-                } else {
-                    //get parameter of client
-                    int result = getParameter(out);
-                    
-                    if (result != 0) {
-                        
-                        //load number of mail for user
-                        int mail_count = get_mail_count(mail_list);
-                        
-                        //if non-existent mail
-                        if (result > mail_count) {
-                            if (send_string(fd, "-ERR No such message\r\n") < 0) {
-                                break;
-                            }
-                        }
-                        
-                        //mark message deleted
-                        mail_item_t getItem = get_mail_item(mail_list, result - 1);
-                        
-                        if (getItem == NULL) {
-                            if (send_string(fd, "-ERR message %d %s\r\n", result, "already deleted") < 0) {
-                                break;
-                            }
-                            
-                        } else {
-                            mark_mail_item_deleted(getItem);
-                            if (send_string(fd, "+OK message %d %s\r\n", result, "deleted") < 0) {
-                                break;
-                            }
-                        }
-                        
-                    } else {
-                        if (send_string(fd, "-ERR Invalid parameter specified\r\n") < 0) {
-                            break;
-                        }
-                    }
-                }
-
-            } else {
-                if (send_string(fd, "-ERR Need to complete AUTHORIZATION\r\n") < 0) {
-                    break;
-                }
-            }
         
-        //==============================================================================================================
-            
-        //if command is RSET
-        } else if (strncasecmp(out, "RSET", 4) == 0) {
-            if (current == 'T') {
-                
-                //rejected if parameter specified
-                if (strncasecmp(out, "RSET\r\n", 6) == 0) {
-                    //reset deleted fields
-                    //number of recovered mails
-                    int mail_count = reset_mail_list_deleted_flag(mail_list);
-                    
-                    if (send_string(fd, "+OK maildrop has %d %s\r\n", mail_count, "message(s)") < 0) {
-                        break;
-                    }
-                    
-                } else {
-                    if (send_string(fd, "-ERR Invalid parameter specified\r\n") < 0) {
-                        break;
-                    }
-                }
+        //the verb is looked up in the table of the current state, handlers return < 0 to close the connection
+        const struct proto_table *table = session.current == 'T' ? &tableTransaction : &tableAuthorization;
+        if (proto_dispatch(table, &session, out, size) < 0) {
+            break;
+        }
+    }
+    
+    nb_destroy(nb);
+    reportSession(session.arena);
+    arena_destroy(session.arena);
+}
 
-            } else {
-                if (send_string(fd, "-ERR Need to complete AUTHORIZATION\r\n") < 0) {
-                    break;
-                }
-            }
+//==============================================================================================================
+
+//if command is NOOP (only in TRANSACTION state)
+static int popNoop(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    return send_fixed(session->fd, "+OK\r\n");
+}
+
+//==============================================================================================================
+
+//if command is USER (only in AUTHORIZATION state)
+static int popUser(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    
+    //rejected if no parameter
+    if (cmd->arg_length == 0) {
+        return send_fixed(session->fd, "-ERR No parameter detected\r\n");
+    }
+    
+    //get username of client
+    int len = cmd->arg_length < sizeof(session->username) ? cmd->arg_length : sizeof(session->username) - 1;
+    memcpy(session->username, cmd->arg, len);
+    session->username[len] = '\0';
+    
+    //rejected if user is not in users.txt, otherwise proper reply
+    if (is_valid_user(session->username, NULL) == 0) {
+        reply_start(&session->reply, "-ERR never heard of ");
+        reply_text(&session->reply, session->username);
+        reply_text(&session->reply, "\r\n");
+        return reply_send(session->fd, &session->reply);
+    }
+    
+    //front end of a storage cluster: the rest of the session is handled by the node owning the mailbox (see shard.c)
+    if (shard_enabled()) {
+        return proxyToNode(session, shard_lookup(session->username));
+    }
+    
+    //set last command to USER
+    session->lastCommand = 'U';
+    reply_start(&session->reply, "+OK ");
+    reply_text(&session->reply, session->username);
+    reply_text(&session->reply, " is a valid mailbox\r\n");
+    return reply_send(session->fd, &session->reply);
+}
+
+//==============================================================================================================
+
+//proxyToNode hands the client over to the storage node owning the mailbox: the USER command is sent on to the node,
+//which replies to it, and from then on bytes are relayed both ways without being looked at (see splice_connections)
+//returns -1 once the session is over, so the connection is closed
+int proxyToNode(struct pop_session *session, const struct shard_node *node) {
+    
+    int backend = connect_server(node->address, "110", NODE_TIMEOUT_SECONDS);
+    
+    //node must greet like any POP3 server before the client is handed over
+    char line[MAX_LINE_LENGTH + 1] = "";
+    net_buffer_t greeting = NULL;
+    if (backend >= 0) {
+        greeting = nb_create(backend, MAX_LINE_LENGTH, session->arena);
+    }
+    if (greeting == NULL || nb_read_line(greeting, line) < 3 || strncmp(line, "+OK", 3) != 0) {
+        if (backend >= 0) {
+            close(backend);
+        }
+        return send_fixed(session->fd, "-ERR [SYS/TEMP] mailbox server unavailable, try again later\r\n");
+    }
+    
+    //replies still held back for pipelined commands are released, the node's replies follow them
+    set_send_batching(session->fd, 0);
+    
+    //relay timeouts must not end an idle session, the client decides when it is over
+    struct timeval noTimeout = { 0 };
+    setsockopt(backend, SOL_SOCKET, SO_RCVTIMEO, &noTimeout, sizeof(noTimeout));
+    setsockopt(backend, SOL_SOCKET, SO_SNDTIMEO, &noTimeout, sizeof(noTimeout));
+    
+    //commands the client sent after USER are already in the buffer, and go right after it
+    reply_start(&session->reply, "USER ");
+    reply_text(&session->reply, session->username);
+    reply_text(&session->reply, "\r\n");
+    int rv = reply_send(backend, &session->reply);
+    
+    char pending[MAX_LINE_LENGTH];
+    while (rv >= 0 && nb_pending(session->nb) > 0) {
+        int size = nb_read(session->nb, pending, sizeof(pending));
+        rv = size > 0 ? send_all(backend, pending, size) : -1;
+    }
+    
+    if (rv >= 0) {
+        splice_connections(session->fd, backend);
+    }
+    close(backend);
+    return -1;
+}
+
+//==============================================================================================================
+
+//if command is PASS (only in AUTHORIZATION state)
+static int popPass(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    
+    if (session->lastCommand != 'U') {
+        return send_fixed(session->fd, "-ERR Must input USER first\r\n");
+    }
+    
+    //rejected if no parameter
+    if (cmd->arg_length == 0) {
+        return send_fixed(session->fd, "-ERR No parameter detected\r\n");
+    }
+    
+    //get password of client
+    char password[256];
+    int len = cmd->arg_length < sizeof(password) ? cmd->arg_length : sizeof(password) - 1;
+    memcpy(password, cmd->arg, len);
+    password[len] = '\0';
+    
+    //rejected if user/password not in users.txt, otherwise proper reply
+    if (is_valid_user(session->username, password) == 0) {
+        return send_fixed(session->fd, "-ERR invalid password\r\n");
+    }
+    
+    //number of mail for user comes from the usage counters, without reading the mailbox
+    int mail_count = get_user_mail_count(session->username);
+    if (mail_count < 0) {
+        loadMailbox(session);
+        mail_count = session->noOfMail;
+    }
+    
+    //set last command to PASS
+    //set current state to TRANSACTION
+    session->lastCommand = 'P';
+    session->current = 'T';
+    
+    reply_start(&session->reply, "+OK ");
+    reply_text(&session->reply, session->username);
+    reply_text(&session->reply, "'s maildrop has ");
+    reply_number(&session->reply, mail_count);
+    reply_text(&session->reply, " message(s)\r\n");
+    return reply_send(session->fd, &session->reply);
+}
+
+//==============================================================================================================
+
+//if command is STAT (only in TRANSACTION state)
+static int popStat(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    
+    //rejected if parameter specified
+    if (cmd->arg_length != 0) {
+        return send_fixed(session->fd, "-ERR Parameter specified\r\n");
+    }
+    
+    //message list is loaded by the first command that needs it
+    loadMailbox(session);
+    
+    //load number of mail and total size of mail in bytes
+    int mail_count = get_mail_count(session->mail_list);
+    int mail_size = get_mail_list_size(session->mail_list);
+    
+    reply_start(&session->reply, "+OK ");
+    reply_number(&session->reply, mail_count);
+    reply_text(&session->reply, " ");
+    reply_number(&session->reply, mail_size);
+    reply_text(&session->reply, "\r\n");
+    return reply_send(session->fd, &session->reply);
+}
+
+//==============================================================================================================
+
+//if command is LIST (only in TRANSACTION state)
+static int popList(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    
+    //message list is loaded by the first command that needs it
+    loadMailbox(session);
+    
+    //if parameter specified, properly replies with single line reply containing number and size
+    if (cmd->arg_length != 0) {
+        int result = getParameter(cmd);
         
-        //==============================================================================================================
-            
-        //if command is RETR
-        } else if (strncasecmp(out, "RETR", 4) == 0) {
-            if (current == 'T') {
-                
-                //rejected if no parameter specified
-                if (strncasecmp(out, "RETR\r\n", 6) == 0) {
-                    if (send_string(fd, "-ERR No parameter detected\r\n") < 0) {
-                        break;
-                    }
-                
-                } else {
-                    //get parameter of client
-                    int result = getParameter(out);
+        if (result == 0) {
+            return send_fixed(session->fd, "-ERR Invalid parameter specified\r\n");
+        }
         
-                    if (result != 0) {
-                        
-                        //if unable to read message file
-                        if (mail_list == NULL) {
-                            
-                            if (send_string(fd, "-ERR Unable to read message file\r\n") < 0) {
-                                break;
-                            }
-                          
-                        //mail_list is loaded properly
-                        } else {
-                            mail_item_t getItem = get_mail_item(mail_list, result - 1);
-                                
-                            //if item is deleted or nonexistent
-                            if (getItem == NULL) {
-                                send_string(fd, "-ERR No such message\r\n");
-                                
-                            //if item is not deleted and exists
-                            } else {
-                                //get size of each individual mail
-                                int ind_mail_size = get_mail_item_size(getItem);
-                                    
-                                if (send_string(fd, "+OK %d %s\r\n", ind_mail_size, "octets") < 0) {
-                                    break;
-                                }
-                                    
-                                //open a tempfile
-                                FILE *tempfile = fopen(get_mail_item_filename(getItem), "r");
-                                    
-                                char message[1024];
-                                    
-                                //if the file isn't null, iterate through and send the email message to user
-                                if (tempfile != NULL) {
-                                    while (fgets(message, 1024, tempfile)) {
-                                        send_string(fd, "%s", message);
-                                    }
-                                        
-                                    //close file and send the CLRF to user
-                                    fclose(tempfile);
-                                    send_string(fd, ".\r\n");
-                                    
-                                }
-                            }
-                        }
-                        
-                    } else {
-                        if (send_string(fd, "-ERR Invalid parameter specified\r\n") < 0) {
-                            break;
-                        }
-                    }
-                }
-                
-            } else {
-                if (send_string(fd, "-ERR Need to complete AUTHORIZATION\r\n") < 0) {
-                    break;
-                }
-            }
-            
-        //==============================================================================================================
-            
-        //if command is QUIT
-        } else if (strncasecmp(out, "QUIT", 4) == 0) {
-            if (current == 'A') {
-                send_string(fd, "+OK dewey POP3 server signing off\r\n");
-                break;
-                    
-            } else if (current == 'T') {
-                //delete those marked to be deleted
-                destroy_mail_list(mail_list);
-                
-                //number of mail destroyed (old count - new count)
-                int noDestroyed = noOfMail - get_mail_count(mail_list);
-                
-                if (noDestroyed != 0) {
-                    send_string(fd, "+OK dewey POP3 server signing off (%d %s\r\n", noDestroyed, "messages destroyed)");
-                } else {
-                    send_string(fd, "+OK dewey POP3 server signing off (maildrop empty)\r\n");
-                }
-                
-                current = 'U';
-                break;
-            }
-            
-        //==============================================================================================================
-            
-        } else if (strncasecmp(out, "APOP", 4) == 0 || strncmp(out, "TOP", 3) == 0 || strncmp(out, "UIDL", 4) == 0) {
-            if (send_string(fd, "-ERR Command not implemented\r\n") < 0) {
-                break;
+        mail_item_t getItem = get_mail_item(session->mail_list, result - 1);
+        
+        //if item is deleted or non-existent
+        if (getItem == NULL) {
+            return send_fixed(session->fd, "-ERR No such message\r\n");
+        }
+        
+        reply_start(&session->reply, "+OK ");
+        reply_number(&session->reply, result);
+        reply_text(&session->reply, " ");
+        reply_number(&session->reply, (int) get_mail_item_size(getItem));
+        reply_text(&session->reply, "\r\n");
+        return reply_send(session->fd, &session->reply);
+    }
+    
+    //load number of mail for user and total size of mail in bytes
+    int mail_count = get_mail_count(session->mail_list);
+    int mail_size = get_mail_list_size(session->mail_list);
+    
+    reply_start(&session->reply, "+OK ");
+    reply_number(&session->reply, mail_count);
+    reply_text(&session->reply, " message(s) (");
+    reply_number(&session->reply, mail_size);
+    reply_text(&session->reply, " octets)\r\n");
+    if (reply_send(session->fd, &session->reply) < 0) {
+        return -1;
+    }
+    
+    //need to use old mail count to iterate through all elements
+    for (int i = 0; i < session->noOfMail; i++) {
+        mail_item_t getItem = get_mail_item(session->mail_list, i);
+        
+        //if item is not deleted, send its size
+        if (getItem != NULL) {
+            reply_start(&session->reply, "+OK ");
+            reply_number(&session->reply, i + 1);
+            reply_text(&session->reply, " ");
+            reply_number(&session->reply, (int) get_mail_item_size(getItem));
+            reply_text(&session->reply, "\r\n");
+            if (reply_send(session->fd, &session->reply) < 0) {
+                return -1;
             }
+        }
+    }
+    
+    //to end multiline replies
+    return send_fixed(session->fd, ".\r\n");
+}
 
-        //==============================================================================================================
-            
+//==============================================================================================================
+
+//if command is DELE (only in TRANSACTION state)
+static int popDele(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    
+    //rejected if no parameter specified
+    if (cmd->arg_length == 0) {
+        return send_fixed(session->fd, "-ERR No parameter detected\r\n");
+    }
+    
+    //message list is loaded by the first command that needs it
+    loadMailbox(session);
+    
+    int result = getParameter(cmd);
+    if (result == 0) {
+        return send_fixed(session->fd, "-ERR Invalid parameter specified\r\n");
+    }
+    
+    //if non-existent mail (numbers go up to the pre-DELE count)
+    if (result > session->noOfMail) {
+        return send_fixed(session->fd, "-ERR No such message\r\n");
+    }
+    
+    mail_item_t getItem = get_mail_item(session->mail_list, result - 1);
+    if (getItem == NULL) {
+        reply_start(&session->reply, "-ERR message ");
+        reply_number(&session->reply, result);
+        reply_text(&session->reply, " already deleted\r\n");
+        return reply_send(session->fd, &session->reply);
+    }
+    
+    //mark message deleted
+    mark_mail_item_deleted(getItem);
+    reply_start(&session->reply, "+OK message ");
+    reply_number(&session->reply, result);
+    reply_text(&session->reply, " deleted\r\n");
+    return reply_send(session->fd, &session->reply);
+}
+
+//==============================================================================================================
+
+//if command is RSET (only in TRANSACTION state)
+static int popRset(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    
+    //rejected if parameter specified
+    if (cmd->arg_length != 0) {
+        return send_fixed(session->fd, "-ERR Invalid parameter specified\r\n");
+    }
+    
+    //reset deleted fields
+    //number of recovered mails
+    int mail_count = reset_mail_list_deleted_flag(session->mail_list);
+    
+    reply_start(&session->reply, "+OK maildrop has ");
+    reply_number(&session->reply, mail_count);
+    reply_text(&session->reply, " message(s)\r\n");
+    return reply_send(session->fd, &session->reply);
+}
+
+//==============================================================================================================
+
+//if command is RETR (only in TRANSACTION state)
+static int popRetr(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    int fd = session->fd;
+    
+    //rejected if no parameter specified
+    if (cmd->arg_length == 0) {
+        return send_fixed(fd, "-ERR No parameter detected\r\n");
+    }
+    
+    //message list is loaded by the first command that needs it
+    loadMailbox(session);
+    
+    int result = getParameter(cmd);
+    if (result == 0) {
+        return send_fixed(fd, "-ERR Invalid parameter specified\r\n");
+    }
+    
+    //if unable to read message file
+    if (session->mail_list == NULL) {
+        return send_fixed(fd, "-ERR Unable to read message file\r\n");
+    }
+    
+    mail_item_t getItem = get_mail_item(session->mail_list, result - 1);
+    
+    //if item is deleted or nonexistent
+    if (getItem == NULL) {
+        return send_fixed(fd, "-ERR No such message\r\n");
+    }
+    
+    //get size of each individual mail
+    int ind_mail_size = get_mail_item_size(getItem);
+    
+    //small messages come from the message cache shared by all sessions, without opening the file
+    size_t cached_size;
+    char *cached = read_mail_item(getItem, &cached_size);
+    
+    //open the message file before replying, so a missing file gets an error instead of a truncated reply
+    int mail_fd = cached != NULL ? -1 : open_mail_item(getItem);
+    
+    if (cached == NULL && mail_fd < 0) {
+        return send_fixed(fd, "-ERR Unable to read message file\r\n");
+    }
+    
+    //client is downloading messages in order, read the next ones ahead while this one is sent
+    if (result == session->lastRetr + 1) {
+        prefetchMessages(session->mail_list, result, session->noOfMail, &session->prefetched);
+    }
+    session->lastRetr = result;
+    
+    reply_start(&session->reply, "+OK ");
+    reply_number(&session->reply, ind_mail_size);
+    reply_text(&session->reply, " octets\r\n");
+    if (reply_send(fd, &session->reply) < 0) {
+        if (cached != NULL) {
+            free(cached);
         } else {
-            if (send_string(fd, "-ERR Syntax error, command unrecognized\r\n") < 0) {
-                break;
-            }
+            close(mail_fd);
         }
+        return -1;
+    }
+    
+    //cached message is already in wire format, just needs the terminating line
+    if (cached != NULL) {
+        int rv = send_all(fd, cached, cached_size);
+        free(cached);
+        return rv < 0 ? rv : send_fixed(fd, ".\r\n");
     }
+    
+    //send the email message to user, followed by the terminating line
+    return sendMessage(fd, mail_fd, getItem);
 }
 
-//getParameter will get the parameter for COMMANDS that have parameters with integer types
-//Used a char to digit conversion trick, where if you - '0' a char, it gives the digit value
-int getParameter(char out[]) {
+//==============================================================================================================
+
+//if command is TOP (only in TRANSACTION state)
+static int popTop(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    int fd = session->fd;
+    
+    //message list is loaded by the first command that needs it
+    loadMailbox(session);
+    
+    //message number and number of body lines, rejected if parameters are missing or invalid
+    int result = 0;
+    int lines = 0;
+    if (getTopParameters(cmd, &result, &lines) == 0) {
+        return send_fixed(fd, "-ERR Invalid parameter specified\r\n");
+    }
+    
+    mail_item_t getItem = session->mail_list == NULL ? NULL : get_mail_item(session->mail_list, result - 1);
     
-    //get parameter of client
-    char parameter[256] = "";
-    strncpy(parameter, &out[5], strlen(out) - 7);
+    //if item is deleted or nonexistent
+    if (getItem == NULL) {
+        return send_fixed(fd, "-ERR No such message\r\n");
+    }
+    
+    int mail_fd = open_mail_item(getItem);
+    if (mail_fd < 0) {
+        return send_fixed(fd, "-ERR Unable to read message file\r\n");
+    }
+    
+    if (send_fixed(fd, "+OK top of message follows\r\n") < 0) {
+        close(mail_fd);
+        return -1;
+    }
+    
+    //send header and first lines of body, followed by the terminating line
+    return sendTop(fd, mail_fd, getItem, lines);
+}
+
+//==============================================================================================================
+
+//if command is CAPA (RFC 2449), allowed in any state
+static int popCapa(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    
+    if (cmd->arg_length != 0) {
+        return send_fixed(session->fd, "-ERR Parameter specified\r\n");
+    }
+    
+    return send_fixed(session->fd, "+OK Capability list follows\r\nUSER\r\nTOP\r\nUIDL\r\nPIPELINING\r\n.\r\n");
+}
+
+//==============================================================================================================
+
+//if command is UIDL (only in TRANSACTION state)
+static int popUidl(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    
+    //message list is loaded by the first command that needs it
+    loadMailbox(session);
+    
+    //if no parameter specified, unique ids come from the loaded list, whole listing is sent in one write
+    if (cmd->arg_length == 0) {
+        return sendUidList(session->fd, session->mail_list, session->noOfMail);
+    }
+    
+    int result = getParameter(cmd);
+    if (result == 0) {
+        return send_fixed(session->fd, "-ERR Invalid parameter specified\r\n");
+    }
+    
+    mail_item_t getItem = get_mail_item(session->mail_list, result - 1);
+    
+    //if item is deleted or non-existent
+    if (getItem == NULL) {
+        return send_fixed(session->fd, "-ERR No such message\r\n");
+    }
+    
+    reply_start(&session->reply, "+OK ");
+    reply_number(&session->reply, result);
+    reply_text(&session->reply, " ");
+    reply_text(&session->reply, get_mail_item_uid(getItem));
+    reply_text(&session->reply, "\r\n");
+    return reply_send(session->fd, &session->reply);
+}
+
+//==============================================================================================================
+
+//if command is QUIT, allowed in any state
+static int popQuit(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    
+    if (session->current == 'A') {
+        send_fixed(session->fd, "+OK dewey POP3 server signing off\r\n");
+        return -1;
+    }
+    
+    //number of mail destroyed (old count - new count), counted before the list is freed
+    int noDestroyed = session->noOfMail - get_mail_count(session->mail_list);
+    
+    //delete those marked to be deleted
+    destroy_mail_list(session->mail_list);
+    session->mail_list = NULL;
+    
+    if (noDestroyed != 0) {
+        reply_start(&session->reply, "+OK dewey POP3 server signing off (");
+        reply_number(&session->reply, noDestroyed);
+        reply_text(&session->reply, " messages destroyed)\r\n");
+        reply_send(session->fd, &session->reply);
+    } else {
+        send_fixed(session->fd, "+OK dewey POP3 server signing off (maildrop empty)\r\n");
+    }
+    
+    session->current = 'U';
+    return -1;
+}
+
+//==============================================================================================================
+
+//USER sent after authentication
+static int popBadSequence(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    return send_fixed(session->fd, "-ERR Bad sequence of commands\r\n");
+}
+
+//PASS sent after authentication
+static int popNeedUser(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    return send_fixed(session->fd, "-ERR Must input USER first\r\n");
+}
+
+//TRANSACTION command sent before authentication
+static int popNeedAuthorization(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    return send_fixed(session->fd, "-ERR Need to complete AUTHORIZATION\r\n");
+}
+
+//known command this server does not support
+static int popNotImplemented(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    return send_fixed(session->fd, "-ERR Command not implemented\r\n");
+}
+
+//anything else
+static int popUnrecognized(void *data, const struct proto_command *cmd) {
+    struct pop_session *session = data;
+    return send_fixed(session->fd, "-ERR Syntax error, command unrecognized\r\n");
+}
+
+//==============================================================================================================
+
+void buildCommandTables(void) {
+    
+    //AUTHORIZATION state
+    proto_table_init(&tableAuthorization, popUnrecognized);
+    proto_table_add(&tableAuthorization, PROTO_VERB('U','S','E','R'), popUser);
+    proto_table_add(&tableAuthorization, PROTO_VERB('P','A','S','S'), popPass);
+    proto_table_add(&tableAuthorization, PROTO_VERB('Q','U','I','T'), popQuit);
+    proto_table_add(&tableAuthorization, PROTO_VERB('C','A','P','A'), popCapa);
+    proto_table_add(&tableAuthorization, PROTO_VERB('A','P','O','P'), popNotImplemented);
+    proto_table_add(&tableAuthorization, PROTO_VERB('N','O','O','P'), popNeedAuthorization);
+    proto_table_add(&tableAuthorization, PROTO_VERB('S','T','A','T'), popNeedAuthorization);
+    proto_table_add(&tableAuthorization, PROTO_VERB('L','I','S','T'), popNeedAuthorization);
+    proto_table_add(&tableAuthorization, PROTO_VERB('R','E','T','R'), popNeedAuthorization);
+    proto_table_add(&tableAuthorization, PROTO_VERB('D','E','L','E'), popNeedAuthorization);
+    proto_table_add(&tableAuthorization, PROTO_VERB('R','S','E','T'), popNeedAuthorization);
+    proto_table_add(&tableAuthorization, PROTO_VERB('T','O','P', 0 ), popNeedAuthorization);
+    proto_table_add(&tableAuthorization, PROTO_VERB('U','I','D','L'), popNeedAuthorization);
+    
+    //TRANSACTION state
+    proto_table_init(&tableTransaction, popUnrecognized);
+    proto_table_add(&tableTransaction, PROTO_VERB('U','S','E','R'), popBadSequence);
+    proto_table_add(&tableTransaction, PROTO_VERB('P','A','S','S'), popNeedUser);
+    proto_table_add(&tableTransaction, PROTO_VERB('Q','U','I','T'), popQuit);
+    proto_table_add(&tableTransaction, PROTO_VERB('C','A','P','A'), popCapa);
+    proto_table_add(&tableTransaction, PROTO_VERB('A','P','O','P'), popNotImplemented);
+    proto_table_add(&tableTransaction, PROTO_VERB('N','O','O','P'), popNoop);
+    proto_table_add(&tableTransaction, PROTO_VERB('S','T','A','T'), popStat);
+    proto_table_add(&tableTransaction, PROTO_VERB('L','I','S','T'), popList);
+    proto_table_add(&tableTransaction, PROTO_VERB('R','E','T','R'), popRetr);
+    proto_table_add(&tableTransaction, PROTO_VERB('D','E','L','E'), popDele);
+    proto_table_add(&tableTransaction, PROTO_VERB('R','S','E','T'), popRset);
+    proto_table_add(&tableTransaction, PROTO_VERB('T','O','P', 0 ), popTop);
+    proto_table_add(&tableTransaction, PROTO_VERB('U','I','D','L'), popUidl);
+}
+
+//getParameter will get the parameter for COMMANDS that have parameters with integer types
+//returns 0 if the parameter is not a positive number
+int getParameter(const struct proto_command *cmd) {
     
     //stores digit value of parameter
     int result = 0;
     
-    //find number of elements in parameter
-    int n = 0;
-    char p = ' ';
-    while (p!= '\0') {
-        n++;
-        p = parameter[n];
+    //numbers beyond 9 digits can't be a message number
+    if (cmd->arg_length > 9) {
+        return 0;
     }
     
     //small "atoi" function that gets the number in digit value from our parameter
-    for (int j = 0 ; j < n; j++) {
-
+    for (int j = 0; j < cmd->arg_length; j++) {
+        
         //if char at j is not a digit, then there is an issue -> set result to 0 and return it
-        if (parameter[j] < '0' || parameter[j] > '9') {
-            result = 0;
-            break;
+        if (cmd->arg[j] < '0' || cmd->arg[j] > '9') {
+            return 0;
         }
         
         //if char at j is fine, append it to our integer
-        result = result*10 + parameter[j] - '0';
+        result = result*10 + cmd->arg[j] - '0';
     }
     
     return result;
 }
+
+//sendMessage sends the contents of a message file (already open), followed by the terminating line
+//new messages are stored exactly as they are sent (CRLF, dot-stuffed), so they are sent with sendfile straight from the page cache
+//compressed messages are decompressed and sent in blocks, and messages saved by older versions are sent line by line
+int sendMessage(int fd, int mail_fd, mail_item_t item) {
+    
+    //stored in wire format and not compressed: no need to look at the contents at all
+    if (is_mail_item_wire_format(item) && !is_mail_item_compressed(item)) {
+        int rv = send_file(fd, mail_fd, get_mail_item_size(item));
+        close(mail_fd);
+        return rv < 0 ? rv : send_fixed(fd, ".\r\n");
+    }
+    
+    //gzdopen reads both compressed and raw message files
+    gzFile file = gzdopen(mail_fd, "r");
+    if (file == NULL) {
+        close(mail_fd);
+        return -1;
+    }
+    
+    int rv = 0;
+    
+    if (is_mail_item_wire_format(item)) {
+        
+        //compressed, but in wire format: send decompressed blocks as they are
+        char block[16384];
+        int n;
+        while (rv >= 0 && (n = gzread(file, block, sizeof(block))) > 0) {
+            rv = send_all(fd, block, n);
+        }
+        
+    } else {
+        
+        //older message: lines were stored as received (already dot-stuffed by the SMTP client), only line endings need fixing
+        char message[MAX_LINE_LENGTH + 2];
+        char last = '\n';
+        while (rv >= 0 && gzgets(file, message, MAX_LINE_LENGTH)) {
+            int len = strlen(message);
+            char before = len >= 2 ? message[len - 2] : last;
+            
+            //bare LF becomes CRLF
+            if (message[len - 1] == '\n' && before != '\r') {
+                message[len - 1] = '\r';
+                message[len++] = '\n';
+            }
+            last = message[len - 1];
+            rv = send_all(fd, message, len);
+        }
+        
+        //last line without line terminator
+        if (rv >= 0 && last != '\n') {
+            rv = send_fixed(fd, "\r\n");
+        }
+    }
+    
+    gzclose(file);
+    return rv < 0 ? rv : send_fixed(fd, ".\r\n");
+}
+
+//getTopParameters gets the two parameters of TOP (message number and number of lines)
+//returns 1 if both are valid (message number must be positive, lines can be zero), or 0 otherwise
+int getTopParameters(const struct proto_command *cmd, int *message, int *lines) {
+    
+    const char *arg_end = cmd->arg + cmd->arg_length;
+    char *end;
+    
+    //message number, at the start of the parameters
+    if (cmd->arg_length == 0 || !isdigit((unsigned char) cmd->arg[0])) {
+        return 0;
+    }
+    long value = strtol(cmd->arg, &end, 10);
+    if (value <= 0) {
+        return 0;
+    }
+    *message = value;
+    
+    //number of lines, after a space and followed only by the line terminator
+    char *start = end;
+    value = strtol(start, &end, 10);
+    if (end == start || *start != ' ' || value < 0 || end != arg_end) {
+        return 0;
+    }
+    *lines = value;
+    
+    return 1;
+}
+
+//sendTop sends the header block and the first lines of the body of a message (already open), followed by the terminating line
+//for new messages the length of the header block is known from delivery, so only the header and the requested lines are read
+//(typically a single read), no matter how large the message is; there is no per-line index, as the header size is enough
+//the line by line fallback is only for message files saved before the header size was recorded (no H= field in the
+//name, or not stored in wire format): those are read from the start of the message up to the same point, like RETR
+int sendTop(int fd, int mail_fd, mail_item_t item, int lines) {
+    
+    //gzdopen reads both compressed and raw message files
+    gzFile file = gzdopen(mail_fd, "r");
+    if (file == NULL) {
+        close(mail_fd);
+        return -1;
+    }
+    
+    int rv = 0;
+    size_t header = get_mail_item_header_size(item);
+    
+    if (is_mail_item_wire_format(item) && header > 0) {
+        
+        //header is sent as is, then body up to the end of the requested line
+        char block[16384];
+        int n;
+        while (rv >= 0 && (header > 0 || lines > 0) && (n = gzread(file, block, sizeof(block))) > 0) {
+            int send_len = header < n ? header : n;
+            header -= send_len;
+            
+            while (header == 0 && lines > 0 && send_len < n) {
+                char *nl = memchr(&block[send_len], '\n', n - send_len);
+                send_len = nl == NULL ? n : nl - block + 1;
+                lines -= nl != NULL;
+            }
+            rv = send_all(fd, block, send_len);
+        }
+        
+    } else {
+        
+        //older message: same as RETR, but stopping after the requested number of body lines
+        char message[MAX_LINE_LENGTH + 2];
+        char last = '\n';
+        int in_header = 1;
+        while (rv >= 0 && (in_header || lines > 0) && gzgets(file, message, MAX_LINE_LENGTH)) {
+            int len = strlen(message);
+            char before = len >= 2 ? message[len - 2] : last;
+            int line_start = last == '\n';
+            
+            //bare LF becomes CRLF
+            if (message[len - 1] == '\n' && before != '\r') {
+                message[len - 1] = '\r';
+                message[len++] = '\n';
+            }
+            last = message[len - 1];
+            
+            //empty line ends the header, and each complete body line counts
+            if (last == '\n') {
+                if (!in_header) {
+                    lines--;
+                } else if (line_start && len == 2) {
+                    in_header = 0;
+                }
+            }
+            rv = send_all(fd, message, len);
+        }
+        
+        //last line without line terminator
+        if (rv >= 0 && last != '\n') {
+            rv = send_fixed(fd, "\r\n");
+        }
+    }
+    
+    gzclose(file);
+    return rv < 0 ? rv : send_fixed(fd, ".\r\n");
+}
+
+//sendUidList sends the multi-line UIDL listing for all messages not marked as deleted
+//the unique ids are part of the loaded list, so no message file is opened,
+//and the listing is built in one buffer so it goes out in a single write
+int sendUidList(int fd, mail_list_t mail_list, int noOfMail) {
+    
+    //"+OK\r\n", one line per message and ".\r\n"
+    size_t capacity = 16;
+    for (int i = 0; i < noOfMail; i++) {
+        mail_item_t getItem = get_mail_item(mail_list, i);
+        if (getItem != NULL) {
+            capacity += strlen(get_mail_item_uid(getItem)) + 16;
+        }
+    }
+    
+    char *listing = malloc(capacity);
+    if (listing == NULL) {
+        return send_fixed(fd, "-ERR Unable to list messages\r\n");
+    }
+    
+    size_t len = sprintf(listing, "+OK\r\n");
+    for (int i = 0; i < noOfMail; i++) {
+        mail_item_t getItem = get_mail_item(mail_list, i);
+        if (getItem != NULL) {
+            len += sprintf(listing + len, "%d %s\r\n", i + 1, get_mail_item_uid(getItem));
+        }
+    }
+    len += sprintf(listing + len, ".\r\n");
+    
+    int rv = send_all(fd, listing, len);
+    free(listing);
+    return rv;
+}
+
+//loadMailbox loads the message list of the user the first time it is called in a session
+//PASS only reports the message count, so sessions that never look at their messages don't read the mailbox
+void loadMailbox(struct pop_session *session) {
+    
+    if (session->mailLoaded) {
+        return;
+    }
+    
+    session->mail_list = load_user_mail(session->username, session->arena);
+    session->noOfMail = get_mail_count(session->mail_list);
+    session->mailLoaded = 1;
+}
+
+//prefetchMessages asks the kernel to start reading the messages after message number result from disk
+//it reads up to MAIL_PREFETCH_DEPTH messages ahead (0, the default, turns read-ahead off); every session runs in
+//its own forked worker, so the bytes read ahead are taken from a budget shared by all workers (MAIL_PREFETCH_RATE
+//bytes per minute, see ratelimit.c) and read-ahead stops when it runs out; prefetched keeps how far messages
+//were already read ahead
+void prefetchMessages(mail_list_t mail_list, int result, int noOfMail, int *prefetched) {
+    
+    long depth = config_long("MAIL_PREFETCH_DEPTH", 0);
+    
+    //positions start at 0, so position result is the message after the one being retrieved
+    for (int i = result > *prefetched ? result : *prefetched; i < result + depth && i < noOfMail; i++) {
+        mail_item_t getItem = get_mail_item(mail_list, i);
+        if (getItem != NULL) {
+            if (!ratelimit_take(RATE_KEY_SERVER, RATE_PREFETCH, get_mail_item_size(getItem))) {
+                break;
+            }
+            prefetch_mail_item(getItem);
+        }
+        *prefetched = i + 1;
+    }
+}
+
+//==============================================================================================================
+
+//reportSession prints how many allocations the session made (and how much memory they took) when MAIL_SESSION_STATS is set
+void reportSession(arena_t arena) {
+    
+    if (config_long("MAIL_SESSION_STATS", 0) == 0) {
+        return;
+    }
+    
+    struct arena_stats stats;
+    arena_stats(arena, &stats);
+    fprintf(stderr, "mypopd[%d]: %zu allocations, %zu bytes, %zu blocks\n",
+            (int) getpid(), stats.allocations, stats.bytes, stats.blocks);
+}
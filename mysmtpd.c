@@ -1,6 +1,16 @@
 #include "netbuffer.h"
 #include "mailuser.h"
 #include "server.h"
+#include "spool.h"
+#include "protocol.h"
+#include "config.h"
+#include "arena.h"
+#include "queue.h"
+#include "relay.h"
+#include "ratelimit.h"
+#include "filter.h"
+#include "replica.h"
+#include "shard.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,8 +20,48 @@
 
 #define MAX_LINE_LENGTH 1024
 
+//everything a client connection needs is kept in the session, which is passed to the command handlers
+struct smtp_session {
+    int fd;
+    net_buffer_t nb;
+    
+    //current represents current state
+    //N : None
+    //H : "HELO"
+    //M : "MAIL"
+    //R : "RCPT"
+    //D : "DATA"
+    //E : "END"
+    char current;
+    
+    char hostname[256];
+    user_list_t recipients;
+    
+    //sender of the message, and recipients that are not local users (only when relaying, see relay.c)
+    char sender[256];
+    user_list_t relayed;
+    
+    //client address, as known to the shared rate limits (see ratelimit.c)
+    uint64_t peer;
+    
+    //set if the client is in a network allowed to relay (MAIL_RELAY_CLIENTS, see relay.c)
+    int mayRelay;
+    
+    //memory of the session comes from its arena, everything allocated after transaction is freed after each message
+    arena_t arena;
+    struct arena_mark transaction;
+    
+    //replies that depend on the command are built here, without allocating (see reply_start)
+    struct reply reply;
+};
+
 static void handle_client(int fd);
-static void saveMessages(int fd, net_buffer_t nb, char current, user_list_t recipients);
+static void buildCommandTables(void);
+static const struct proto_table *commandTable(char current);
+static int getAddress(const struct proto_command *cmd, const char *prefix, char address[256]);
+static int saveMessages(struct smtp_session *session, struct filter_verdict *verdict);
+static int forwardToNodes(struct smtp_session *session, const char *file, const char *info);
+static void reportSession(const char *server, arena_t arena);
 
 int main(int argc, char *argv[]) {
   
@@ -20,6 +70,22 @@ int main(int argc, char *argv[]) {
     return 1;
   }
   
+  if (replica_is_standby()) {
+    fprintf(stderr, "%s: mail storage is a replication standby, promote it first\n", argv[0]);
+    return 1;
+  }
+  
+  // Undo deliveries interrupted by a crash of an earlier server, before anyone delivers again
+  recover_deliveries();
+  
+  buildCommandTables();
+  set_connection_limit("421 Too many connections from your address, try again later\r\n");
+  
+  // Messages are saved to mailboxes by queue workers, so sessions don't wait for it
+  queue_start_workers(config_long("MAIL_QUEUE_WORKERS", 2));
+  relay_start_scheduler();
+  replica_start_shipper();
+  
   run_server(argv[1], handle_client);
   
   return 0;
@@ -30,35 +96,38 @@ int main(int argc, char *argv[]) {
 //recipients must be limited to ones supported by system (users.txt)
 void handle_client(int fd) {
 
-    //current represents current state
-    //N : None
-    //H : "HELO"
-    //M : "MAIL"
-    //R : "RCPT"
-    //D : "DATA"
-    //E : "END"
-    char current = 'N';
+    struct smtp_session session;
+    session.fd = fd;
+    session.current = 'N';
+    session.peer = ratelimit_peer(fd);
+    session.mayRelay = relay_client_allowed(fd);
     
     //==============================================================================================================
     
     //researched from https://stackoverflow.com/questions/5190553/linux-c-get-server-hostname/5190590
-    char hostname[256];
-    gethostname(hostname, 256);
+    gethostname(session.hostname, sizeof(session.hostname));
 
     //send greeting (welcoming) message
-    send_string(fd, "220 %s %s\r\n", hostname, "Simple Mail Transfer Service Ready");
+    reply_start(&session.reply, "220 ");
+    reply_text(&session.reply, session.hostname);
+    reply_text(&session.reply, " Simple Mail Transfer Service Ready\r\n");
+    reply_send(fd, &session.reply);
     
     //==============================================================================================================
     
     //creating our list of recipients (updated in RCPT case)
-    user_list_t recipients = create_user_list();
+    session.recipients = create_user_list();
+    session.relayed = create_user_list();
+    session.sender[0] = '\0';
     
     //==============================================================================================================
 
-    net_buffer_t nb = nb_create(fd, MAX_LINE_LENGTH);
+    session.arena = arena_create(MAX_LINE_LENGTH * 4);
+    session.nb = nb_create(fd, MAX_LINE_LENGTH, session.arena);
+    session.transaction = arena_mark(session.arena);
     
     //what client is sending
-    char out[MAX_LINE_LENGTH] = "";
+    char out[MAX_LINE_LENGTH + 1] = "";
     
     //==============================================================================================================
     
@@ -66,261 +135,463 @@ void handle_client(int fd) {
     while(1) {
         //==============================================================================================================
         
-        int size = nb_read_line(nb, out);
-        
-        //properly replies with 500 error if line is too long
-        if (size > MAX_LINE_LENGTH) {
-            if (send_string(fd, "500 Syntax error, command line too long\r\n") < 0) {
-                break;
-            }
+        int size = nb_read_line(session.nb, out);
         
         //Properly closes connection if read (or nb_read_line) returns <= 0
-        } else if (size <= 0) {
+        if (size <= 0) {
             break;
         }
-    
-        //==============================================================================================================
-        
-        //if command is QUIT
-        if (strncasecmp(out, "QUIT", 4) == 0) {
-            if (strlen(out) != 6) {
-                //set command as first 4 char of client input
-                if (send_string(fd, "455 Server unable to accommodate parameters\r\n") < 0) {
-                    break;
-                }
-                
-            //if current state isn't data
-            } else if (current != 'D') {
-                send_string(fd, "221 %s %s\r\n", hostname, "Service closing transmission channel");
-                break;
-            }
         
-        //==============================================================================================================
+        //properly replies with 500 error if line is too long (no line terminator within the buffer)
+        if (size == MAX_LINE_LENGTH && out[size - 1] != '\n') {
+            //rest of the line is discarded, so it is not taken as another command
+            while (size == MAX_LINE_LENGTH && out[size - 1] != '\n' && (size = nb_read_line(session.nb, out)) > 0);
             
-        //if command is NOOP
-        } else if (strncasecmp(out, "NOOP", 4) == 0) {
-            //if current state isn't data
-            if (current != 'D') {
-                if (send_string(fd, "250 OK\r\n") < 0) {
-                    break;
-                }
+            if (size <= 0 || send_fixed(fd, "500 Syntax error, command line too long\r\n") < 0) {
+                break;
             }
-            
+            continue;
+        }
+    
         //==============================================================================================================
         
-        //if command is HELO
-        } else if (strncasecmp(out, "HELO", 4) == 0) {
-            //if current state isn't None, HELO cannot be sent
-            if (current != 'N') {
-                if (send_string(fd, "503 Bad sequence of commands\r\n") < 0) {
-                    break;
-            }
+        //the verb is looked up in the table of the current state, handlers return < 0 to close the connection
+        if (proto_dispatch(commandTable(session.current), &session, out, size) < 0) {
+            break;
+        }
+    }
+    
+    //recipients and buffer are freed with the arena
+    nb_destroy(session.nb);
+    reportSession("mysmtpd", session.arena);
+    arena_destroy(session.arena);
+}
 
-            //Properly replies with 500 if command is valid but is not followed by space
-            } else if (strncmp(&out[4], " ", 1) != 0) {
-                if (send_string(fd, "500 Syntax error, command is valid but is not followed by space\r\n") < 0) {
-                    break;
-                }
-                
-            } else {
-                //get domain of client
-                //have to initialize or I get garbage characters for some reason
-                char domain[256] = "";
-                
-                strncpy(domain, &out[5], strlen(out) - 5 - 2);
-                
-                //send HELO response to client
-                if (send_string(fd, "250 %s %s%s %s\r\n", "Hello", domain, ", pleased to meet you. I am", hostname) < 0) {
-                    break;
-                }
-                
-                //set state as HELO
-                current = 'H';
-            }
+//==============================================================================================================
+
+//if command is QUIT
+static int smtpQuit(void *data, const struct proto_command *cmd) {
+    struct smtp_session *session = data;
+    
+    if (cmd->arg_length != 0) {
+        return send_fixed(session->fd, "455 Server unable to accommodate parameters\r\n");
+    }
+    
+    reply_start(&session->reply, "221 ");
+    reply_text(&session->reply, session->hostname);
+    reply_text(&session->reply, " Service closing transmission channel\r\n");
+    reply_send(session->fd, &session->reply);
+    return -1;
+}
+
+//==============================================================================================================
+
+//if command is NOOP
+static int smtpNoop(void *data, const struct proto_command *cmd) {
+    struct smtp_session *session = data;
+    return send_fixed(session->fd, "250 OK\r\n");
+}
+
+//==============================================================================================================
+
+//if command is HELO (only in state None, see buildCommandTables)
+static int smtpHelo(void *data, const struct proto_command *cmd) {
+    struct smtp_session *session = data;
+    
+    //Properly replies with 500 if command is valid but is not followed by space
+    if (cmd->arg_length == 0) {
+        return send_fixed(session->fd, "500 Syntax error, command is valid but is not followed by space\r\n");
+    }
+    
+    //send HELO response to client, with the domain of client
+    reply_start(&session->reply, "250 Hello ");
+    reply_span(&session->reply, cmd->arg, cmd->arg_length);
+    reply_text(&session->reply, ", pleased to meet you. I am ");
+    reply_text(&session->reply, session->hostname);
+    reply_text(&session->reply, "\r\n");
+    if (reply_send(session->fd, &session->reply) < 0) {
+        return -1;
+    }
+    
+    //set state as HELO
+    session->current = 'H';
+    return 0;
+}
+
+//==============================================================================================================
+
+//if command is MAIL (only in state HELO)
+static int smtpMail(void *data, const struct proto_command *cmd) {
+    struct smtp_session *session = data;
+    
+    //get address of client user, rejected if parameter is not FROM:<...>
+    char address[256];
+    if (getAddress(cmd, "FROM:<", address) == 0) {
+        return send_fixed(session->fd, "501 Syntax error in parameters or arguments\r\n");
+    }
+    
+    //each message counts against the sender's rate, checked before any recipient is taken
+    if (!ratelimit_take(session->peer, RATE_MESSAGES, 1)) {
+        return send_fixed(session->fd, "451 Too many messages from your address, try again later\r\n");
+    }
+    
+    strcpy(session->sender, address);
+    
+    //send MAIL response to client
+    reply_start(&session->reply, "250 ");
+    reply_text(&session->reply, address);
+    reply_text(&session->reply, " ... Sender ok\r\n");
+    if (reply_send(session->fd, &session->reply) < 0) {
+        return -1;
+    }
+    
+    //set state as MAIL
+    session->current = 'M';
+    return 0;
+}
+
+//==============================================================================================================
+
+//if command is RCPT (only in states MAIL and RCPT)
+static int smtpRcpt(void *data, const struct proto_command *cmd) {
+    struct smtp_session *session = data;
+    
+    //get address of recipient, rejected if parameter is not TO:<...>
+    char address[256];
+    if (getAddress(cmd, "TO:<", address) == 0) {
+        return send_fixed(session->fd, "501 Syntax error in parameters or arguments\r\n");
+    }
+    
+    //clients that already sent too much data are stopped before they send more
+    if (!ratelimit_take(session->peer, RATE_BYTES, 0)) {
+        return send_fixed(session->fd, "452 Too much data from your address, try again later\r\n");
+    }
+    
+    //if recipient is a known user, continue or else send error code
+    int valid = is_valid_user(address, NULL);
+    
+    if (valid != 0 && is_user_over_quota(address) != 0) {
+        //rejected before DATA, based on shared usage counters (no mailbox scan)
+        reply_start(&session->reply, "552 ");
+        reply_text(&session->reply, address);
+        reply_text(&session->reply, " ... Mailbox full, exceeded storage allocation\r\n");
         
-        //==============================================================================================================
-            
-        //if command is MAIL
-        } else if (strncasecmp(out, "MAIL", 4) == 0) {
-            //if current state is not HELO or DATA
-            if (current != 'H' && current != 'D') {
-                if (send_string(fd, "503 Bad sequence of commands\r\n") < 0) {
-                    break;
-                }
-                
-            //Rejected if parameter is not FROM:<...>\r\n
-            } else if (strncasecmp(&out[4], " FROM:<", 7) != 0 || strncasecmp(&out[strlen(out) - 3], ">\r\n", 3) != 0) {
-                //for (int i = 0; i < sizeof out; i ++) {
-                //printf(" %2x", out[i]);
-                //}
-                if (send_string(fd, "501 Syntax error in parameters or arguments\r\n") < 0) {
-                    break;
-                }
-                
-            } else {
-                //get address of client user
-                char address[256] = "";
-                
-                int leftindex = strchr(out,'<') - out + 1;
-                int rightindex = strchr(out,'>') - out;
-       
-                strncpy(address, &out[leftindex], rightindex - leftindex);
-                
-                //send MAIL response to client
-                if (send_string(fd, "250 %s %s\r\n", address, "... Sender ok") < 0) {
-                    break;
-                }
-                
-                //set state as MAIL
-                current = 'M';
-            }
+    } else if (valid != 0) {
+        //send RCPT response to client
+        reply_start(&session->reply, "250 ");
+        reply_text(&session->reply, address);
+        reply_text(&session->reply, " ... Recipient ok\r\n");
+        add_user_to_list(&session->recipients, address, session->arena);
+        
+    } else if (session->mayRelay && strchr(address, '@') != NULL) {
+        //not a local user, message will be sent on through the smarthost
+        reply_start(&session->reply, "250 ");
+        reply_text(&session->reply, address);
+        reply_text(&session->reply, " ... Recipient ok (will relay)\r\n");
+        add_user_to_list(&session->relayed, address, session->arena);
+        
+    } else if (relay_enabled() && strchr(address, '@') != NULL) {
+        //relaying is only for known client networks, otherwise anyone could send anywhere through this server
+        reply_start(&session->reply, "550 ");
+        reply_text(&session->reply, address);
+        reply_text(&session->reply, " ... Relaying denied\r\n");
+        
+    } else {
+        reply_start(&session->reply, "550 No such user ");
+        reply_text(&session->reply, address);
+        reply_text(&session->reply, "\r\n");
+    }
+    
+    session->current = 'R';
+    return reply_send(session->fd, &session->reply);
+}
 
-        //==============================================================================================================
-            
-        //if command is RCPT
-        } else if (strncasecmp(out, "RCPT", 4) == 0) {
-            //if current state is not MAIL or RCPT
-            if (current != 'M' && current != 'R') {
-                if (send_string(fd, "503 Bad sequence of commands\r\n") < 0) {
-                    break;
-                }
-            
-            //Rejected if parameter is not TO:<...>\r\n
-            } else if (strncasecmp(&out[4], " TO:<", 5) != 0 || strncasecmp(&out[strlen(out) - 3], ">\r\n", 3) != 0) {
-                if (send_string(fd, "501 Syntax error in parameters or arguments\r\n") < 0) {
-                    break;
-                }
+//==============================================================================================================
 
-            } else {
-                //get address of recipient
-                char address[256] = "";
-                
-                int leftindex = strchr(out,'<') - out + 1;
-                int rightindex = strchr(out,'>') - out;
-                
-                strncpy(address, &out[leftindex], rightindex - leftindex);
-                
-                //if recipient is a known user, continue or else send error code
-                if (is_valid_user(address, NULL) != 0) {
-                    //send RCPT response to client
-                    if (send_string(fd, "250 %s %s\r\n", address, "... Recipient ok") < 0) {
-                        break;
-                    }
-                    
-                    add_user_to_list(&recipients, address);
-                    current = 'R';
-                } else {
-                    if (send_string(fd, "550 %s %s\r\n", "No such user", address) < 0) {
-                        break;
-                    }
-                    current = 'R';
-                }
-            }
-            
-        //==============================================================================================================
-            
-        //if command is DATA
-        } else if (strncasecmp(out, "DATA", 4) == 0) {
-            //if current state is not RCPT
-            if (current != 'R') {
-                if (send_string(fd, "503 Bad sequence of commands\r\n") < 0) {
-                    break;
-                }
-                
-            } else if (strlen(out) != 6) {
-                //set command as first 4 char of client input
-                if (send_string(fd, "455 Server unable to accommodate parameters\r\n") < 0) {
-                    break;
-                }
-                
-            } else if (recipients == NULL) {
-                if (send_string(fd, "554 No Valid Recipients\r\n") < 0) {
-                    break;
-                }
-                
-            } else {
-                if (send_string(fd, "354 Start mail input; end with <CRLF>.<CRLF>\r\n") < 0) {
-                    break;
-                }
-                
-                current = 'D';
-                
-                //helper function to save messages
-                saveMessages(fd, nb, current, recipients);
-                
-                if (current == 'D') {
-                    if (send_string(fd, "250 OK\r\n") < 0) {
-                        break;
-                    }
-                }
-                //set back to HELO state so MAIL can run again
-                current = 'H';
-                destroy_user_list(recipients);
-            }
-            
-        //==============================================================================================================
-            
-        } else if (strncasecmp(out, "EHLO", 4) == 0 || strncasecmp(out, "RSET", 4) == 0 || strncasecmp(out, "VRFY", 4) == 0 || strncasecmp(out, "EXPN", 4) == 0 || strncasecmp(out, "HELP", 4) == 0){
-            
-            if (send_string(fd, "502 Command not implemented\r\n") < 0) {
-                break;
-            }
+//if command is DATA (only in state RCPT)
+static int smtpData(void *data, const struct proto_command *cmd) {
+    struct smtp_session *session = data;
+    
+    if (cmd->arg_length != 0) {
+        return send_fixed(session->fd, "455 Server unable to accommodate parameters\r\n");
+    }
+    
+    if (session->recipients == NULL && session->relayed == NULL) {
+        return send_fixed(session->fd, "554 No Valid Recipients\r\n");
+    }
+    
+    if (!ratelimit_take(session->peer, RATE_BYTES, 0)) {
+        return send_fixed(session->fd, "452 Too much data from your address, try again later\r\n");
+    }
+    
+    if (send_fixed(session->fd, "354 Start mail input; end with <CRLF>.<CRLF>\r\n") < 0) {
+        return -1;
+    }
+    
+    session->current = 'D';
+    
+    //helper function to save messages, returns -1 if no recipient got the message
+    struct filter_verdict verdict = { .action = FILTER_ACCEPT };
+    int saved = saveMessages(session, &verdict);
+    
+    //set back to HELO state so MAIL can run again, recipients are freed in one step
+    session->current = 'H';
+    session->recipients = create_user_list();
+    session->relayed = create_user_list();
+    arena_reset(session->arena, session->transaction);
+    
+    //message refused by the content filters (only when they run before the reply)
+    if (verdict.action != FILTER_ACCEPT) {
+        reply_start(&session->reply, verdict.action == FILTER_REJECT ? "554 " : "451 ");
+        reply_text(&session->reply, verdict.reason);
+        reply_text(&session->reply, "\r\n");
+        return reply_send(session->fd, &session->reply);
+    }
+    
+    if (saved < 0) {
+        return send_fixed(session->fd, "451 Requested action aborted: local error in processing\r\n");
+    }
+    return send_fixed(session->fd, "250 OK\r\n");
+}
+
+//==============================================================================================================
+
+//known command sent in a state where it is not allowed
+static int smtpBadSequence(void *data, const struct proto_command *cmd) {
+    struct smtp_session *session = data;
+    return send_fixed(session->fd, "503 Bad sequence of commands\r\n");
+}
+
+//known command this server does not support
+static int smtpNotImplemented(void *data, const struct proto_command *cmd) {
+    struct smtp_session *session = data;
+    return send_fixed(session->fd, "502 Command not implemented\r\n");
+}
+
+//anything else
+static int smtpUnrecognized(void *data, const struct proto_command *cmd) {
+    struct smtp_session *session = data;
+    return send_fixed(session->fd, "500 Syntax error, command unrecognized\r\n");
+}
+
+//==============================================================================================================
+
+//one command table per state (None, HELO, MAIL, RCPT), so each verb is found in a single lookup
+//with the handler that applies in that state; built once before any client is accepted
+static struct proto_table tableNone, tableHelo, tableMail, tableRcpt;
+
+void buildCommandTables(void) {
+    
+    struct proto_table *tables[] = { &tableNone, &tableHelo, &tableMail, &tableRcpt };
+    
+    //commands allowed in every state, and commands that are known but not allowed (or not supported)
+    for (int i = 0; i < 4; i++) {
+        proto_table_init(tables[i], smtpUnrecognized);
+        proto_table_add(tables[i], PROTO_VERB('Q','U','I','T'), smtpQuit);
+        proto_table_add(tables[i], PROTO_VERB('N','O','O','P'), smtpNoop);
+        proto_table_add(tables[i], PROTO_VERB('H','E','L','O'), smtpBadSequence);
+        proto_table_add(tables[i], PROTO_VERB('M','A','I','L'), smtpBadSequence);
+        proto_table_add(tables[i], PROTO_VERB('R','C','P','T'), smtpBadSequence);
+        proto_table_add(tables[i], PROTO_VERB('D','A','T','A'), smtpBadSequence);
+        proto_table_add(tables[i], PROTO_VERB('E','H','L','O'), smtpNotImplemented);
+        proto_table_add(tables[i], PROTO_VERB('R','S','E','T'), smtpNotImplemented);
+        proto_table_add(tables[i], PROTO_VERB('V','R','F','Y'), smtpNotImplemented);
+        proto_table_add(tables[i], PROTO_VERB('E','X','P','N'), smtpNotImplemented);
+        proto_table_add(tables[i], PROTO_VERB('H','E','L','P'), smtpNotImplemented);
+    }
+    
+    //commands that move the session forward
+    proto_table_add(&tableNone, PROTO_VERB('H','E','L','O'), smtpHelo);
+    proto_table_add(&tableHelo, PROTO_VERB('M','A','I','L'), smtpMail);
+    proto_table_add(&tableMail, PROTO_VERB('R','C','P','T'), smtpRcpt);
+    proto_table_add(&tableRcpt, PROTO_VERB('R','C','P','T'), smtpRcpt);
+    proto_table_add(&tableRcpt, PROTO_VERB('D','A','T','A'), smtpData);
+}
+
+//commandTable returns the command table for a state
+const struct proto_table *commandTable(char current) {
+    switch (current) {
+        case 'H': return &tableHelo;
+        case 'M': return &tableMail;
+        case 'R': return &tableRcpt;
+        default:  return &tableNone;
+    }
+}
+
+//getAddress gets the address in a MAIL or RCPT parameter, which must be prefix (e.g. "FROM:<") followed by the address and ">"
+//returns 1 if the parameter is valid, or 0 otherwise
+int getAddress(const struct proto_command *cmd, const char *prefix, char address[256]) {
+    
+    size_t prefix_len = strlen(prefix);
+    if (cmd->arg_length < prefix_len + 1 || strncasecmp(cmd->arg, prefix, prefix_len) != 0 ||
+        cmd->arg[cmd->arg_length - 1] != '>') {
+        return 0;
+    }
+    
+    //address ends at the first '>', and must fit in the buffer
+    const char *start = cmd->arg + prefix_len;
+    const char *end = memchr(start, '>', cmd->arg + cmd->arg_length - start);
+    if (end - start > 255) {
+        return 0;
+    }
+    
+    memcpy(address, start, end - start);
+    address[end - start] = '\0';
+    return 1;
+}
+
+//reportSession writes the allocation counters of a session to standard error, if MAIL_SESSION_STATS is set
+void reportSession(const char *server, arena_t arena) {
+    
+    if (config_long("MAIL_SESSION_STATS", 0) == 0) {
+        return;
+    }
+    
+    struct arena_stats stats;
+    arena_stats(arena, &stats);
+    fprintf(stderr, "%s[%d]: %zu allocations, %zu bytes, %zu blocks, %zu resets\n",
+            server, (int) getpid(), stats.allocations, stats.bytes, stats.blocks, stats.resets);
+}
+
+//forwardToNodes queues the message once for each storage node owning some of the recipients, with those recipients
+//returns the number of nodes it was queued for, or -1 if it could not be queued for all of them (then nothing is queued)
+int forwardToNodes(struct smtp_session *session, const char *file, const char *info) {
+    
+    //one group per node, built in a single pass with one lookup per recipient (at most one group per recipient)
+    struct nodeGroup {
+        const struct shard_node *node;
+        user_list_t recipients;
+    };
+    
+    size_t count = 0;
+    for (user_list_t user = session->recipients; user != NULL; user = get_next_user(user)) {
+        count++;
+    }
+    
+    struct nodeGroup *groups = arena_alloc(session->arena, count * sizeof(struct nodeGroup));
+    size_t groupCount = 0;
+    if (groups == NULL) {
+        return -1;
+    }
+    
+    for (user_list_t user = session->recipients; user != NULL; user = get_next_user(user)) {
+        const struct shard_node *node = shard_lookup(get_user_name(user));
         
-        } else {
-            if (send_string(fd, "500 Syntax error, command unrecognized\r\n") < 0) {
-                break;
-            }
+        size_t g = 0;
+        while (g < groupCount && groups[g].node != node) {
+            g++;
+        }
+        if (g == groupCount) {
+            groups[groupCount++] = (struct nodeGroup) { node, create_user_list() };
+        }
+        add_user_to_list(&groups[g].recipients, get_user_name(user), session->arena);
+    }
+    
+    //every group is prepared in the outbound queue first, so a failure leaves nothing queued for a client retry to duplicate
+    char (*ids)[RELAY_ID_MAX] = arena_alloc(session->arena, groupCount * sizeof(*ids));
+    size_t prepared = 0;
+    while (ids != NULL && prepared < groupCount &&
+           relay_prepare(groups[prepared].node->address, file, info, session->sender, groups[prepared].recipients, ids[prepared]) == 0) {
+        prepared++;
+    }
+    
+    size_t committed = 0;
+    if (prepared == groupCount) {
+        while (committed < groupCount && relay_commit(ids[committed]) == 0) {
+            committed++;
         }
     }
+    for (size_t g = committed; g < prepared; g++) {
+        relay_cancel(ids[g]);
+    }
+    
+    //a commit failing after others succeeded (a rename in the same directory) still tempfails, as a duplicate beats a loss
+    return committed == groupCount ? (int) groupCount : -1;
 }
 
-void saveMessages(int fd, net_buffer_t nb, char current, user_list_t recipients) {
+int saveMessages(struct smtp_session *session, struct filter_verdict *verdict) {
     
     //what client is sending
-    char out[MAX_LINE_LENGTH] = "";
+    char out[MAX_LINE_LENGTH + 1] = "";
     
-    //out accumulator: accumulates client input
-    char out_acc[MAX_LINE_LENGTH] = "";
+    //number of recipients the message was delivered to
+    int delivered = -1;
     
-    //keeps track of how much we have written to accumulator
-    int out_writer = 0;
-    
-    if (current == 'D') {
-        
-        //researched from: https://github.com/perusio/linux-programming-by-example/blob/master/book/ch12/ch12-mkstemp.c
-        static char file[] = "tmpXXXXXX";
+    if (session->current == 'D') {
         
-        //Create and open temp file
-        int f;
-        f = mkstemp(file);
+        //Create and open spool file (compressed when worth it, see spool.c)
+        spool_t spool = spool_create();
         
-        while(nb_read_line(nb, out)) {
+        int size;
+        size_t received = 0;
+        while((size = nb_read_line(session->nb, out)) > 0) {
             
-            //if string is not .\r\n, keep accumulating client input
+            //if string is not .\r\n, keep writing client input
             if (strncmp(out, ".\r\n", 3) == 0) {
                 
-                //write what we have accumulated to file
-                write(f, out_acc, strlen(out_acc));
-                
-                save_user_mail(file, recipients);
-                
-                //Close file
-                close(f);
-
-                //Remove it
-                unlink(file);
-                
+                if (spool != NULL && spool_close(spool) == 0) {
+                    const char *file = spool_filename(spool);
+                    const char *info = spool_info(spool);
+                    
+                    //relayed mail leaves no copy here to quarantine, so the filters decide before the reply in queue mode too
+                    int relaying = session->relayed != NULL;
+                    int filtered = filter_mode() == FILTER_MODE_REPLY || (relaying && filter_mode() == FILTER_MODE_QUEUE);
+                    char relayId[RELAY_ID_MAX];
+                    
+                    if (filtered && filter_message(file, info, verdict) != FILTER_ACCEPT) {
+                        delivered = -1;
+                        
+                    //non-local recipients are prepared in the outbound queue, and only released once the local part is safe
+                    } else if (relaying && relay_prepare(NULL, file, info, session->sender, session->relayed, relayId) < 0) {
+                        delivered = -1;
+                    } else {
+                        
+                        //message is put in the delivery queue, or delivered right away if the queue is not running
+                        if (session->recipients == NULL) {
+                            delivered = 0;
+                            
+                        //front end of a storage cluster: mailboxes are on the nodes, which run their own filters (see shard.c)
+                        } else if (shard_enabled()) {
+                            delivered = forwardToNodes(session, file, info);
+                        } else if (queue_submit(file, info, session->recipients) == 0) {
+                            delivered = 1;
+                            
+                        //without queue workers to run the filters, they run here
+                        } else if (!filtered && filter_mode() == FILTER_MODE_QUEUE && filter_message(file, info, verdict) != FILTER_ACCEPT) {
+                            delivered = -1;
+                        } else {
+                            delivered = save_user_mail(file, info, session->recipients, NULL);
+                        }
+                        
+                        //250 only if both parts are queued: a local part that failed or reached nobody drops the relayed part
+                        if (relaying) {
+                            if ((session->recipients == NULL ? delivered == 0 : delivered > 0) && relay_commit(relayId) == 0) {
+                                delivered++;
+                            } else {
+                                relay_cancel(relayId);
+                                delivered = -1;
+                            }
+                        }
+                    }
+                }
                 break;
                 
-            } else {
-                
-                int out_length = strlen(out);
-                strncpy(&out_acc[out_writer], out, out_length);
-                out_writer += out_length;
+            } else if (spool != NULL) {
                 
+                //write each line straight to the file, so message size is not limited by a buffer
+                spool_write(spool, out, size);
             }
+            received += size;
+        }
+        
+        //data is counted once received, even if it pushes the client over its limit
+        ratelimit_charge(session->peer, RATE_BYTES, received);
+        
+        //Remove spool file
+        if (spool != NULL) {
+            spool_destroy(spool);
         }
     }
+    
+    return delivered > 0 ? 0 : -1;
 }
-
-
@@ -15,6 +15,7 @@ struct net_buffer {
   int    fd;
   size_t max_bytes;
   size_t avail_data;
+  arena_t arena;
   // Buffer set as size zero, but since it's the last member of the
   // struct, any additional memory allocated after this struct can be
   // used as part of the buffer.
@@ -32,25 +33,31 @@ struct net_buffer {
  *  Parameters: fd: Socket file descriptor.
  *              max_buffer_size: Maximum number of bytes to be stored
  *                               locally for a connection. 
+ *              arena: Arena of the connection the buffer is allocated
+ *                     from, or NULL to allocate it from the heap.
  *
  *  Returns: A net_buffer_t object that can be used in other functions
  *           to read buffered data.
  */
-net_buffer_t nb_create(int fd, size_t max_buffer_size) {
+net_buffer_t nb_create(int fd, size_t max_buffer_size, arena_t arena) {
 
-  net_buffer_t nb = malloc(sizeof(struct net_buffer) + max_buffer_size);
+  size_t size = sizeof(struct net_buffer) + max_buffer_size;
+  net_buffer_t nb = arena ? arena_alloc(arena, size) : malloc(size);
   nb->fd          = fd;
+  nb->arena       = arena;
   nb->max_bytes   = max_buffer_size;
   nb->avail_data  = 0;
   return nb;
 }
 
-/** Frees all memory used by a net_buffer_t object.
+/** Frees all memory used by a net_buffer_t object. Buffers allocated
+ *  from an arena are freed with the arena instead.
  *  
  *  Parameters: nb: buffer object to be freed.
  */
 void nb_destroy(net_buffer_t nb) {
-  free(nb);
+  if (!nb->arena)
+    free(nb);
 }
 
 /** Reads a single line from the socket/buffer. If the socket returns
@@ -107,3 +114,56 @@ int nb_read_line(net_buffer_t nb, char out[]) {
     memmove(nb->buf, eos + 1, nb->avail_data);
   return rv;
 }
+
+/** Checks if a complete line (i.e., one ending in a line-feed) is
+ *  already stored in the buffer, so that the next call to
+ *  nb_read_line will return it without waiting for the socket. This
+ *  is the case when a client sends several commands at once.
+ *
+ *  Parameter: nb: buffer object to be checked.
+ *
+ *  Returns: 1 if a complete line is available, 0 otherwise.
+ */
+int nb_has_line(net_buffer_t nb) {
+  return memchr(nb->buf, '\n', nb->avail_data) != NULL;
+}
+
+/** Reads up to size bytes of raw data (e.g., the contents of a file
+ *  sent after a line announcing its size). Data already stored in the
+ *  buffer is returned first; otherwise, waits for the socket.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *             out: array of bytes where the data will be stored.
+ *             size: maximum number of bytes to be read.
+ *
+ *  Returns: If the connection was terminated properly, returns 0. If
+ *           the connection was terminated abruptly or another unknown
+ *           error is found, returns -1. Otherwise, returns the number
+ *           of bytes read.
+ */
+int nb_read(net_buffer_t nb, char out[], size_t size) {
+
+  if (!nb->avail_data)
+    return recv(nb->fd, out, size, 0);
+
+  size_t rv = size < nb->avail_data ? size : nb->avail_data;
+  memcpy(out, nb->buf, rv);
+  nb->avail_data -= rv;
+  if (nb->avail_data)
+    memmove(nb->buf, nb->buf + rv, nb->avail_data);
+  return rv;
+}
+
+/** Returns the number of bytes already stored in the buffer, i.e.,
+ *  that were received from the socket but not read yet (e.g., commands
+ *  a client sent ahead, which must be passed on when the connection is
+ *  handed over to another server).
+ *
+ *  Parameter: nb: buffer object to be checked.
+ *
+ *  Returns: the number of bytes that nb_read can return without
+ *           waiting for the socket.
+ */
+size_t nb_pending(net_buffer_t nb) {
+  return nb->avail_data;
+}
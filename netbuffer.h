@@ -9,10 +9,15 @@
 
 #include <string.h>
 
+#include "arena.h"
+
 typedef struct net_buffer *net_buffer_t;
 
-net_buffer_t nb_create(int fd, size_t max_buffer_size);
+net_buffer_t nb_create(int fd, size_t max_buffer_size, arena_t arena);
 void nb_destroy(net_buffer_t nb);
 int nb_read_line(net_buffer_t nb, char out[]);
+int nb_has_line(net_buffer_t nb);
+int nb_read(net_buffer_t nb, char out[], size_t size);
+size_t nb_pending(net_buffer_t nb);
 
 #endif
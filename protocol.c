@@ -0,0 +1,131 @@
+/* protocol.c
+ * Parses command lines of line-based protocols (SMTP, POP3) and
+ * dispatches them to handler functions.
+ *
+ * Notes: A command line starts with a verb of up to four letters,
+ * optionally followed by arguments. The verb is folded to upper case
+ * and packed into a 32-bit integer, so finding its handler is a
+ * single hash table lookup instead of a string comparison per known
+ * command. Servers keep one table per protocol state, so a handler
+ * is only reached in the states where its command is valid. Handlers
+ * receive the position and length of the arguments, already
+ * separated from the verb and the line terminator.
+ */
+
+#include "protocol.h"
+
+#include <string.h>
+
+/** Internal function that returns the first slot to probe for a verb
+ *  (Fibonacci hashing of the verb).
+ */
+static unsigned int verb_slot(uint32_t verb) {
+  return (verb * 2654435769U) >> (32 - PROTO_TABLE_BITS);
+}
+
+/** Initializes an empty command table.
+ *
+ *  Parameters: table: Table to be initialized.
+ *              fallback: Handler for unknown verbs and for lines with
+ *                        no valid verb.
+ */
+void proto_table_init(struct proto_table *table, proto_handler_t fallback) {
+  memset(table, 0, sizeof(*table));
+  table->fallback = fallback;
+}
+
+/** Adds a command to a table, replacing the handler of the same verb
+ *  if already present.
+ *
+ *  Parameters: table: Table where the command is added.
+ *              verb: Verb of the command (see PROTO_VERB).
+ *              handler: Function called for lines with this verb.
+ *
+ *  Returns: zero on success, -1 if the table is full.
+ */
+int proto_table_add(struct proto_table *table, uint32_t verb, proto_handler_t handler) {
+
+  unsigned int slot = verb_slot(verb);
+  for (int n = 0; n < PROTO_TABLE_SLOTS; n++, slot = (slot + 1) % PROTO_TABLE_SLOTS) {
+    if (table->slots[slot].verb == 0 || table->slots[slot].verb == verb) {
+      table->slots[slot].verb = verb;
+      table->slots[slot].handler = handler;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/** Finds the handler of a verb in a command table.
+ *
+ *  Parameters: table: Table to be searched.
+ *              verb: Verb of the command, as set by proto_parse.
+ *
+ *  Returns: The handler of the verb, or the table's fallback handler
+ *           if the verb is not in the table.
+ */
+proto_handler_t proto_lookup(const struct proto_table *table, uint32_t verb) {
+
+  if (verb == 0) return table->fallback;
+
+  unsigned int slot = verb_slot(verb);
+  for (int n = 0; n < PROTO_TABLE_SLOTS && table->slots[slot].verb; n++,
+	 slot = (slot + 1) % PROTO_TABLE_SLOTS) {
+    if (table->slots[slot].verb == verb)
+      return table->slots[slot].handler;
+  }
+  return table->fallback;
+}
+
+/** Splits a command line into its verb and arguments. The verb is the
+ *  leading run of letters, folded to upper case; lines whose verb is
+ *  longer than four letters, or is not followed by a space or the end
+ *  of the line, get a verb of zero. The arguments start after the
+ *  spaces following the verb and end before the line terminator and
+ *  any trailing spaces. The line itself is not modified.
+ *
+ *  Parameters: line: Command line, as returned by nb_read_line.
+ *              length: Length of the line, including the terminator.
+ *              cmd: Receives the parsed command.
+ */
+void proto_parse(const char *line, size_t length, struct proto_command *cmd) {
+
+  const char *end = line + length;
+  const char *p = line;
+  uint32_t verb = 0;
+
+  // Line terminator and trailing blanks are not part of the arguments
+  while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' '))
+    end--;
+
+  // Verbs are ASCII, so letters are folded without the locale tables
+  for (int n = 0; n < 4 && p < end && (unsigned) ((*p | 0x20) - 'a') < 26; n++, p++)
+    verb |= (uint32_t) (*p & ~0x20) << (24 - 8 * n);
+
+  if (p < end && *p != ' ')
+    verb = 0;
+  while (p < end && *p == ' ')
+    p++;
+
+  cmd->verb = verb;
+  cmd->line = line;
+  cmd->length = length;
+  cmd->arg = p;
+  cmd->arg_length = end - p;
+}
+
+/** Parses a command line and calls the handler for its verb.
+ *
+ *  Parameters: table: Command table for the current protocol state.
+ *              session: Passed unchanged to the handler.
+ *              line: Command line, as returned by nb_read_line.
+ *              length: Length of the line, including the terminator.
+ *
+ *  Returns: The value returned by the handler.
+ */
+int proto_dispatch(const struct proto_table *table, void *session, const char *line, size_t length) {
+
+  struct proto_command cmd;
+  proto_parse(line, length, &cmd);
+  return proto_lookup(table, cmd.verb)(session, &cmd);
+}
@@ -0,0 +1,44 @@
+/* protocol.h
+ * Parses command lines of line-based protocols (SMTP, POP3) and
+ * dispatches them to handler functions.
+ */
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Verbs are up to four upper-case letters packed into an integer, e.g. PROTO_VERB('T','O','P',0)
+#define PROTO_VERB(a, b, c, d) \
+  ((uint32_t) (a) << 24 | (uint32_t) (b) << 16 | (uint32_t) (c) << 8 | (uint32_t) (d))
+
+#define PROTO_TABLE_BITS  6
+#define PROTO_TABLE_SLOTS (1 << PROTO_TABLE_BITS)
+
+struct proto_command {
+  uint32_t verb;
+  const char *line;
+  size_t length;
+  const char *arg;
+  size_t arg_length;
+};
+
+typedef int (*proto_handler_t)(void *session, const struct proto_command *cmd);
+
+struct proto_table {
+  proto_handler_t fallback;
+  struct {
+    uint32_t verb;
+    proto_handler_t handler;
+  } slots[PROTO_TABLE_SLOTS];
+};
+
+void proto_table_init(struct proto_table *table, proto_handler_t fallback);
+int proto_table_add(struct proto_table *table, uint32_t verb, proto_handler_t handler);
+proto_handler_t proto_lookup(const struct proto_table *table, uint32_t verb);
+
+void proto_parse(const char *line, size_t length, struct proto_command *cmd);
+int proto_dispatch(const struct proto_table *table, void *session, const char *line, size_t length);
+
+#endif
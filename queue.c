@@ -0,0 +1,487 @@
+/* queue.c
+ * Durable queue of messages waiting to be delivered to local mailboxes.
+ *
+ * Notes: An SMTP session hands a received message to the queue and
+ * replies as soon as the message is safely on disk; delivery worker
+ * processes then save it into the recipients' mailboxes (see
+ * save_user_mail). A queue entry is a pair of files in the queue
+ * directory: <id>.msg, a hard link to the spool file, and <id>.rcpt,
+ * holding the time the message was queued, the number of delivery
+ * attempts, the time of the next attempt, the message information and
+ * one recipient per line. The recipients file is written under a
+ * temporary name, synced and renamed, so an entry exists (and will be
+ * delivered) only once it is complete.
+ *
+ * A worker delivering an entry holds a lock on its recipients file,
+ * so each entry is delivered by one worker at a time; if the worker
+ * dies, the lock is released and the entry is delivered again by the
+ * next pass. Failed deliveries are retried with exponential backoff.
+ * Files left behind by an interrupted submission or delivery are
+ * removed once they are old enough not to belong to one in progress.
+ *
+ * Unless content filters run in the SMTP session (see filter.c), the
+ * workers run them on each message before delivering it: rejected
+ * messages are moved to the quarantine (see filter_quarantine), and
+ * deferred ones retried like failed deliveries.
+ */
+
+#include "queue.h"
+#include "filter.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define QUEUE_MESSAGE_SUFFIX    ".msg"
+#define QUEUE_RECIPIENTS_SUFFIX ".rcpt"
+#define QUEUE_TEMP_SUFFIX       ".tmp"
+#define QUEUE_COUNTERS_FILE     QUEUE_DIRECTORY "/.counters"
+
+#define QUEUE_ID_MAX 64
+#define QUEUE_MAX_WORKERS 64
+#define QUEUE_STALE_SECONDS 600
+
+struct queue_counters {
+  uint64_t delivered;
+  uint64_t retries;
+  uint64_t failed;
+  uint64_t lag_total_ms;
+  uint64_t lag_max_ms;
+  uint64_t rejected;
+};
+
+// Delivery workers started by this process (see queue_start_workers)
+static pid_t workers[QUEUE_MAX_WORKERS];
+static int worker_count = 0;
+
+/** Internal function that returns the current time in milliseconds.
+ */
+static uint64_t now_ms(void) {
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/** Internal function that maps the queue counters into memory,
+ *  creating them if needed. The mapping is kept for the lifetime of
+ *  the process.
+ *
+ *  Returns: the counters, or NULL if they cannot be mapped.
+ */
+static struct queue_counters *queue_counters(void) {
+
+  static struct queue_counters *counters = NULL;
+  struct stat st;
+
+  if (counters) return counters;
+
+  int fd = open(QUEUE_COUNTERS_FILE, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) return NULL;
+
+  // Growing a file fills it with zeros, so racing creators agree
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size < sizeof(struct queue_counters) &&
+       ftruncate(fd, sizeof(struct queue_counters)) < 0)) {
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, sizeof(struct queue_counters), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return counters = map == MAP_FAILED ? NULL : map;
+}
+
+/** Internal function that makes changes to the queue directory (new,
+ *  renamed and removed entries) durable.
+ */
+static void sync_queue_directory(void) {
+
+  int fd = open(QUEUE_DIRECTORY, O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/** Internal function that builds the path of a file of a queue entry.
+ */
+static int entry_path(char path[PATH_MAX], const char *id, const char *suffix) {
+  return snprintf(path, PATH_MAX, QUEUE_DIRECTORY "/%s%s", id, suffix) < PATH_MAX ? 0 : -1;
+}
+
+/** Internal function that writes the recipients file of an entry
+ *  under a temporary name, syncs it and renames it into place.
+ *
+ *  Returns: zero on success, -1 on error.
+ */
+static int write_recipients(const char *id, uint64_t queued, int attempts, time_t next_attempt,
+			    const char *info, user_list_t users) {
+
+  char temp[PATH_MAX], path[PATH_MAX];
+  if (entry_path(temp, id, QUEUE_TEMP_SUFFIX) < 0 || entry_path(path, id, QUEUE_RECIPIENTS_SUFFIX) < 0)
+    return -1;
+
+  FILE *file = fopen(temp, "w");
+  if (!file) return -1;
+
+  fprintf(file, "%llu %d %lld\n%s\n", (unsigned long long) queued, attempts,
+	  (long long) next_attempt, info);
+  for (; users; users = get_next_user(users))
+    fprintf(file, "%s\n", get_user_name(users));
+
+  if (fflush(file) != 0 || fsync(fileno(file)) < 0) {
+    fclose(file);
+    unlink(temp);
+    return -1;
+  }
+  fclose(file);
+
+  if (rename(temp, path) < 0) {
+    unlink(temp);
+    return -1;
+  }
+  sync_queue_directory();
+  return 0;
+}
+
+/** Adds a message to the delivery queue. The message is on disk (and
+ *  synced) when this function returns, so it survives a crash, and
+ *  the delivery workers are woken up to deliver it.
+ *
+ *  Parameters: basefile: Name of a file containing the contents of the
+ *                        email message, as written by the spool
+ *                        functions; it must be in the same file system
+ *                        as the mail storage.
+ *              info: Message information, as returned by spool_info.
+ *              users: List of recipient users to the message.
+ *
+ *  Returns: zero on success, or -1 if the queue is not running (no
+ *           workers were started by this server) or the message could
+ *           not be queued, in which case it should be delivered
+ *           directly.
+ */
+int queue_submit(const char *basefile, const char *info, user_list_t users) {
+
+  static unsigned int counter = 0;
+  char id[QUEUE_ID_MAX], message[PATH_MAX];
+  int rv;
+
+  if (!worker_count) return -1;
+
+  // Spool file is linked, not copied, so its data must be on disk
+  int fd = open(basefile, O_RDONLY);
+  if (fd < 0) return -1;
+  rv = fsync(fd);
+  close(fd);
+  if (rv < 0) return -1;
+
+  // Message ID is unique as long as the link succeeds
+  do {
+    snprintf(id, sizeof(id), "%lx-%x-%x", (unsigned long) time(NULL), (unsigned int) getpid(), counter++);
+    if (entry_path(message, id, QUEUE_MESSAGE_SUFFIX) < 0) return -1;
+  } while ((rv = link(basefile, message)) < 0 && errno == EEXIST);
+  if (rv < 0) return -1;
+
+  if (write_recipients(id, now_ms(), 0, 0, info, users) < 0) {
+    unlink(message);
+    return -1;
+  }
+
+  for (int i = 0; i < worker_count; i++)
+    kill(workers[i], SIGUSR1);
+  return 0;
+}
+
+/** Internal function that reads a whole file from a descriptor into
+ *  a NUL-terminated string.
+ *
+ *  Returns: the contents, to be freed by the caller, or NULL on error.
+ */
+static char *read_file(int fd, size_t size) {
+
+  char *data = malloc(size + 1);
+  if (!data) return NULL;
+  if (pread(fd, data, size, 0) != size) {
+    free(data);
+    return NULL;
+  }
+  data[size] = 0;
+  return data;
+}
+
+/** Internal function that tries to deliver one queue entry, unless it
+ *  is being delivered by another worker or its next attempt is not
+ *  due yet. The entry is removed once the message reaches all its
+ *  recipients, is rejected by the content filters, or runs out of
+ *  attempts (MAIL_QUEUE_MAX_ATTEMPTS); otherwise it is rewritten with
+ *  the recipients left, and its next attempt is delayed by
+ *  MAIL_QUEUE_RETRY_SECONDS, doubled at each attempt.
+ *
+ *  Returns: 1 if the message was delivered, 0 otherwise.
+ */
+static int deliver_entry(const char *id) {
+
+  char path[PATH_MAX], message[PATH_MAX];
+  unsigned long long queued;
+  long long next_attempt;
+  int attempts, offset, delivered = 0;
+  struct stat st;
+
+  if (entry_path(path, id, QUEUE_RECIPIENTS_SUFFIX) < 0 ||
+      entry_path(message, id, QUEUE_MESSAGE_SUFFIX) < 0)
+    return 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+
+  // Entry removed by the worker that held the lock before us
+  char *data = NULL;
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0 || st.st_nlink == 0 ||
+      (data = read_file(fd, st.st_size)) == NULL ||
+      sscanf(data, "%llu %d %lld\n%n", &queued, &attempts, &next_attempt, &offset) != 3 ||
+      next_attempt > time(NULL)) {
+    free(data);
+    close(fd);
+    return 0;
+  }
+
+  // Message information, followed by one recipient per line
+  user_list_t users = create_user_list();
+  char *info = data + offset;
+  char *line = strchr(info, '\n');
+  if (line) {
+    *line++ = 0;
+    for (char *end; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+      *end = 0;
+      if (*line) add_user_to_list(&users, line, NULL);
+    }
+  }
+
+  // Entry is kept only when it will be attempted again, for the recipients that are left
+  struct queue_counters *counters = queue_counters();
+  struct filter_verdict verdict = { .action = FILTER_ACCEPT };
+  user_list_t retry = users, failed = create_user_list();
+  int remove_entry = 1;
+  if (users && filter_mode() == FILTER_MODE_QUEUE)
+    filter_message(message, info, &verdict);
+
+  if (verdict.action == FILTER_REJECT && filter_quarantine(message, info, &verdict, users) < 0) {
+    // Kept in the queue rather than lost, until the quarantine can take it
+    verdict.action = FILTER_TEMPFAIL;
+
+  } else if (verdict.action == FILTER_REJECT) {
+    if (counters)
+      __sync_fetch_and_add(&counters->rejected, 1);
+    retry = NULL;
+
+  } else if (users && verdict.action == FILTER_ACCEPT && save_user_mail(message, info, users, &failed) > 0) {
+    delivered = 1;
+    retry = failed;
+    if (counters) {
+      uint64_t lag = now_ms() - queued;
+      __sync_fetch_and_add(&counters->delivered, 1);
+      __sync_fetch_and_add(&counters->lag_total_ms, lag);
+      for (uint64_t max = counters->lag_max_ms; lag > max &&
+	     !__sync_bool_compare_and_swap(&counters->lag_max_ms, max, lag); max = counters->lag_max_ms);
+    }
+  }
+
+  if (retry && ++attempts < config_long("MAIL_QUEUE_MAX_ATTEMPTS", 10)) {
+    long delay = config_long("MAIL_QUEUE_RETRY_SECONDS", 30);
+    for (int i = 1; i < attempts && delay < 3600; i++)
+      delay *= 2;
+    if (write_recipients(id, queued, attempts, time(NULL) + delay, info, retry) == 0 && counters)
+      __sync_fetch_and_add(&counters->retries, 1);
+    remove_entry = 0;
+
+  } else if (retry && counters) {
+    __sync_fetch_and_add(&counters->failed, 1);
+  }
+
+  // Recipients file goes first: without it the message file is only a leftover
+  if (remove_entry) {
+    unlink(path);
+    unlink(message);
+    sync_queue_directory();
+  }
+
+  destroy_user_list(users);
+  destroy_user_list(failed);
+  free(data);
+  close(fd);
+  return delivered;
+}
+
+/** Internal function that removes a file left behind by a submission
+ *  or delivery that was interrupted (a message file without a
+ *  recipients file, or a temporary file), once it is old enough.
+ */
+static void remove_if_stale(const char *name) {
+
+  char path[PATH_MAX], recipients[PATH_MAX];
+  struct stat st;
+  size_t id_len = strrchr(name, '.') - name;
+
+  if (snprintf(path, sizeof(path), QUEUE_DIRECTORY "/%s", name) >= sizeof(path) ||
+      snprintf(recipients, sizeof(recipients), QUEUE_DIRECTORY "/%.*s" QUEUE_RECIPIENTS_SUFFIX,
+	       (int) id_len, name) >= sizeof(recipients))
+    return;
+
+  if (stat(path, &st) == 0 && st.st_ctime + QUEUE_STALE_SECONDS < time(NULL) &&
+      access(recipients, F_OK) < 0)
+    unlink(path);
+}
+
+/** Delivers all queue entries that are due, skipping entries being
+ *  delivered by other workers, and cleans up leftovers of interrupted
+ *  work. May be called by any number of processes at the same time.
+ *
+ *  Returns: Number of messages delivered.
+ */
+int queue_run(void) {
+
+  struct dirent *dir_entry;
+  int delivered = 0;
+
+  DIR *dir = opendir(QUEUE_DIRECTORY);
+  if (!dir) return 0;
+
+  while ((dir_entry = readdir(dir)) != NULL) {
+    const char *suffix = strrchr(dir_entry->d_name, '.');
+    if (dir_entry->d_name[0] == '.' || !suffix || suffix - dir_entry->d_name >= QUEUE_ID_MAX)
+      continue;
+
+    if (!strcmp(suffix, QUEUE_RECIPIENTS_SUFFIX)) {
+      char id[QUEUE_ID_MAX];
+      snprintf(id, sizeof(id), "%.*s", (int) (suffix - dir_entry->d_name), dir_entry->d_name);
+      delivered += deliver_entry(id);
+    } else {
+      remove_if_stale(dir_entry->d_name);
+    }
+  }
+
+  closedir(dir);
+  return delivered;
+}
+
+/** Internal function run by each delivery worker: delivers the queue
+ *  whenever a message is submitted (signalled with SIGUSR1), and at
+ *  least every MAIL_QUEUE_POLL_SECONDS for retries. Exits when the
+ *  server process that started it goes away.
+ */
+static void run_worker(pid_t server, const sigset_t *wakeup) {
+
+  struct timespec interval = { .tv_sec = config_long("MAIL_QUEUE_POLL_SECONDS", 5) };
+
+  while (getppid() == server) {
+    queue_run();
+    sigtimedwait(wakeup, NULL, &interval);
+  }
+  exit(0);
+}
+
+/** Starts the delivery workers, which run until the calling process
+ *  exits. Messages submitted by this process and its children (e.g.,
+ *  SMTP sessions) wake them up. Entries left in the queue by an
+ *  earlier run, including any interrupted by a crash, are delivered
+ *  as soon as the workers start.
+ *
+ *  Parameters: count: Number of worker processes.
+ *
+ *  Returns: Number of workers started. If zero, queue_submit fails
+ *           and messages must be delivered directly.
+ */
+int queue_start_workers(int count) {
+
+  sigset_t wakeup, previous;
+
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  if (mkdir(QUEUE_DIRECTORY, 0777) < 0 && errno != EEXIST)
+    return 0;
+  queue_counters();
+
+  // Wake-up signal stays blocked in workers, so it is never lost between passes
+  sigemptyset(&wakeup);
+  sigaddset(&wakeup, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &wakeup, &previous);
+
+  pid_t server = getpid();
+  for (int i = 0; i < count && worker_count < QUEUE_MAX_WORKERS; i++) {
+    pid_t pid = fork();
+    if (pid == 0)
+      run_worker(server, &wakeup);
+    if (pid > 0)
+      workers[worker_count++] = pid;
+  }
+
+  sigprocmask(SIG_SETMASK, &previous, NULL);
+  return worker_count;
+}
+
+/** Retrieves the state of the queue: number of entries waiting
+ *  (depth), how many of them failed at least once (deferred) and the
+ *  age in seconds of the oldest one; as well as counters of messages
+ *  delivered, delivery attempts postponed (retries), messages given up
+ *  on (failed), messages rejected by the content filters, and the total and largest time in milliseconds from
+ *  submission to delivery (lag).
+ *
+ *  Parameters: stats: Receives the queue state.
+ *
+ *  Returns: zero on success, -1 if the queue cannot be read.
+ */
+int queue_stats(struct queue_stats *stats) {
+
+  struct dirent *dir_entry;
+  struct queue_counters *counters = queue_counters();
+  uint64_t now = now_ms();
+
+  memset(stats, 0, sizeof(*stats));
+  DIR *dir = opendir(QUEUE_DIRECTORY);
+  if (!dir) return -1;
+
+  while ((dir_entry = readdir(dir)) != NULL) {
+    const char *suffix = strrchr(dir_entry->d_name, '.');
+    char path[PATH_MAX], header[64];
+    unsigned long long queued;
+    int attempts;
+
+    if (dir_entry->d_name[0] == '.' || !suffix || strcmp(suffix, QUEUE_RECIPIENTS_SUFFIX) ||
+	snprintf(path, sizeof(path), QUEUE_DIRECTORY "/%s", dir_entry->d_name) >= sizeof(path))
+      continue;
+
+    FILE *file = fopen(path, "r");
+    if (!file) continue;
+    if (fgets(header, sizeof(header), file) && sscanf(header, "%llu %d", &queued, &attempts) == 2) {
+      stats->depth++;
+      stats->deferred += attempts > 0;
+      if (queued < now && (now - queued) / 1000 > stats->oldest_age)
+	stats->oldest_age = (now - queued) / 1000;
+    }
+    fclose(file);
+  }
+  closedir(dir);
+
+  if (counters) {
+    stats->delivered    = __atomic_load_n(&counters->delivered, __ATOMIC_RELAXED);
+    stats->retries      = __atomic_load_n(&counters->retries, __ATOMIC_RELAXED);
+    stats->failed       = __atomic_load_n(&counters->failed, __ATOMIC_RELAXED);
+    stats->lag_total_ms = __atomic_load_n(&counters->lag_total_ms, __ATOMIC_RELAXED);
+    stats->lag_max_ms   = __atomic_load_n(&counters->lag_max_ms, __ATOMIC_RELAXED);
+    stats->rejected     = __atomic_load_n(&counters->rejected, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
@@ -0,0 +1,31 @@
+/* queue.h
+ * Durable queue of messages waiting to be delivered to local mailboxes.
+ */
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include "mailuser.h"
+
+#include <stdint.h>
+
+#define QUEUE_DIRECTORY MAIL_BASE_DIRECTORY "/queue"
+
+struct queue_stats {
+  uint64_t depth;
+  uint64_t deferred;
+  uint64_t oldest_age;
+  uint64_t delivered;
+  uint64_t retries;
+  uint64_t failed;
+  uint64_t lag_total_ms;
+  uint64_t lag_max_ms;
+  uint64_t rejected;
+};
+
+int queue_start_workers(int count);
+int queue_submit(const char *basefile, const char *info, user_list_t users);
+int queue_run(void);
+int queue_stats(struct queue_stats *stats);
+
+#endif
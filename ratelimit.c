@@ -0,0 +1,315 @@
+/* ratelimit.c
+ * Shared table of per-address rate limits.
+ *
+ * Notes: Each client address has a token bucket for connections,
+ * messages and message bytes, kept in a file in the mail storage
+ * mapped into every server process, so limits hold across all the
+ * connections (and forked processes) of a client. Limits are set per
+ * minute by MAIL_RATE_CONNECTIONS, MAIL_RATE_MESSAGES and
+ * MAIL_RATE_BYTES (zero disables a limit), with bursts of up to
+ * MAIL_RATE_*_BURST.
+ *
+ * Buckets are implemented as in the generic cell rate algorithm: the
+ * state of a bucket is a single time, at which it would be full
+ * again. Taking tokens moves that time forward, and is refused if it
+ * would end up more than a burst ahead of now. Since the state is one
+ * word, it is updated with a compare-and-swap, and no process ever
+ * waits for another. Like the usage table (see usage.c), the table
+ * uses open addressing on a hash of the address; a slot whose buckets
+ * are all full again may be taken over by another address. IPv6
+ * clients are limited per /64 network, as that is what a single host
+ * usually has.
+ *
+ * The same table holds budgets shared by all server processes, under
+ * RATE_KEY_SERVER: the bytes that POP3 workers may read ahead from
+ * disk (MAIL_PREFETCH_RATE per minute, see mypopd.c).
+ */
+
+#include "ratelimit.h"
+#include "mailuser.h"
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define RATELIMIT_FILE_NAME MAIL_BASE_DIRECTORY "/.ratelimit"
+#define RATELIMIT_MAGIC 0x54494d494c544153ULL
+#define RATELIMIT_DEFAULT_SLOTS (1 << 16)
+#define RATELIMIT_MAX_PROBES 32
+
+struct ratelimit_slot {
+  uint64_t key;
+  uint64_t full_at[RATE_KINDS];
+};
+
+struct ratelimit_table {
+  uint64_t magic;
+  uint64_t slot_count;
+  uint64_t reserved[6];
+  struct ratelimit_slot slots[];
+};
+
+// Settings of each kind of limit: rate per minute and burst
+struct ratelimit_setting {
+  const char *rate_name;
+  const char *burst_name;
+  long rate;
+  long burst;
+};
+
+static const struct ratelimit_setting settings[RATE_KINDS] = {
+  [RATE_CONNECTIONS] = { "MAIL_RATE_CONNECTIONS", "MAIL_RATE_CONNECTIONS_BURST", 300, 60 },
+  [RATE_MESSAGES]    = { "MAIL_RATE_MESSAGES", "MAIL_RATE_MESSAGES_BURST", 600, 120 },
+  [RATE_BYTES]       = { "MAIL_RATE_BYTES", "MAIL_RATE_BYTES_BURST", 200 << 20, 50 << 20 },
+  [RATE_PREFETCH]    = { "MAIL_PREFETCH_RATE", "MAIL_PREFETCH_RATE_BURST", 1 << 30, 64 << 20 },
+};
+
+/** Internal function that maps the table into memory, creating it if
+ *  it doesn't exist yet. The mapping is kept for the lifetime of the
+ *  process (and inherited by forked children).
+ *
+ *  Returns: the table, or NULL if it cannot be mapped.
+ */
+static struct ratelimit_table *ratelimit_table(void) {
+
+  static struct ratelimit_table *table = NULL;
+  static int failed = 0;
+  struct ratelimit_table header;
+  struct stat st;
+
+  if (table || failed) return table;
+  failed = 1;
+
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  int fd = open(RATELIMIT_FILE_NAME, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) return NULL;
+
+  // Serialize creation between processes starting at the same time
+  flock(fd, LOCK_EX);
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(header) ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != RATELIMIT_MAGIC) {
+
+    // Slot count must be a power of two; the file is sparse until used
+    uint64_t slots = 1;
+    while (slots < config_long("MAIL_RATE_SLOTS", RATELIMIT_DEFAULT_SLOTS)) slots <<= 1;
+
+    header = (struct ratelimit_table) { .magic = RATELIMIT_MAGIC, .slot_count = slots };
+    if (ftruncate(fd, 0) < 0 ||
+	ftruncate(fd, sizeof(header) + slots * sizeof(struct ratelimit_slot)) < 0 ||
+	pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      close(fd);
+      return NULL;
+    }
+  }
+
+  void *map = mmap(NULL, sizeof(header) + header.slot_count * sizeof(struct ratelimit_slot),
+		   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  if (map == MAP_FAILED) return NULL;
+  table = map;
+  failed = 0;
+  return table;
+}
+
+/** Internal function that returns the current time in nanoseconds.
+ *  Wall-clock time is used, since the table outlives reboots.
+ */
+static uint64_t now_ns(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Internal function that reads the settings of a kind of limit: the
+ *  time it takes to earn one token, and how far ahead of now a bucket
+ *  may be pushed (the burst). Settings are read once per process.
+ *
+ *  Returns: zero if the limit is enabled, -1 otherwise.
+ */
+static int limit_of(int kind, uint64_t *interval, uint64_t *tolerance) {
+
+  static uint64_t intervals[RATE_KINDS], tolerances[RATE_KINDS];
+  static int loaded = 0;
+
+  if (!loaded) {
+    for (int i = 0; i < RATE_KINDS; i++) {
+      long rate = config_long(settings[i].rate_name, settings[i].rate);
+      long burst = config_long(settings[i].burst_name, settings[i].burst);
+      intervals[i] = rate > 0 ? 60000000000ULL / rate : 0;
+      tolerances[i] = intervals[i] * (burst > 0 ? burst : 1);
+    }
+    loaded = 1;
+  }
+
+  if (kind < 0 || kind >= RATE_KINDS || !intervals[kind]) return -1;
+  *interval = intervals[kind];
+  *tolerance = tolerances[kind];
+  return 0;
+}
+
+/** Internal function that finds the slot of an address, claiming an
+ *  empty slot, or one that has been idle long enough for all its
+ *  buckets to be full, if the address is not in the table yet.
+ *
+ *  Returns: the address's slot, or NULL if no slot could be claimed.
+ */
+static struct ratelimit_slot *find_slot(uint64_t key, uint64_t now) {
+
+  struct ratelimit_table *table = ratelimit_table();
+  if (!table) return NULL;
+
+  uint64_t mask = table->slot_count - 1;
+  uint64_t i = key & mask;
+  struct ratelimit_slot *idle = NULL;
+  uint64_t idle_key = 0;
+
+  for (int n = 0; n < RATELIMIT_MAX_PROBES; n++, i = (i + 1) & mask) {
+    struct ratelimit_slot *slot = &table->slots[i];
+    uint64_t slot_key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+    if (slot_key == key)
+      return slot;
+    if (slot_key == 0) {
+      if (__sync_bool_compare_and_swap(&slot->key, 0, key) ||
+	  __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) == key)
+	return slot;
+      continue;
+    }
+
+    if (!idle) {
+      int full = 1;
+      for (int k = 0; k < RATE_KINDS; k++)
+	full &= __atomic_load_n(&slot->full_at[k], __ATOMIC_RELAXED) <= now;
+      if (full) {
+	idle = slot;
+	idle_key = slot_key;
+      }
+    }
+  }
+
+  // Full buckets look the same for any address, so they are reused as they are
+  if (idle && __sync_bool_compare_and_swap(&idle->key, idle_key, key))
+    return idle;
+  return NULL;
+}
+
+/** Computes the key identifying a client address in the table: the
+ *  IPv4 address, or the /64 network of an IPv6 address.
+ *
+ *  Parameters: addr: Address of the client.
+ *
+ *  Returns: the key, never zero.
+ */
+uint64_t ratelimit_key(const struct sockaddr *addr) {
+
+  const unsigned char *bytes = NULL;
+  size_t length = 0;
+  uint64_t key = 0xcbf29ce484222325ULL;
+
+  if (addr->sa_family == AF_INET) {
+    bytes = (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr;
+    length = 4;
+  } else if (addr->sa_family == AF_INET6) {
+    const struct in6_addr *in6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+    bytes = in6->s6_addr;
+    length = 8;
+    if (IN6_IS_ADDR_V4MAPPED(in6)) {
+      bytes += 12;
+      length = 4;
+    }
+  }
+
+  // 64-bit FNV-1a of the address bytes; zero marks an empty slot
+  for (size_t i = 0; i < length; i++) {
+    key ^= bytes[i];
+    key *= 0x100000001b3ULL;
+  }
+  return key ? key : 1;
+}
+
+/** Computes the key identifying the client connected to a socket.
+ *
+ *  Parameters: fd: Socket connected to the client.
+ *
+ *  Returns: the key (see ratelimit_key).
+ */
+uint64_t ratelimit_peer(int fd) {
+
+  struct sockaddr_storage addr;
+  socklen_t length = sizeof(addr);
+
+  if (getpeername(fd, (struct sockaddr *) &addr, &length) < 0)
+    addr.ss_family = AF_UNSPEC;
+  return ratelimit_key((struct sockaddr *) &addr);
+}
+
+/** Takes tokens from a bucket of a client, if the bucket has enough
+ *  of them. An amount of zero only checks that the bucket is not
+ *  empty. Clients are let through if the table is not available.
+ *
+ *  Parameters: key: Key of the client (see ratelimit_key).
+ *              kind: Bucket to take from (RATE_CONNECTIONS,
+ *                    RATE_MESSAGES, RATE_BYTES or RATE_PREFETCH).
+ *              amount: Number of tokens to take.
+ *
+ *  Returns: non-zero if the tokens were taken (or the limit is
+ *           disabled), zero if the client is over its limit.
+ */
+int ratelimit_take(uint64_t key, int kind, uint64_t amount) {
+
+  uint64_t interval, tolerance, now = now_ns();
+  if (limit_of(kind, &interval, &tolerance) < 0) return 1;
+
+  struct ratelimit_slot *slot = find_slot(key, now);
+  if (!slot) return 1;
+
+  // Checking is done as if a single token was taken
+  uint64_t cost = (amount ? amount : 1) * interval;
+  uint64_t full_at = __atomic_load_n(&slot->full_at[kind], __ATOMIC_RELAXED);
+  while (1) {
+    uint64_t next = (full_at > now ? full_at : now) + cost;
+    if (next - now > tolerance)
+      return 0;
+    if (!amount || __atomic_compare_exchange_n(&slot->full_at[kind], &full_at, next, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  }
+}
+
+/** Takes tokens from a bucket of a client even if it doesn't have
+ *  enough of them (e.g., for data already received), so the client
+ *  is over its limit until it earns them back.
+ *
+ *  Parameters: key: Key of the client (see ratelimit_key).
+ *              kind: Bucket to take from.
+ *              amount: Number of tokens to take.
+ */
+void ratelimit_charge(uint64_t key, int kind, uint64_t amount) {
+
+  uint64_t interval, tolerance, now = now_ns();
+  if (limit_of(kind, &interval, &tolerance) < 0) return;
+
+  struct ratelimit_slot *slot = find_slot(key, now);
+  if (!slot) return;
+
+  // Debt is capped, so a single huge message doesn't lock a client out for days
+  uint64_t full_at = __atomic_load_n(&slot->full_at[kind], __ATOMIC_RELAXED);
+  uint64_t next;
+  do {
+    next = (full_at > now ? full_at : now) + amount * interval;
+    if (next - now > 2 * tolerance)
+      next = now + 2 * tolerance;
+  } while (!__atomic_compare_exchange_n(&slot->full_at[kind], &full_at, next, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
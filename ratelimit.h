@@ -0,0 +1,26 @@
+/* ratelimit.h
+ * Shared table of per-address rate limits.
+ */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Things limited for each client address
+#define RATE_CONNECTIONS 0
+#define RATE_MESSAGES    1
+#define RATE_BYTES       2
+#define RATE_PREFETCH    3
+#define RATE_KINDS       4
+
+// Key of the buckets shared by the whole server instead of one client
+#define RATE_KEY_SERVER 1
+
+uint64_t ratelimit_key(const struct sockaddr *addr);
+uint64_t ratelimit_peer(int fd);
+int ratelimit_take(uint64_t key, int kind, uint64_t amount);
+void ratelimit_charge(uint64_t key, int kind, uint64_t amount);
+
+#endif
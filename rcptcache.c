@@ -0,0 +1,386 @@
+/* rcptcache.c
+ * Shared cache of recipient lookups, with a Bloom filter of valid users.
+ *
+ * Notes: Checking a recipient against the user store means scanning
+ * the users file, which is what dictionary attacks and backscatter
+ * (floods of RCPT TO for users that don't exist) make the server do
+ * over and over. This cache is a file in the mail storage mapped into
+ * every server process, holding two structures:
+ *
+ *  - A Bloom filter of all valid user names, rebuilt whenever the
+ *    users file changes. A name missing from the filter is certainly
+ *    not a user, so most unknown recipients are rejected after a few
+ *    hash operations, without looking at the users file.
+ *
+ *  - A fixed-size hash table of recent lookups, valid or not, each
+ *    kept for a limited time. It answers repeated lookups of valid
+ *    users, and of the few unknown names the filter lets through.
+ *
+ * The filter is double-buffered: a rebuild fills the filter not in
+ * use and then switches to it by bumping the generation, which also
+ * invalidates every cached lookup at once. Readers check that the
+ * generation didn't change while they tested the filter. Until a
+ * change of the users file is built into the filter, unknown names are
+ * left to the user store rather than rejected. Entries of
+ * the table are protected by a sequence counter, as in shmcache.c.
+ */
+
+#include "rcptcache.h"
+#include "mailuser.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define RCPTCACHE_MAGIC 0x4548434354504353ULL
+#define RCPTCACHE_HASHES 7
+#define RCPTCACHE_PROBES 4
+#define RCPTCACHE_REBUILD_TIMEOUT 60
+
+struct rcptcache_entry {
+  uint32_t seq;
+  uint32_t valid;
+  uint64_t generation;
+  uint64_t expires;
+  uint64_t hash;
+  char key[RCPTCACHE_KEY_MAX];
+};
+
+struct rcptcache {
+  uint64_t magic;
+  uint64_t entry_count;
+  uint64_t filter_bits;
+  uint64_t generation;
+  uint64_t stamp;
+  uint64_t seen;
+  uint64_t checked;
+  uint64_t rebuilding;
+  uint64_t users;
+  uint64_t filter_rejects;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t stores;
+  uint64_t evictions;
+  uint64_t rebuilds;
+  struct rcptcache_entry entries[];
+};
+
+/** Maps a recipient cache into memory, creating it if it doesn't
+ *  exist yet. The sizes are only used when the cache is created; an
+ *  existing cache keeps its geometry until its file is removed. The
+ *  mapping is kept for the lifetime of the process (and inherited by
+ *  forked children).
+ *
+ *  Parameters: file_name: Name of the cache file.
+ *              entries: Number of lookups kept in the cache (rounded
+ *                       up to a power of two).
+ *              filter_bytes: Size of the Bloom filter (rounded up to
+ *                            a power of two), or zero for none.
+ *
+ *  Returns: A rcptcache_t object, or NULL if the number of entries is
+ *           zero (cache disabled) or the cache cannot be mapped.
+ */
+rcptcache_t rcptcache_open(const char *file_name, long entries, long filter_bytes) {
+
+  struct rcptcache header;
+  struct stat st;
+
+  if (entries <= 0 || filter_bytes < 0)
+    return NULL;
+
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  int fd = open(file_name, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) return NULL;
+
+  // Serialize creation between processes starting at the same time
+  flock(fd, LOCK_EX);
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(header) ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != RCPTCACHE_MAGIC) {
+
+    // Both sizes are powers of two, so they are indexed by masking
+    uint64_t count = 1, bits = filter_bytes ? 64 : 0;
+    while (count < entries) count <<= 1;
+    while (bits && bits < filter_bytes * 8ULL) bits <<= 1;
+
+    header = (struct rcptcache) { .magic = RCPTCACHE_MAGIC, .entry_count = count,
+				  .filter_bits = bits };
+    if (ftruncate(fd, 0) < 0 ||
+	ftruncate(fd, sizeof(header) + count * sizeof(struct rcptcache_entry) + bits / 4) < 0 ||
+	pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      close(fd);
+      return NULL;
+    }
+  }
+
+  void *map = mmap(NULL, sizeof(header) + header.entry_count * sizeof(struct rcptcache_entry) +
+		   header.filter_bits / 4, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  return map == MAP_FAILED ? NULL : map;
+}
+
+/** Internal function that returns one of the two Bloom filters.
+ */
+static uint64_t *filter_at(rcptcache_t cache, uint64_t which) {
+  return (uint64_t *) &cache->entries[cache->entry_count] + (which & 1) * (cache->filter_bits / 64);
+}
+
+/** Internal function that converts a user name to the form used as a
+ *  key (lowercase, as user names are not case sensitive) and hashes
+ *  it with 64-bit FNV-1a.
+ *
+ *  Returns: the hash, or zero if the name is too long to be cached.
+ */
+static uint64_t make_key(const char *username, char key[RCPTCACHE_KEY_MAX]) {
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t len = 0;
+
+  for (const char *p = username; *p; p++) {
+    if (len == RCPTCACHE_KEY_MAX - 1) return 0;
+    key[len] = tolower((unsigned char) *p);
+    hash ^= (unsigned char) key[len++];
+    hash *= 0x100000001b3ULL;
+  }
+  key[len] = 0;
+  return hash ? hash : 1;
+}
+
+/** Internal function that tests (or, if set is non-zero, sets) the
+ *  bits of a key in a Bloom filter. The bit positions are derived
+ *  from the two halves of the key's hash (double hashing).
+ *
+ *  Returns: non-zero if all bits of the key are set.
+ */
+static int filter_bits(rcptcache_t cache, uint64_t *filter, uint64_t hash, int set) {
+
+  uint64_t mask = cache->filter_bits - 1;
+  uint32_t h1 = (uint32_t) hash, h2 = (uint32_t) (hash >> 32) | 1;
+
+  for (int i = 0; i < RCPTCACHE_HASHES; i++) {
+    uint64_t bit = (h1 + (uint64_t) i * h2) & mask;
+    if (set)
+      filter[bit / 64] |= 1ULL << (bit % 64);
+    else if (!(__atomic_load_n(&filter[bit / 64], __ATOMIC_RELAXED) & (1ULL << (bit % 64))))
+      return 0;
+  }
+  return 1;
+}
+
+/** Internal function that computes a value that changes whenever the
+ *  users file is replaced or modified.
+ */
+static uint64_t file_stamp(const char *file_name) {
+
+  struct stat st;
+  if (stat(file_name, &st) < 0)
+    return 1;
+
+  uint64_t stamp = 0xcbf29ce484222325ULL;
+  uint64_t fields[] = { st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+  for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    stamp ^= fields[i];
+    stamp *= 0x100000001b3ULL;
+  }
+  return stamp ? stamp : 2;
+}
+
+/** Rebuilds the Bloom filter if the users file has changed since it
+ *  was built, which also discards all cached lookups. The file is
+ *  checked at most once per second by all processes together, and
+ *  only one process rebuilds the filter at a time.
+ *
+ *  Parameters: cache: Cache to be refreshed.
+ *              user_file: Name of the users file.
+ *              reader: Function called to read the users file, one
+ *                      user name per call, when rebuilding.
+ *              context: Argument passed to the reader.
+ */
+void rcptcache_refresh(rcptcache_t cache, const char *user_file, rcptcache_reader_t reader, void *context) {
+
+  uint64_t now = time(NULL);
+  uint64_t checked = __atomic_load_n(&cache->checked, __ATOMIC_RELAXED);
+  if (checked == now || !__sync_bool_compare_and_swap(&cache->checked, checked, now))
+    return;
+
+  // Stamp seen is published first, so lookups stop rejecting names while the filter is rebuilt
+  uint64_t stamp = file_stamp(user_file);
+  __atomic_store_n(&cache->seen, stamp, __ATOMIC_RELEASE);
+  if (stamp == __atomic_load_n(&cache->stamp, __ATOMIC_ACQUIRE))
+    return;
+
+  // A rebuild left behind by a process that died is taken over after a while
+  uint64_t rebuilding = __atomic_load_n(&cache->rebuilding, __ATOMIC_RELAXED);
+  if ((rebuilding && rebuilding + RCPTCACHE_REBUILD_TIMEOUT > now) ||
+      !__sync_bool_compare_and_swap(&cache->rebuilding, rebuilding, now))
+    return;
+
+  // The filter not in use is filled in, then made current with the new generation
+  uint64_t generation = __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+  uint64_t users = 0;
+  const char *username;
+  char key[RCPTCACHE_KEY_MAX];
+  uint64_t *filter = cache->filter_bits ? filter_at(cache, generation + 1) : NULL;
+
+  if (filter)
+    memset(filter, 0, cache->filter_bits / 8);
+  while ((username = reader(context)) != NULL) {
+    uint64_t hash = make_key(username, key);
+    if (filter && hash)
+      filter_bits(cache, filter, hash, 1);
+    users++;
+  }
+
+  cache->users = users;
+  __atomic_store_n(&cache->stamp, stamp, __ATOMIC_RELEASE);
+  __atomic_store_n(&cache->generation, generation + 1, __ATOMIC_RELEASE);
+  __sync_fetch_and_add(&cache->rebuilds, 1);
+  __atomic_store_n(&cache->rebuilding, 0, __ATOMIC_RELEASE);
+}
+
+/** Checks a user name against the cache: first the Bloom filter of
+ *  valid users, then the lookups cached since the users file last
+ *  changed. Once rcptcache_refresh has noticed a change of the users
+ *  file, users are not reported as invalid until the filter is rebuilt
+ *  from the new file, so users just added are only rejected within
+ *  the interval at which the file is checked (one second).
+ *
+ *  Parameters: cache: Cache to be searched.
+ *              username: Name of the user.
+ *
+ *  Returns: 1 if the user is known to be valid, 0 if it is known not
+ *           to be, or -1 if the user store must be checked.
+ */
+int rcptcache_lookup(rcptcache_t cache, const char *username) {
+
+  char key[RCPTCACHE_KEY_MAX];
+  uint64_t hash = make_key(username, key);
+  uint64_t generation = __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+  int stale = __atomic_load_n(&cache->seen, __ATOMIC_ACQUIRE) != __atomic_load_n(&cache->stamp, __ATOMIC_ACQUIRE);
+
+  // Nothing is known until the filter has been built once (see rcptcache_refresh)
+  if (!hash || !generation)
+    return -1;
+
+  // The filter tested may be refilled only after a later rebuild has started
+  if (cache->filter_bits && !filter_bits(cache, filter_at(cache, generation), hash, 0)) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&cache->generation, __ATOMIC_RELAXED) == generation) {
+      if (stale) {
+	__sync_fetch_and_add(&cache->misses, 1);
+	return -1;
+      }
+      __sync_fetch_and_add(&cache->filter_rejects, 1);
+      return 0;
+    }
+  }
+
+  uint64_t now = time(NULL);
+  uint64_t mask = cache->entry_count - 1;
+  for (uint64_t n = 0, i = hash & mask; n < RCPTCACHE_PROBES; n++, i = (i + 1) & mask) {
+    struct rcptcache_entry *entry = &cache->entries[i];
+    uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || entry->hash != hash || entry->generation != generation ||
+	entry->expires <= now || strncmp(entry->key, key, sizeof(entry->key)))
+      continue;
+
+    int valid = entry->valid;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq ||
+	(!valid && stale))
+      break;
+
+    __sync_fetch_and_add(&cache->hits, 1);
+    return valid;
+  }
+
+  __sync_fetch_and_add(&cache->misses, 1);
+  return -1;
+}
+
+/** Stores the result of a lookup in the user store. It replaces an
+ *  earlier result for the same user or, if there is none, the entry
+ *  among those the user may be stored in that expires first. Results
+ *  are not stored while another process writes the chosen entry.
+ *
+ *  Parameters: cache: Cache where the result will be stored.
+ *              username: Name of the user.
+ *              valid: Non-zero if the user is valid.
+ *              ttl: Number of seconds the result is kept; zero or
+ *                   less to not store it.
+ */
+void rcptcache_store(rcptcache_t cache, const char *username, int valid, long ttl) {
+
+  char key[RCPTCACHE_KEY_MAX];
+  uint64_t hash = make_key(username, key);
+  uint64_t generation = __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+
+  if (!hash || !generation || ttl <= 0)
+    return;
+
+  uint64_t now = time(NULL);
+  uint64_t mask = cache->entry_count - 1;
+  struct rcptcache_entry *victim = NULL;
+  for (uint64_t n = 0, i = hash & mask; n < RCPTCACHE_PROBES; n++, i = (i + 1) & mask) {
+    struct rcptcache_entry *entry = &cache->entries[i];
+    if (entry->hash == hash && !strncmp(entry->key, key, sizeof(entry->key))) {
+      victim = entry;
+      break;
+    }
+    if (!victim || entry->generation != generation || entry->expires < victim->expires)
+      victim = entry;
+  }
+
+  uint32_t seq = __atomic_load_n(&victim->seq, __ATOMIC_ACQUIRE);
+  if ((seq & 1) || !__sync_bool_compare_and_swap(&victim->seq, seq, seq + 1))
+    return;
+
+  if (victim->hash && victim->hash != hash && victim->generation == generation && victim->expires > now)
+    __sync_fetch_and_add(&cache->evictions, 1);
+
+  strcpy(victim->key, key);
+  victim->hash = hash;
+  victim->valid = valid != 0;
+  victim->generation = generation;
+  victim->expires = now + ttl;
+
+  __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+  __sync_fetch_and_add(&cache->stores, 1);
+}
+
+/** Retrieves the cache counters: recipients rejected by the Bloom
+ *  filter, lookups answered from the cached results (hits) or not
+ *  (misses), results stored and entries evicted to make room for
+ *  other users, and filter rebuilds, as well as the cache geometry.
+ *
+ *  Parameters: cache: Cache to be assessed.
+ *              stats: Receives the counters.
+ */
+void rcptcache_stats(rcptcache_t cache, struct rcptcache_stats *stats) {
+
+  uint64_t generation = __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+  uint64_t now = time(NULL);
+
+  stats->filter_rejects = __atomic_load_n(&cache->filter_rejects, __ATOMIC_RELAXED);
+  stats->hits           = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+  stats->misses         = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+  stats->stores         = __atomic_load_n(&cache->stores, __ATOMIC_RELAXED);
+  stats->evictions      = __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED);
+  stats->rebuilds       = __atomic_load_n(&cache->rebuilds, __ATOMIC_RELAXED);
+  stats->users          = cache->users;
+  stats->entry_count    = cache->entry_count;
+  stats->filter_bits    = cache->filter_bits;
+  stats->entries_used   = 0;
+  for (uint64_t i = 0; i < cache->entry_count; i++)
+    stats->entries_used += cache->entries[i].hash && cache->entries[i].generation == generation &&
+      cache->entries[i].expires > now;
+}
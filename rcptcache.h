@@ -0,0 +1,36 @@
+/* rcptcache.h
+ * Shared cache of recipient lookups, with a Bloom filter of valid users.
+ */
+
+#ifndef _RCPTCACHE_H_
+#define _RCPTCACHE_H_
+
+#include <stdint.h>
+
+#define RCPTCACHE_KEY_MAX 256
+
+typedef struct rcptcache *rcptcache_t;
+
+// Returns the next user name of the user store, or NULL at the end
+typedef const char *(*rcptcache_reader_t)(void *context);
+
+struct rcptcache_stats {
+  uint64_t filter_rejects;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t stores;
+  uint64_t evictions;
+  uint64_t rebuilds;
+  uint64_t users;
+  uint64_t entries_used;
+  uint64_t entry_count;
+  uint64_t filter_bits;
+};
+
+rcptcache_t rcptcache_open(const char *file_name, long entries, long filter_bytes);
+void rcptcache_refresh(rcptcache_t cache, const char *user_file, rcptcache_reader_t reader, void *context);
+int rcptcache_lookup(rcptcache_t cache, const char *username);
+void rcptcache_store(rcptcache_t cache, const char *username, int valid, long ttl);
+void rcptcache_stats(rcptcache_t cache, struct rcptcache_stats *stats);
+
+#endif
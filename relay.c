@@ -0,0 +1,816 @@
+/* relay.c
+ * Queue of messages to be relayed to other mail servers.
+ *
+ * Notes: Messages for recipients that are not local users are relayed
+ * through a smarthost (MAIL_RELAY_HOST, as host or host:port), for
+ * clients in the networks listed in MAIL_RELAY_CLIENTS (addresses or
+ * address/prefix pairs, separated by commas; loopback by default);
+ * anyone else may only send to local users. An SMTP
+ * session queues the message in the outbound directory, in the same
+ * format as the local delivery queue (see queue.c): a hard link to the
+ * spool file (<id>.msg) and an entry file (<id>.rcpt) holding the
+ * time the message was queued, the number of attempts, the time of the
+ * next attempt, the destination, the message information, the sender
+ * and one recipient per line. New entries are written to a separate
+ * directory (new), so the scheduler finds them without listing the
+ * whole queue. Submitting takes two steps: relay_prepare writes the
+ * entry under a name the scheduler ignores (<id>.held), and
+ * relay_commit renames it into place, so a session can prepare every
+ * part of a message and only release them once all parts are safe
+ * (or discard them with relay_cancel).
+ *
+ * A single scheduler process owns the queue. It keeps every entry in a
+ * binary heap ordered by the time of its next attempt, so deferred
+ * entries cost nothing until they are due, however many there are;
+ * the whole queue is only listed when the scheduler starts (e.g.,
+ * after a crash). Due entries wait in a list per destination and are
+ * handed, in batches, to sender processes, each of which opens one
+ * SMTP connection to the destination and sends all messages of its
+ * batch through it. The number of sender processes per destination is
+ * limited (MAIL_RELAY_CONNECTIONS). Senders update or remove the
+ * entries they handle; when a sender exits, the scheduler reads back
+ * the entries that are left and puts them in the heap again.
+ *
+ * Front ends of a storage cluster (see shard.c) use the same queue to
+ * forward messages for local users to the node that owns their
+ * mailboxes; each entry names its own destination.
+ *
+ * Temporary failures are retried with exponential backoff; messages
+ * refused permanently (5xx), or that run out of attempts, are dropped
+ * (no bounce messages are generated).
+ */
+
+#include "relay.h"
+#include "config.h"
+#include "server.h"
+#include "netbuffer.h"
+#include "shard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define RELAY_NEW_DIRECTORY  RELAY_DIRECTORY "/new"
+#define RELAY_MESSAGE_SUFFIX ".msg"
+#define RELAY_ENTRY_SUFFIX   ".rcpt"
+#define RELAY_TEMP_SUFFIX    ".tmp"
+#define RELAY_HELD_SUFFIX    ".held"
+
+#define RELAY_DESTINATION_MAX 256
+#define RELAY_MAX_DESTINATIONS 64
+#define RELAY_MAX_BATCH 1000
+#define RELAY_LINE_MAX 1024
+#define RELAY_READ_CHUNK 65536
+#define RELAY_STALE_SECONDS 600
+#define RELAY_TIMEOUT_SECONDS 120
+
+struct relay_entry {
+  char *data;
+  unsigned long long queued;
+  int attempts;
+  long long next_attempt;
+  const char *destination;
+  const char *info;
+  const char *sender;
+  user_list_t recipients;
+};
+
+struct relay_task {
+  time_t due;
+  unsigned int destination;
+  char id[RELAY_ID_MAX];
+};
+
+struct relay_tasks {
+  size_t count;
+  size_t capacity;
+  struct relay_task *tasks;
+};
+
+struct relay_destination {
+  char name[RELAY_DESTINATION_MAX];
+  int connections;
+  struct relay_tasks ready;
+};
+
+struct relay_sender {
+  pid_t pid;
+  unsigned int destination;
+  struct relay_tasks batch;
+};
+
+// Scheduler process, woken up when messages are submitted (see relay_commit)
+static pid_t scheduler = 0;
+
+// State of the scheduler process
+static struct relay_tasks heap;
+static struct relay_destination destinations[RELAY_MAX_DESTINATIONS];
+static unsigned int destination_count = 0;
+static struct relay_sender *senders = NULL;
+static int sender_count = 0;
+
+/** Returns non-zero if messages for non-local recipients are relayed
+ *  (i.e., MAIL_RELAY_HOST is set).
+ */
+int relay_enabled(void) {
+  return config_string("MAIL_RELAY_HOST", NULL) != NULL;
+}
+
+/** Checks if the client on a connection may relay messages to
+ *  non-local recipients, i.e., if relaying is enabled and the client
+ *  address is in one of the networks in MAIL_RELAY_CLIENTS.
+ *
+ *  Parameters: fd: Socket of the client connection.
+ *
+ *  Returns: non-zero if the client may relay.
+ */
+int relay_client_allowed(int fd) {
+
+  struct sockaddr_storage addr;
+  socklen_t length = sizeof(addr);
+
+  if (!relay_enabled() || getpeername(fd, (struct sockaddr *) &addr, &length) < 0)
+    return 0;
+
+  return address_in_networks((struct sockaddr *) &addr, config_string("MAIL_RELAY_CLIENTS", "127.0.0.0/8,::1"));
+}
+
+/** Internal function that builds the path of a file of a queue entry.
+ */
+static int entry_path(char path[PATH_MAX], const char *dir, const char *id, const char *suffix) {
+  return snprintf(path, PATH_MAX, "%s/%s%s", dir, id, suffix) < PATH_MAX ? 0 : -1;
+}
+
+/** Internal function that makes changes to a queue directory durable.
+ */
+static void sync_directory(const char *dir) {
+
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/** Internal function that writes the entry file of a message under a
+ *  temporary name, syncs it and renames it into place (with the given
+ *  suffix).
+ *
+ *  Returns: zero on success, -1 on error.
+ */
+static int write_entry_as(const char *dir, const char *id, const char *suffix,
+			  const struct relay_entry *entry) {
+
+  char temp[PATH_MAX], path[PATH_MAX];
+  if (entry_path(temp, dir, id, RELAY_TEMP_SUFFIX) < 0 || entry_path(path, dir, id, suffix) < 0)
+    return -1;
+
+  FILE *file = fopen(temp, "w");
+  if (!file) return -1;
+
+  fprintf(file, "%llu %d %lld\n%s\n%s\n%s\n", entry->queued, entry->attempts, entry->next_attempt,
+	  entry->destination, entry->info, entry->sender);
+  for (user_list_t user = entry->recipients; user; user = get_next_user(user))
+    fprintf(file, "%s\n", get_user_name(user));
+
+  if (fflush(file) != 0 || fsync(fileno(file)) < 0) {
+    fclose(file);
+    unlink(temp);
+    return -1;
+  }
+  fclose(file);
+
+  if (rename(temp, path) < 0) {
+    unlink(temp);
+    return -1;
+  }
+  sync_directory(dir);
+  return 0;
+}
+
+/** Internal function that writes the entry file of a message, see
+ *  write_entry_as.
+ */
+static int write_entry(const char *dir, const char *id, const struct relay_entry *entry) {
+  return write_entry_as(dir, id, RELAY_ENTRY_SUFFIX, entry);
+}
+
+/** Internal function that reads the entry file of a message. The
+ *  entry must be released with free_entry.
+ *
+ *  Returns: zero on success, -1 if the entry doesn't exist or is
+ *           malformed.
+ */
+static int read_entry(const char *dir, const char *id, struct relay_entry *entry) {
+
+  char path[PATH_MAX];
+  struct stat st;
+  int offset;
+
+  memset(entry, 0, sizeof(*entry));
+  if (entry_path(path, dir, id, RELAY_ENTRY_SUFFIX) < 0) return -1;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || (entry->data = malloc(st.st_size + 1)) == NULL ||
+      read(fd, entry->data, st.st_size) != st.st_size) {
+    close(fd);
+    free(entry->data);
+    return -1;
+  }
+  close(fd);
+  entry->data[st.st_size] = 0;
+
+  if (sscanf(entry->data, "%llu %d %lld\n%n", &entry->queued, &entry->attempts,
+	     &entry->next_attempt, &offset) != 3) {
+    free(entry->data);
+    return -1;
+  }
+
+  // Destination, information and sender, followed by one recipient per line
+  const char **fields[] = { &entry->destination, &entry->info, &entry->sender };
+  char *line = entry->data + offset;
+  for (int i = 0; i < 3; i++) {
+    char *end = strchr(line, '\n');
+    if (!end) {
+      free(entry->data);
+      return -1;
+    }
+    *end = 0;
+    *fields[i] = line;
+    line = end + 1;
+  }
+  for (char *end; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+    *end = 0;
+    if (*line) add_user_to_list(&entry->recipients, line, NULL);
+  }
+  return 0;
+}
+
+/** Internal function that releases an entry read with read_entry.
+ */
+static void free_entry(struct relay_entry *entry) {
+  destroy_user_list(entry->recipients);
+  free(entry->data);
+}
+
+/** Prepares a message to be relayed to non-local recipients. The
+ *  message is on disk (and synced) when this function returns, but it
+ *  is only queued once relay_commit is called; until then it can be
+ *  discarded with relay_cancel. Entries left prepared by a session
+ *  that died are removed by the scheduler after a while.
+ *
+ *  Parameters: destination: Server the message is sent to (host or
+ *                           host:port), or NULL for the smarthost
+ *                           (MAIL_RELAY_HOST).
+ *              basefile: Name of a file containing the contents of the
+ *                        email message, as written by the spool
+ *                        functions; it must be in the same file system
+ *                        as the mail storage.
+ *              info: Message information, as returned by spool_info.
+ *              sender: Address given in the MAIL command.
+ *              recipients: Non-local recipient addresses.
+ *              id: Receives the ID of the prepared entry.
+ *
+ *  Returns: zero on success, -1 if the message could not be prepared.
+ */
+int relay_prepare(const char *destination, const char *basefile, const char *info,
+		  const char *sender, user_list_t recipients, char id[RELAY_ID_MAX]) {
+
+  static unsigned int counter = 0;
+  char message[PATH_MAX];
+  int rv;
+
+  if (!destination)
+    destination = config_string("MAIL_RELAY_HOST", NULL);
+  if (!destination || strlen(destination) >= RELAY_DESTINATION_MAX) return -1;
+
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  mkdir(RELAY_DIRECTORY, 0777);
+  mkdir(RELAY_NEW_DIRECTORY, 0777);
+
+  // Spool file is linked, not copied, so its data must be on disk
+  int fd = open(basefile, O_RDONLY);
+  if (fd < 0) return -1;
+  rv = fsync(fd);
+  close(fd);
+  if (rv < 0) return -1;
+
+  do {
+    snprintf(id, RELAY_ID_MAX, "%lx-%x-%x", (unsigned long) time(NULL), (unsigned int) getpid(), counter++);
+    if (entry_path(message, RELAY_NEW_DIRECTORY, id, RELAY_MESSAGE_SUFFIX) < 0) return -1;
+  } while ((rv = link(basefile, message)) < 0 && errno == EEXIST);
+  if (rv < 0) return -1;
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  struct relay_entry entry = { .queued = (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000,
+			       .destination = destination, .info = info, .sender = sender,
+			       .recipients = recipients };
+  if (write_entry_as(RELAY_NEW_DIRECTORY, id, RELAY_HELD_SUFFIX, &entry) < 0) {
+    unlink(message);
+    return -1;
+  }
+  return 0;
+}
+
+/** Queues a message prepared with relay_prepare, and wakes up the
+ *  scheduler.
+ *
+ *  Parameters: id: ID of the prepared entry.
+ *
+ *  Returns: zero on success, -1 if the message could not be queued
+ *           (it stays prepared, and may be discarded with
+ *           relay_cancel).
+ */
+int relay_commit(const char *id) {
+
+  char held[PATH_MAX], path[PATH_MAX];
+  if (entry_path(held, RELAY_NEW_DIRECTORY, id, RELAY_HELD_SUFFIX) < 0 ||
+      entry_path(path, RELAY_NEW_DIRECTORY, id, RELAY_ENTRY_SUFFIX) < 0 ||
+      rename(held, path) < 0)
+    return -1;
+  sync_directory(RELAY_NEW_DIRECTORY);
+
+  if (scheduler)
+    kill(scheduler, SIGUSR1);
+  return 0;
+}
+
+/** Discards a message prepared with relay_prepare and not committed.
+ *
+ *  Parameters: id: ID of the prepared entry.
+ */
+void relay_cancel(const char *id) {
+
+  char path[PATH_MAX];
+  if (entry_path(path, RELAY_NEW_DIRECTORY, id, RELAY_HELD_SUFFIX) == 0)
+    unlink(path);
+  if (entry_path(path, RELAY_NEW_DIRECTORY, id, RELAY_MESSAGE_SUFFIX) == 0)
+    unlink(path);
+}
+
+/** Internal function that removes the entry of a message, or, if some
+ *  recipients are left to be retried, schedules the next attempt for
+ *  them (MAIL_RELAY_RETRY_SECONDS, doubled at each attempt, up to
+ *  MAIL_RELAY_MAX_ATTEMPTS attempts).
+ */
+static void complete_entry(const char *id, struct relay_entry *entry, user_list_t retry) {
+
+  char path[PATH_MAX], message[PATH_MAX];
+
+  if (retry && entry->attempts + 1 < config_long("MAIL_RELAY_MAX_ATTEMPTS", 20)) {
+    long delay = config_long("MAIL_RELAY_RETRY_SECONDS", 60);
+    for (int i = 0; i < entry->attempts && delay < 4 * 3600; i++)
+      delay *= 2;
+
+    struct relay_entry next = *entry;
+    next.attempts++;
+    next.next_attempt = time(NULL) + delay;
+    next.recipients = retry;
+    if (write_entry(RELAY_DIRECTORY, id, &next) == 0)
+      return;
+  }
+
+  // Entry file goes first: without it the message file is only a leftover
+  if (entry_path(path, RELAY_DIRECTORY, id, RELAY_ENTRY_SUFFIX) == 0 &&
+      entry_path(message, RELAY_DIRECTORY, id, RELAY_MESSAGE_SUFFIX) == 0) {
+    unlink(path);
+    unlink(message);
+  }
+}
+
+/** Internal function that reads an SMTP reply, including all lines of
+ *  a multiline reply.
+ *
+ *  Returns: the reply code, or -1 if the connection was lost or the
+ *           reply is malformed.
+ */
+static int read_reply(net_buffer_t nb) {
+
+  char line[RELAY_LINE_MAX + 1];
+
+  while (1) {
+    int size = nb_read_line(nb, line);
+    if (size < 4 || !isdigit((unsigned char) line[0]))
+      return -1;
+    if (line[3] != '-')
+      return atoi(line);
+  }
+}
+
+/** Internal function that sends a command and reads its reply. The
+ *  command line is the verb, followed by the argument and the text
+ *  that closes it (e.g., "RCPT TO:<", address, ">").
+ *
+ *  Returns: the reply code, or -1 if the connection was lost.
+ */
+static int command(int fd, net_buffer_t nb, const char *verb, const char *argument, const char *end) {
+
+  struct reply reply;
+  reply_start(&reply, verb);
+  reply_text(&reply, argument);
+  reply_text(&reply, end);
+  reply_text(&reply, "\r\n");
+  return reply_send(fd, &reply) < 0 ? -1 : read_reply(nb);
+}
+
+/** Internal function that sends the contents of a message file,
+ *  followed by the terminating line. Message files are already in
+ *  wire format (dot-stuffed, CRLF); compressed files are inflated.
+ *
+ *  Returns: zero on success, -1 on error.
+ */
+static int send_message_file(int fd, const char *id) {
+
+  char path[PATH_MAX], buf[RELAY_READ_CHUNK];
+  int len, rv = 0;
+
+  if (entry_path(path, RELAY_DIRECTORY, id, RELAY_MESSAGE_SUFFIX) < 0) return -1;
+  int file_fd = open(path, O_RDONLY);
+  if (file_fd < 0) return -1;
+
+  // Uncompressed files are read as they are
+  gzFile file = gzdopen(file_fd, "rb");
+  if (!file) {
+    close(file_fd);
+    return -1;
+  }
+  while ((len = gzread(file, buf, sizeof(buf))) > 0)
+    if (send_all(fd, buf, len) < 0) {
+      rv = -1;
+      break;
+    }
+  if (len < 0) rv = -1;
+  gzclose(file);
+
+  return rv < 0 || send_fixed(fd, ".\r\n") < 0 ? -1 : 0;
+}
+
+/** Internal function that relays one message through an open SMTP
+ *  connection. Recipients refused temporarily (4xx) are kept for a
+ *  later attempt; those refused permanently (5xx) are dropped.
+ *
+ *  Returns: zero if the connection can be used for the next message,
+ *           -1 if it was lost (in which case the message is deferred).
+ */
+static int relay_message(int fd, net_buffer_t nb, const char *id, struct relay_entry *entry) {
+
+  user_list_t retry = NULL;
+  int accepted = 0;
+  int code = command(fd, nb, "MAIL FROM:<", entry->sender, ">");
+
+  if (code < 0 || code / 100 != 2) {
+    complete_entry(id, entry, code / 100 == 5 ? NULL : entry->recipients);
+    return code < 0 || command(fd, nb, "RSET", "", "") < 0 ? -1 : 0;
+  }
+
+  for (user_list_t user = entry->recipients; user; user = get_next_user(user)) {
+    code = command(fd, nb, "RCPT TO:<", get_user_name(user), ">");
+    if (code < 0) {
+      destroy_user_list(retry);
+      complete_entry(id, entry, entry->recipients);
+      return -1;
+    }
+    if (code / 100 == 2)
+      accepted++;
+    else if (code / 100 == 4)
+      add_user_to_list(&retry, get_user_name(user), NULL);
+  }
+
+  if (!accepted) {
+    complete_entry(id, entry, retry);
+    destroy_user_list(retry);
+    return command(fd, nb, "RSET", "", "") < 0 ? -1 : 0;
+  }
+
+  code = command(fd, nb, "DATA", "", "");
+  if (code == 354)
+    code = send_message_file(fd, id) < 0 ? -1 : read_reply(nb);
+
+  // Whole message is retried if it was not accepted for a temporary reason
+  if (code < 0 || code / 100 == 4)
+    complete_entry(id, entry, entry->recipients);
+  else
+    complete_entry(id, entry, retry);
+  destroy_user_list(retry);
+
+  if (code < 0) return -1;
+  return code / 100 == 2 || command(fd, nb, "RSET", "", "") >= 0 ? 0 : -1;
+}
+
+/** Internal function run by a sender process: relays a batch of
+ *  messages to a destination through a single SMTP connection. Entries
+ *  that cannot be sent because the connection failed are deferred.
+ */
+static void send_batch(const char *destination, const struct relay_tasks *batch) {
+
+  char hostname[256] = "localhost";
+  net_buffer_t nb = NULL;
+  int fd = connect_server(destination, "25", RELAY_TIMEOUT_SECONDS);
+
+  gethostname(hostname, sizeof(hostname));
+  int connected = fd >= 0 && (nb = nb_create(fd, RELAY_LINE_MAX, NULL)) != NULL &&
+    read_reply(nb) == 220 && command(fd, nb, "HELO ", hostname, "") == 250;
+
+  // Once the connection is lost, the rest of the batch is deferred
+  for (size_t i = 0; i < batch->count; i++) {
+    struct relay_entry entry;
+    if (read_entry(RELAY_DIRECTORY, batch->tasks[i].id, &entry) < 0)
+      continue;
+    if (!connected)
+      complete_entry(batch->tasks[i].id, &entry, entry.recipients);
+    else if (relay_message(fd, nb, batch->tasks[i].id, &entry) < 0)
+      connected = 0;
+    free_entry(&entry);
+  }
+
+  if (connected)
+    command(fd, nb, "QUIT", "", "");
+  if (nb) nb_destroy(nb);
+  if (fd >= 0) close(fd);
+}
+
+/** Internal function that adds a task to a list of tasks.
+ */
+static int add_task(struct relay_tasks *list, const struct relay_task *task) {
+
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? 2 * list->capacity : 64;
+    struct relay_task *tasks = realloc(list->tasks, capacity * sizeof(struct relay_task));
+    if (!tasks) return -1;
+    list->tasks = tasks;
+    list->capacity = capacity;
+  }
+  list->tasks[list->count++] = *task;
+  return 0;
+}
+
+/** Internal function that adds a task to the heap of the scheduler,
+ *  which keeps the task with the earliest due time at the top.
+ */
+static void heap_push(const struct relay_task *task) {
+
+  if (add_task(&heap, task) < 0) return;
+
+  // Sift up
+  size_t i = heap.count - 1;
+  while (i > 0 && heap.tasks[(i - 1) / 2].due > heap.tasks[i].due) {
+    struct relay_task tmp = heap.tasks[i];
+    heap.tasks[i] = heap.tasks[(i - 1) / 2];
+    heap.tasks[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+/** Internal function that removes the task at the top of the heap.
+ */
+static struct relay_task heap_pop(void) {
+
+  struct relay_task top = heap.tasks[0];
+  heap.tasks[0] = heap.tasks[--heap.count];
+
+  // Sift down
+  size_t i = 0;
+  while (1) {
+    size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+    if (left < heap.count && heap.tasks[left].due < heap.tasks[smallest].due) smallest = left;
+    if (right < heap.count && heap.tasks[right].due < heap.tasks[smallest].due) smallest = right;
+    if (smallest == i) break;
+    struct relay_task tmp = heap.tasks[i];
+    heap.tasks[i] = heap.tasks[smallest];
+    heap.tasks[smallest] = tmp;
+    i = smallest;
+  }
+  return top;
+}
+
+/** Internal function that returns the index of a destination in the
+ *  scheduler's table, adding it if needed.
+ *
+ *  Returns: the index, or -1 if the table is full.
+ */
+static int find_destination(const char *name) {
+
+  for (unsigned int i = 0; i < destination_count; i++)
+    if (!strcmp(destinations[i].name, name))
+      return i;
+  if (destination_count == RELAY_MAX_DESTINATIONS || strlen(name) >= RELAY_DESTINATION_MAX)
+    return -1;
+
+  strcpy(destinations[destination_count].name, name);
+  return destination_count++;
+}
+
+/** Internal function that reads the entry of a message in the queue
+ *  and puts it in the scheduler's heap at the time of its next attempt.
+ *  Entries that no longer exist are ignored.
+ */
+static void schedule_entry(const char *id) {
+
+  struct relay_entry entry;
+  if (read_entry(RELAY_DIRECTORY, id, &entry) < 0) return;
+
+  struct relay_task task = { .due = entry.next_attempt };
+  int destination = find_destination(entry.destination);
+  snprintf(task.id, sizeof(task.id), "%s", id);
+  free_entry(&entry);
+
+  if (destination >= 0) {
+    task.destination = destination;
+    heap_push(&task);
+  }
+}
+
+/** Internal function that lists a queue directory, calling a function
+ *  for the ID of each complete entry, and removing leftovers of
+ *  interrupted submissions once they are old enough.
+ */
+static void scan_directory(const char *dir, void (*found)(const char *id)) {
+
+  struct dirent *dir_entry;
+  char id[RELAY_ID_MAX], path[PATH_MAX], entry[PATH_MAX];
+  struct stat st;
+
+  DIR *d = opendir(dir);
+  if (!d) return;
+
+  while ((dir_entry = readdir(d)) != NULL) {
+    const char *suffix = strrchr(dir_entry->d_name, '.');
+    if (dir_entry->d_name[0] == '.' || !suffix || suffix - dir_entry->d_name >= RELAY_ID_MAX)
+      continue;
+    snprintf(id, sizeof(id), "%.*s", (int) (suffix - dir_entry->d_name), dir_entry->d_name);
+
+    if (!strcmp(suffix, RELAY_ENTRY_SUFFIX))
+      found(id);
+    else if (entry_path(path, dir, dir_entry->d_name, "") == 0 &&
+	     entry_path(entry, dir, id, RELAY_ENTRY_SUFFIX) == 0 &&
+	     stat(path, &st) == 0 && st.st_ctime + RELAY_STALE_SECONDS < time(NULL) &&
+	     access(entry, F_OK) < 0)
+      unlink(path);
+  }
+  closedir(d);
+}
+
+/** Internal function that moves a newly submitted entry into the
+ *  queue and schedules it.
+ */
+static void accept_new_entry(const char *id) {
+
+  char from[PATH_MAX], to[PATH_MAX];
+
+  // Message file goes first: an entry file without it is dropped when sent
+  if (entry_path(from, RELAY_NEW_DIRECTORY, id, RELAY_MESSAGE_SUFFIX) < 0 ||
+      entry_path(to, RELAY_DIRECTORY, id, RELAY_MESSAGE_SUFFIX) < 0 ||
+      rename(from, to) < 0 ||
+      entry_path(from, RELAY_NEW_DIRECTORY, id, RELAY_ENTRY_SUFFIX) < 0 ||
+      entry_path(to, RELAY_DIRECTORY, id, RELAY_ENTRY_SUFFIX) < 0 ||
+      rename(from, to) < 0)
+    return;
+
+  sync_directory(RELAY_DIRECTORY);
+  schedule_entry(id);
+}
+
+/** Internal function that starts a sender process for the next batch
+ *  of due messages of a destination (up to MAIL_RELAY_BATCH).
+ */
+static void start_sender(unsigned int destination) {
+
+  struct relay_destination *dest = &destinations[destination];
+  struct relay_sender sender = { .destination = destination };
+  long batch_size = config_long("MAIL_RELAY_BATCH", 20);
+  if (batch_size < 1) batch_size = 1;
+  if (batch_size > RELAY_MAX_BATCH) batch_size = RELAY_MAX_BATCH;
+
+  struct relay_sender *list = realloc(senders, (sender_count + 1) * sizeof(struct relay_sender));
+  if (!list) return;
+  senders = list;
+
+  size_t count = dest->ready.count < batch_size ? dest->ready.count : batch_size;
+  for (size_t i = 0; i < count; i++)
+    add_task(&sender.batch, &dest->ready.tasks[i]);
+  if (sender.batch.count != count) {
+    free(sender.batch.tasks);
+    return;
+  }
+
+  sender.pid = fork();
+  if (sender.pid == 0) {
+    send_batch(dest->name, &sender.batch);
+    exit(0);
+  }
+  if (sender.pid < 0) {
+    free(sender.batch.tasks);
+    return;
+  }
+
+  memmove(dest->ready.tasks, dest->ready.tasks + count, (dest->ready.count - count) * sizeof(struct relay_task));
+  dest->ready.count -= count;
+  dest->connections++;
+  senders[sender_count++] = sender;
+}
+
+/** Internal function that collects sender processes that finished,
+ *  putting the entries they left in the queue back in the heap.
+ */
+static void reap_senders(void) {
+
+  pid_t pid;
+  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+    for (int i = 0; i < sender_count; i++) {
+      if (senders[i].pid != pid) continue;
+
+      for (size_t j = 0; j < senders[i].batch.count; j++)
+	schedule_entry(senders[i].batch.tasks[j].id);
+      destinations[senders[i].destination].connections--;
+      free(senders[i].batch.tasks);
+      senders[i] = senders[--sender_count];
+      break;
+    }
+  }
+}
+
+/** Internal function run by the scheduler process. Exits when the
+ *  server process that started it goes away.
+ */
+static void run_scheduler(pid_t server, const sigset_t *wakeup) {
+
+  long poll = config_long("MAIL_RELAY_POLL_SECONDS", 30);
+  long connections = config_long("MAIL_RELAY_CONNECTIONS", 4);
+
+  // Everything in the queue is due at its recorded time, including entries interrupted by a crash
+  scan_directory(RELAY_DIRECTORY, schedule_entry);
+
+  while (getppid() == server) {
+    scan_directory(RELAY_NEW_DIRECTORY, accept_new_entry);
+    reap_senders();
+
+    time_t now = time(NULL);
+    while (heap.count && heap.tasks[0].due <= now) {
+      struct relay_task task = heap_pop();
+      add_task(&destinations[task.destination].ready, &task);
+    }
+
+    for (unsigned int i = 0; i < destination_count; i++)
+      while (destinations[i].ready.count && destinations[i].connections < connections) {
+	int before = sender_count;
+	start_sender(i);
+	if (sender_count == before) break;
+      }
+
+    // Sleeps until the next entry is due, a message is submitted or a sender finishes
+    struct timespec timeout = { .tv_sec = poll };
+    if (heap.count && heap.tasks[0].due - now < poll)
+      timeout.tv_sec = heap.tasks[0].due > now ? heap.tasks[0].due - now : 1;
+    sigtimedwait(wakeup, NULL, &timeout);
+  }
+  exit(0);
+}
+
+/** Starts the relay scheduler, if relaying is enabled or the server
+ *  is a front end of a storage cluster. It runs until
+ *  the calling process exits; messages submitted by this process and
+ *  its children (e.g., SMTP sessions) wake it up.
+ *
+ *  Returns: zero if the scheduler was started, -1 otherwise.
+ */
+int relay_start_scheduler(void) {
+
+  sigset_t wakeup, previous;
+
+  if (!relay_enabled() && !shard_enabled()) return -1;
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  mkdir(RELAY_DIRECTORY, 0777);
+  mkdir(RELAY_NEW_DIRECTORY, 0777);
+
+  // Signals stay blocked in the scheduler, so none is lost between passes
+  sigemptyset(&wakeup);
+  sigaddset(&wakeup, SIGUSR1);
+  sigaddset(&wakeup, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &wakeup, &previous);
+
+  pid_t server = getpid();
+  pid_t pid = fork();
+  if (pid == 0)
+    run_scheduler(server, &wakeup);
+
+  sigprocmask(SIG_SETMASK, &previous, NULL);
+  if (pid < 0) return -1;
+  scheduler = pid;
+  return 0;
+}
@@ -0,0 +1,21 @@
+/* relay.h
+ * Queue of messages to be relayed to other mail servers.
+ */
+
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include "mailuser.h"
+
+#define RELAY_DIRECTORY MAIL_BASE_DIRECTORY "/outbound"
+#define RELAY_ID_MAX 48
+
+int relay_enabled(void);
+int relay_client_allowed(int fd);
+int relay_start_scheduler(void);
+int relay_prepare(const char *destination, const char *basefile, const char *info, const char *sender,
+		  user_list_t recipients, char id[RELAY_ID_MAX]);
+int relay_commit(const char *id);
+void relay_cancel(const char *id);
+
+#endif
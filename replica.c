@@ -0,0 +1,672 @@
+/* replica.c
+ * Replication of the mail storage to a standby server.
+ *
+ * Notes: A standby server keeps a copy of the mail storage of the
+ * primary, to take over if the primary is lost. The primary records
+ * every change to its mailboxes in a change log (see changelog.c); a
+ * shipper process, started by the SMTP server when MAIL_REPLICA_HOST
+ * is set (as host or host:port), streams the log to a receiver on the
+ * standby (mailadm standby <port>), which applies the changes to its
+ * own mail storage, in order. Replication is asynchronous: messages
+ * are accepted before the standby has them, so the changes made in
+ * the last moments before a failure of the primary may be lost.
+ *
+ * Changes are shipped in batches of up to MAIL_REPLICA_BATCH_BYTES of
+ * log records. Each delivery is followed by the contents of its
+ * message, as stored in the blob (i.e., compressed if it was); the
+ * standby stores it under the same message ID and file names, so POP3
+ * clients see the same unique IDs after a takeover. The standby keeps
+ * the log position it has applied, and tells the shipper where to go
+ * on when it connects; since applying a change again is harmless
+ * (files already there, or already removed, are skipped), a batch
+ * interrupted by a failure is simply sent again. Records the standby
+ * acknowledged are dropped from the log. The shipper also records the
+ * replication lag (the time from a change to its acknowledgement by
+ * the standby), reported by mailadm replication.
+ *
+ * A standby is promoted with mailadm promote, which stops the
+ * receiver and undoes any change it was applying; servers refuse to
+ * run on a standby's mail storage until it is promoted.
+ *
+ * The receiver listens only at MAIL_REPLICA_LISTEN (loopback by
+ * default), and only takes connections from MAIL_REPLICA_PRIMARIES
+ * (networks, as in MAIL_RELAY_CLIENTS; anyone by default) that prove
+ * they know MAIL_REPLICA_SECRET, which must be set on both sides. The
+ * secret is sent as is, so links crossing untrusted networks should
+ * be tunnelled.
+ *
+ * Protocol: the shipper first sends "AUTH <secret>"; if it is right,
+ * the standby greets the shipper with "+OK <log> <position>"
+ * (zero for a standby that has applied nothing yet). A batch is sent
+ * as "BATCH <log> <position>", followed by the log records (each
+ * delivery followed by a line with the size of the message, or -1 if
+ * it is gone, and that many bytes) and "END <position>"; the standby
+ * replies with its new state, in the same form as the greeting. An
+ * idle shipper sends "PING" every REPLICA_PING_SECONDS.
+ */
+
+#define _GNU_SOURCE
+
+#include "replica.h"
+#include "changelog.h"
+#include "mailuser.h"
+#include "blobstore.h"
+#include "config.h"
+#include "server.h"
+#include "netbuffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define REPLICA_STATE_FILE   MAIL_BASE_DIRECTORY "/.replica"
+#define REPLICA_MESSAGE_FILE MAIL_BASE_DIRECTORY "/.replica.msg"
+#define REPLICA_DEFAULT_PORT "2526"
+
+#define REPLICA_LINE_MAX (1 << 20)
+#define REPLICA_STATUS_MAX 256
+#define REPLICA_READ_CHUNK 65536
+#define REPLICA_TIMEOUT_SECONDS 120
+#define REPLICA_PING_SECONDS 30
+#define REPLICA_BACKLOG 4
+
+// State of a standby, shared by the receiver and mailadm
+struct replica_state {
+  uint64_t role;
+  uint64_t receiver;
+  uint64_t log_id;
+  uint64_t position;
+  uint64_t applied_at_ms;
+  uint64_t batches;
+  uint64_t records;
+};
+
+/** Internal function that returns the current time in milliseconds.
+ */
+static uint64_t now_ms(void) {
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/** Internal function that maps the state of the standby into memory,
+ *  creating it if requested. The mapping is kept for the lifetime of
+ *  the process.
+ *
+ *  Returns: the state, or NULL if it doesn't exist or cannot be mapped.
+ */
+static struct replica_state *replica_state(int create) {
+
+  static struct replica_state *state = NULL;
+  struct stat st;
+
+  if (state) return state;
+
+  if (create) mkdir(MAIL_BASE_DIRECTORY, 0777);
+  int fd = open(REPLICA_STATE_FILE, O_RDWR | (create ? O_CREAT : 0), 0666);
+  if (fd < 0) return NULL;
+
+  // Growing a file fills it with zeros, so racing creators agree
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size < sizeof(struct replica_state) &&
+       ftruncate(fd, sizeof(struct replica_state)) < 0)) {
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, sizeof(struct replica_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return state = map == MAP_FAILED ? NULL : map;
+}
+
+/** Internal function that reads the state of the standby, sent as its
+ *  greeting and as the reply to every batch.
+ *
+ *  Returns: zero on success, -1 if the connection was lost or the
+ *           standby refused the last request.
+ */
+static int read_status(net_buffer_t nb, uint64_t *log_id, uint64_t *position) {
+
+  char line[REPLICA_STATUS_MAX + 1];
+  unsigned long long id, pos;
+
+  if (nb_read_line(nb, line) <= 0 || sscanf(line, "+OK %llu %llu", &id, &pos) != 2)
+    return -1;
+  *log_id = id;
+  *position = pos;
+  return 0;
+}
+
+/** Internal function that sends a log record to the standby. A
+ *  delivery is followed by the contents of its message, as stored in
+ *  its blob; if the blob is gone (i.e., the message was removed from
+ *  every mailbox before it could be shipped), a size of -1 is sent.
+ *
+ *  Returns: zero on success, -1 if the connection was lost.
+ */
+static int send_record(int fd, const char *record, size_t length) {
+
+  char blob_name[BLOB_NAME_MAX], path[PATH_MAX];
+  struct stat st;
+
+  if (send_all(fd, (char *) record, length) < 0) return -1;
+  if (record[0] != CHANGELOG_DELIVERY) return 0;
+
+  int blob_fd = -1;
+  if (sscanf(record, "%*c %*s %*s %31s", blob_name) == 1) {
+    blob_path(MAIL_BASE_DIRECTORY, blob_name, path);
+    blob_fd = open(path, O_RDONLY);
+  }
+  if (blob_fd < 0 || fstat(blob_fd, &st) < 0) {
+    if (blob_fd >= 0) close(blob_fd);
+    return send_string(fd, "-1\r\n") < 0 ? -1 : 0;
+  }
+
+  int rv = send_string(fd, "%lld\r\n", (long long) st.st_size) < 0 ||
+    send_file(fd, blob_fd, st.st_size) < 0 ? -1 : 0;
+  close(blob_fd);
+  return rv;
+}
+
+/** Internal function that ships the change log to a connected standby
+ *  until the connection is lost or the server goes away. The shipper
+ *  state in the log header is updated after every batch.
+ */
+static void ship_changes(pid_t server, int fd, struct changelog_header *header, int log_fd) {
+
+  long batch_bytes = config_long("MAIL_REPLICA_BATCH_BYTES", 1 << 20);
+  long poll_ms = config_long("MAIL_REPLICA_POLL_MS", 100);
+  struct timespec poll = { .tv_sec = poll_ms / 1000, .tv_nsec = poll_ms % 1000 * 1000000 };
+  uint64_t log_id, position, acked, last_sent = now_ms();
+  struct stat st;
+
+  net_buffer_t nb = nb_create(fd, REPLICA_STATUS_MAX, NULL);
+  char *batch = malloc(batch_bytes);
+  if (!nb || !batch || send_string(fd, "AUTH %s\r\n", config_string("MAIL_REPLICA_SECRET", "")) < 0)
+    goto done;
+  if (read_status(nb, &log_id, &position) < 0) {
+    fprintf(stderr, "replica: standby refused the connection (check MAIL_REPLICA_SECRET)\n");
+    goto done;
+  }
+
+  // A standby that has applied nothing yet starts from the beginning of the log
+  if (log_id && log_id != header->log_id) {
+    fprintf(stderr, "replica: standby has changes from another server\n");
+    goto done;
+  }
+  if (!position) position = CHANGELOG_HEADER_SIZE;
+  if (position < header->start) {
+    fprintf(stderr, "replica: standby is too far behind, copy the mail storage to it\n");
+    goto done;
+  }
+  header->acked = position;
+  header->connected = 1;
+
+  while (getppid() == server && fstat(log_fd, &st) == 0 && position <= st.st_size) {
+
+    size_t length = st.st_size - position < batch_bytes ? st.st_size - position : batch_bytes;
+    ssize_t rv = length ? pread(log_fd, batch, length, position) : 0;
+    char *last = rv > 0 ? memrchr(batch, '\n', rv) : NULL;
+
+    // Nothing to ship (or a record is still being written): wait, keeping the connection alive
+    if (!last) {
+      if (length == batch_bytes) {
+	fprintf(stderr, "replica: change log record longer than MAIL_REPLICA_BATCH_BYTES\n");
+	break;
+      }
+      if (now_ms() - last_sent >= REPLICA_PING_SECONDS * 1000) {
+	if (send_string(fd, "PING\r\n") < 0 || read_status(nb, &log_id, &acked) < 0)
+	  break;
+	last_sent = now_ms();
+      }
+      nanosleep(&poll, NULL);
+      continue;
+    }
+
+    size_t size = last + 1 - batch;
+    uint64_t first_ms = strtoull(batch + 2, NULL, 10), records = 0;
+
+    set_send_batching(fd, 1);
+    int failed = send_string(fd, "BATCH %llu %llu\r\n", (unsigned long long) header->log_id,
+			     (unsigned long long) position) < 0;
+    for (char *record = batch; !failed && record < batch + size; records++) {
+      char *end = memchr(record, '\n', batch + size - record) + 1;
+      failed = send_record(fd, record, end - record) < 0;
+      record = end;
+    }
+    failed = failed || send_string(fd, "END %llu\r\n", (unsigned long long) (position + size)) < 0;
+    set_send_batching(fd, 0);
+
+    if (failed || read_status(nb, &log_id, &acked) < 0 || acked != position + size)
+      break;
+    position = acked;
+    last_sent = now_ms();
+
+    uint64_t lag = last_sent > first_ms ? last_sent - first_ms : 0;
+    header->acked = position;
+    header->acked_at_ms = last_sent;
+    header->last_lag_ms = lag;
+    if (lag > header->max_lag_ms) header->max_lag_ms = lag;
+    header->batches++;
+    header->records += records;
+    changelog_trim(position);
+  }
+
+ done:
+  header->connected = 0;
+  free(batch);
+  if (nb) nb_destroy(nb);
+}
+
+/** Internal function run by the shipper process: connects to the
+ *  standby and ships the change log, reconnecting every
+ *  MAIL_REPLICA_RETRY_SECONDS if the connection fails. Only one
+ *  shipper per mail storage runs at a time; others wait for it to go
+ *  away. Exits when the server process that started it goes away.
+ */
+static void run_shipper(pid_t server) {
+
+  const char *destination = config_string("MAIL_REPLICA_HOST", NULL);
+  if (!*config_string("MAIL_REPLICA_SECRET", "")) {
+    fprintf(stderr, "replica: MAIL_REPLICA_SECRET is not set, changes are not shipped\n");
+    exit(1);
+  }
+  struct timespec retry = { .tv_sec = config_long("MAIL_REPLICA_RETRY_SECONDS", 5) };
+  int log_fd;
+
+  // Messages are sent with sendfile, which raises SIGPIPE if the standby goes away
+  signal(SIGPIPE, SIG_IGN);
+
+  // Record lock, as the log is flocked while being created (see changelog.c)
+  struct changelog_header *header = changelog_header(&log_fd);
+  struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1 };
+  int lock_fd = open(CHANGELOG_FILE_NAME, O_RDWR);
+
+  while (header && lock_fd >= 0 && getppid() == server) {
+    if (fcntl(lock_fd, F_SETLK, &lock) == 0) {
+      int fd = connect_server(destination, REPLICA_DEFAULT_PORT, REPLICA_TIMEOUT_SECONDS);
+      if (fd >= 0) {
+	ship_changes(server, fd, header, log_fd);
+	close(fd);
+      }
+    }
+    nanosleep(&retry, NULL);
+  }
+  exit(0);
+}
+
+/** Starts the shipper, if replication is enabled (see
+ *  changelog_enabled). It runs until the calling process exits.
+ *
+ *  Returns: zero if the shipper was started, -1 otherwise.
+ */
+int replica_start_shipper(void) {
+
+  int log_fd;
+
+  // Log is created before any change is made, so none is missed
+  if (!changelog_enabled() || !changelog_header(&log_fd)) return -1;
+
+  pid_t server = getpid();
+  pid_t pid = fork();
+  if (pid == 0)
+    run_shipper(server);
+  return pid < 0 ? -1 : 0;
+}
+
+/** Internal function that checks that a name received from the
+ *  primary can be used as a file name in the mail storage.
+ */
+static int valid_name(const char *name) {
+  return name && *name && *name != '.' && !strchr(name, '/');
+}
+
+/** Internal function that receives a delivery (the record, without
+ *  its kind, is given) and its message, and saves the message to the
+ *  mailboxes of its recipients.
+ *
+ *  Returns: zero on success (including messages that were gone in the
+ *           primary), -1 if the connection was lost or the message
+ *           could not be saved.
+ */
+static int receive_delivery(net_buffer_t nb, char *record, char *line) {
+
+  char buf[REPLICA_READ_CHUNK];
+  int rv = 0;
+
+  if (nb_read_line(nb, line) <= 0) return -1;
+  long long size = strtoll(line, NULL, 10);
+
+  int fd = -1;
+  if (size >= 0) {
+    unlink(REPLICA_MESSAGE_FILE);
+    fd = open(REPLICA_MESSAGE_FILE, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) return -1;
+  }
+
+  for (long long left = size; left > 0; ) {
+    int n = nb_read(nb, buf, left < sizeof(buf) ? left : sizeof(buf));
+    if (n <= 0 || write(fd, buf, n) != n) {
+      rv = -1;
+      break;
+    }
+    left -= n;
+  }
+  if (fd < 0) return 0;
+  if (close(fd) < 0) rv = -1;
+
+  // Fields: time, message ID, blob name, message information and recipients
+  char *fields[4];
+  int n = 0;
+  while (n < 4 && (fields[n] = strsep(&record, " ")))
+    n++;
+
+  if (rv == 0 && n == 4 && valid_name(fields[1]) && valid_name(fields[2]) && valid_name(fields[3])) {
+    user_list_t users = NULL;
+    for (char *user; record && (user = strsep(&record, " ")); )
+      if (valid_name(user)) add_user_to_list(&users, user, NULL);
+    if (users && replicate_user_mail(REPLICA_MESSAGE_FILE, fields[1], fields[3], users) < 0)
+      rv = -1;
+    destroy_user_list(users);
+  }
+
+  unlink(REPLICA_MESSAGE_FILE);
+  return rv;
+}
+
+/** Internal function that applies the removal of a mailbox file (the
+ *  record, without its kind, is given).
+ */
+static void apply_expunge(char *record) {
+
+  char *fields[3];
+  int n = 0;
+  while (n < 3 && (fields[n] = strsep(&record, " ")))
+    n++;
+
+  if (n == 3 && valid_name(fields[1]) && valid_name(fields[2]))
+    replicate_expunge(fields[1], fields[2]);
+}
+
+/** Internal function that sends the state of the standby.
+ */
+static int send_status(int fd, const struct replica_state *state) {
+  return send_string(fd, "+OK %llu %llu\r\n", (unsigned long long) state->log_id,
+		     (unsigned long long) state->position);
+}
+
+/** Internal function that checks that a shipper may send changes:
+ *  its address must be in MAIL_REPLICA_PRIMARIES (if set), and its
+ *  first line must hold the shared secret. The secret is compared in
+ *  constant time, so its contents cannot be guessed from the timing.
+ *
+ *  Returns: non-zero if the shipper is allowed.
+ */
+static int authorized(int fd, net_buffer_t nb, char *line) {
+
+  const char *primaries = config_string("MAIL_REPLICA_PRIMARIES", NULL);
+  const char *secret = config_string("MAIL_REPLICA_SECRET", "");
+  struct sockaddr_storage addr;
+  socklen_t length = sizeof(addr);
+
+  if (primaries && (getpeername(fd, (struct sockaddr *) &addr, &length) < 0 ||
+		    !address_in_networks((struct sockaddr *) &addr, primaries)))
+    return 0;
+
+  if (nb_read_line(nb, line) <= 0 || strncmp(line, "AUTH ", 5))
+    return 0;
+  line += 5;
+  line[strcspn(line, "\r\n")] = 0;
+
+  size_t secret_length = strlen(secret);
+  unsigned char diff = strlen(line) != secret_length;
+  for (size_t i = 0; i < secret_length; i++)
+    diff |= (unsigned char) line[i] ^ (unsigned char) secret[i];
+  return !diff;
+}
+
+/** Internal function that receives changes from a shipper and applies
+ *  them, until the connection is closed or the standby is promoted.
+ */
+static void receive_changes(int fd, struct replica_state *state) {
+
+  unsigned long long log_id = 0, from, to;
+  uint64_t records = 0, change_ms = 0;
+  int in_batch = 0;
+
+  net_buffer_t nb = nb_create(fd, REPLICA_LINE_MAX, NULL);
+  char *line = malloc(REPLICA_LINE_MAX + 1);
+  char *size_line = malloc(REPLICA_LINE_MAX + 1);
+  if (!nb || !line || !size_line)
+    goto done;
+  if (!authorized(fd, nb, line)) {
+    send_string(fd, "-ERR not authorized\r\n");
+    goto done;
+  }
+  if (send_status(fd, state) < 0)
+    goto done;
+
+  while (state->role == REPLICA_ROLE_STANDBY && nb_read_line(nb, line) > 0) {
+    line[strcspn(line, "\r\n")] = 0;
+
+    if (!in_batch && !strcmp(line, "PING")) {
+      if (send_status(fd, state) < 0) break;
+
+    } else if (!in_batch && sscanf(line, "BATCH %llu %llu", &log_id, &from) == 2) {
+      // Changes must follow those already applied, from the same log
+      if ((state->log_id && log_id != state->log_id) || (state->position && from != state->position)) {
+	send_string(fd, "-ERR standby is at %llu of log %llu\r\n",
+		    (unsigned long long) state->position, (unsigned long long) state->log_id);
+	break;
+      }
+      in_batch = 1;
+      records = 0;
+
+    } else if (in_batch && sscanf(line, "END %llu", &to) == 1) {
+      state->log_id = log_id;
+      state->position = to;
+      state->applied_at_ms = change_ms;
+      state->batches++;
+      state->records += records;
+      in_batch = 0;
+      if (send_status(fd, state) < 0) break;
+
+    } else if (in_batch) {
+      // Records only partly written in the primary's log are skipped (a delivery's message is still read)
+      int complete = line[0] && line[1] == ' ';
+      if (complete)
+	change_ms = strtoull(line + 2, NULL, 10);
+      if (line[0] == CHANGELOG_DELIVERY) {
+	if (receive_delivery(nb, complete ? line + 2 : line + strlen(line), size_line) < 0)
+	  break;
+      } else if (line[0] == CHANGELOG_EXPUNGE && complete) {
+	apply_expunge(line + 2);
+      }
+      records++;
+
+    } else {
+      send_string(fd, "-ERR unexpected command\r\n");
+      break;
+    }
+  }
+
+ done:
+  free(line);
+  free(size_line);
+  if (nb) nb_destroy(nb);
+}
+
+/** Internal function that creates a socket listening at a port of a
+ *  local address.
+ *
+ *  Returns: the socket, or -1 on error.
+ */
+static int listen_on(const char *host, const char *port) {
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+  struct addrinfo *servinfo, *p;
+  int fd = -1, yes = 1;
+
+  if (getaddrinfo(host, port, &hints, &servinfo) != 0)
+    return -1;
+
+  for (p = servinfo; p; p = p->ai_next) {
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, REPLICA_BACKLOG) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(servinfo);
+  return fd;
+}
+
+/** Runs the receiver of a standby server: makes the mail storage a
+ *  standby (if it isn't one yet) and applies the changes shipped by
+ *  the primary, one connection at a time, until the standby is
+ *  promoted (see replica_promote).
+ *
+ *  Parameters: port: Port (or service name) to listen at, on the
+ *                    address in MAIL_REPLICA_LISTEN.
+ *
+ *  Returns: zero once promoted, -1 if the receiver cannot run (no
+ *           MAIL_REPLICA_SECRET is set, the mail storage was promoted
+ *           or is in use by another receiver, or the port is not
+ *           available).
+ */
+int replica_serve(const char *port) {
+
+  struct timeval timeout = { .tv_sec = REPLICA_TIMEOUT_SECONDS };
+  if (!*config_string("MAIL_REPLICA_SECRET", "")) return -1;
+  struct replica_state *state = replica_state(1);
+  if (!state || state->role == REPLICA_ROLE_PROMOTED) return -1;
+
+  // Lock is held for as long as the receiver runs (see replica_promote)
+  int lock_fd = open(REPLICA_STATE_FILE, O_RDONLY);
+  if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) < 0) return -1;
+
+  int listen_fd = listen_on(config_string("MAIL_REPLICA_LISTEN", "localhost"), port);
+  if (listen_fd < 0) return -1;
+
+  state->role = REPLICA_ROLE_STANDBY;
+  state->receiver = getpid();
+  signal(SIGPIPE, SIG_IGN);
+
+  // Changes interrupted when the receiver last stopped are undone, and sent again by the primary
+  recover_deliveries();
+
+  while (state->role == REPLICA_ROLE_STANDBY) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) continue;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    receive_changes(fd, state);
+    close(fd);
+  }
+
+  close(listen_fd);
+  close(lock_fd);
+  return 0;
+}
+
+/** Promotes a standby, so servers can run on its mail storage. The
+ *  receiver, if running, is stopped (even in the middle of a change,
+ *  which is then undone); changes the primary made but had not yet
+ *  shipped are lost.
+ *
+ *  Returns: zero on success, -1 if the mail storage is not a standby.
+ */
+int replica_promote(void) {
+
+  struct replica_state *state = replica_state(0);
+  if (!state || state->role != REPLICA_ROLE_STANDBY) return -1;
+  state->role = REPLICA_ROLE_PROMOTED;
+
+  // Receiver is running if it holds the lock; it is waited for, so no change is left half done
+  int lock_fd = open(REPLICA_STATE_FILE, O_RDONLY);
+  if (lock_fd >= 0 && flock(lock_fd, LOCK_EX | LOCK_NB) < 0 && state->receiver > 0 &&
+      kill(state->receiver, SIGTERM) == 0)
+    flock(lock_fd, LOCK_EX);
+  if (lock_fd >= 0) close(lock_fd);
+
+  recover_deliveries();
+  unlink(REPLICA_MESSAGE_FILE);
+  return 0;
+}
+
+/** Returns non-zero if the mail storage is a standby that has not
+ *  been promoted, on which servers must not run.
+ */
+int replica_is_standby(void) {
+
+  struct replica_state *state = replica_state(0);
+  return state && state->role == REPLICA_ROLE_STANDBY;
+}
+
+/** Retrieves the state of replication: for a primary, the size of
+ *  the change log, the position acknowledged by the standby, the age
+ *  of the oldest change not acknowledged yet, the time since the last
+ *  acknowledgement, the last and largest replication lag, and the
+ *  number of batches and records shipped; for a standby, its role,
+ *  the position applied, the age of the last change applied, and the
+ *  number of batches and records applied. Times are in milliseconds.
+ *
+ *  Parameters: stats: Receives the replication state.
+ *
+ *  Returns: zero on success.
+ */
+int replica_stats(struct replica_stats *stats) {
+
+  struct changelog_header *header;
+  struct replica_state *state;
+  struct stat st;
+  uint64_t now = now_ms();
+  int log_fd;
+
+  memset(stats, 0, sizeof(*stats));
+
+  if (access(CHANGELOG_FILE_NAME, F_OK) == 0 && (header = changelog_header(&log_fd)) &&
+      fstat(log_fd, &st) == 0) {
+    stats->shipping = 1;
+    stats->connected = header->connected;
+    stats->log_end = st.st_size;
+    stats->acked = header->acked;
+    stats->acked_age_ms = header->acked_at_ms ? now - header->acked_at_ms : 0;
+    stats->last_lag_ms = header->last_lag_ms;
+    stats->max_lag_ms = header->max_lag_ms;
+    stats->batches = header->batches;
+    stats->records = header->records;
+
+    // Oldest change not acknowledged, from the time in its record
+    char record[64] = "";
+    if (stats->acked < stats->log_end && pread(log_fd, record, sizeof(record) - 1, stats->acked) > 2) {
+      uint64_t change_ms = strtoull(record + 2, NULL, 10);
+      stats->pending_age_ms = now > change_ms ? now - change_ms : 0;
+    }
+  }
+
+  if ((state = replica_state(0))) {
+    stats->role = state->role;
+    stats->position = state->position;
+    stats->applied_age_ms = state->applied_at_ms ? now - state->applied_at_ms : 0;
+    stats->applied_batches = state->batches;
+    stats->applied_records = state->records;
+  }
+  return 0;
+}
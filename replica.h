@@ -0,0 +1,41 @@
+/* replica.h
+ * Replication of the mail storage to a standby server.
+ */
+
+#ifndef _REPLICA_H_
+#define _REPLICA_H_
+
+#include <stdint.h>
+
+// Role of a mail storage in replication
+#define REPLICA_ROLE_NONE     0
+#define REPLICA_ROLE_STANDBY  1
+#define REPLICA_ROLE_PROMOTED 2
+
+struct replica_stats {
+  // Primary: change log and shipper (see changelog.c)
+  int shipping;
+  int connected;
+  uint64_t log_end;
+  uint64_t acked;
+  uint64_t pending_age_ms;
+  uint64_t acked_age_ms;
+  uint64_t last_lag_ms;
+  uint64_t max_lag_ms;
+  uint64_t batches;
+  uint64_t records;
+  // Standby: changes applied from the primary
+  int role;
+  uint64_t position;
+  uint64_t applied_age_ms;
+  uint64_t applied_batches;
+  uint64_t applied_records;
+};
+
+int replica_start_shipper(void);
+int replica_serve(const char *port);
+int replica_promote(void);
+int replica_is_standby(void);
+int replica_stats(struct replica_stats *stats);
+
+#endif
@@ -9,7 +9,10 @@
  * send_all.
  */
 
+#define _GNU_SOURCE
+
 #include "server.h"
+#include "ratelimit.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,19 +23,29 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <poll.h>
 
 /* Fixes a problem in OSX that it does not define MSG_NOSIGNAL */
 #ifndef MSG_NOSIGNAL 
 #define MSG_NOSIGNAL 0x2000 /* don't raise SIGPIPE */
 #endif
 
+#define SPLICE_CHUNK_SIZE 65536
+
 #define BACKLOG 10     // how many pending connections queue will hold
 
+// Reply sent to clients over their connection rate, see set_connection_limit
+static const char *limit_reply = NULL;
+
 /** Signal handler used to destroy zombie children (forked) processes
  *  once they finish executing.
  */
@@ -54,6 +67,17 @@ static void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+/** Enables the per-address connection rate limit (see ratelimit.c)
+ *  in run_server. Connections from clients over their limit are sent
+ *  a reply and closed right away, without creating a new process.
+ *
+ *  Parameters: reply: Reply sent to refused clients, in the protocol
+ *                     of the server.
+ */
+void set_connection_limit(const char *reply) {
+  limit_reply = reply;
+}
+
 /** Creates a server socket at the specified port number, listens for
  *  new connections and accepts them. A new forked process is created
  *  for each new client, calling the provided handler function for
@@ -139,6 +163,9 @@ void run_server(const char *port, void (*handler)(int)) {
     exit(1);
   }
   
+  // sendfile cannot use MSG_NOSIGNAL, so a closed connection must not kill the process
+  signal(SIGPIPE, SIG_IGN);
+  
   printf("server: waiting for connections...\n");
   
   while(1) {
@@ -154,6 +181,14 @@ void run_server(const char *port, void (*handler)(int)) {
 	      s, sizeof(s));
     printf("server: got connection from %s\n", s);
     
+    if (limit_reply &&
+	!ratelimit_take(ratelimit_key((struct sockaddr *)&their_addr), RATE_CONNECTIONS, 1)) {
+      printf("server: connection rate exceeded by %s\n", s);
+      send_all(new_fd, (char *) limit_reply, strlen(limit_reply));
+      close(new_fd);
+      continue;
+    }
+    
     // Create a new process to handle the new client; parent process
     // will wait for another client.
     if (!fork()) {
@@ -170,6 +205,121 @@ void run_server(const char *port, void (*handler)(int)) {
 
 }
 
+/** Opens a connection to a server, given as host or host:port (an
+ *  IPv6 address with a port must be written as [address]:port).
+ *
+ *  Parameters: destination: Host and optional port of the server.
+ *              default_port: Port used if destination has none.
+ *              timeout: Seconds after which a send or receive on the
+ *                       connection fails, or zero to wait forever.
+ *
+ *  Returns: the socket, or -1 on error.
+ */
+int connect_server(const char *destination, const char *default_port, int timeout) {
+
+  char host[256];
+  const char *port = default_port;
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *servinfo, *p;
+  struct timeval tv = { .tv_sec = timeout };
+  int fd = -1;
+
+  if (snprintf(host, sizeof(host), "%s", destination) >= sizeof(host))
+    return -1;
+  char *colon = strrchr(host, ':');
+  if (colon && (colon == strchr(host, ':') || colon[-1] == ']')) {
+    *colon = 0;
+    port = colon + 1;
+  }
+  if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+    memmove(host, host + 1, strlen(host) - 2);
+    host[strlen(host) - 2] = 0;
+  }
+
+  if (getaddrinfo(host, port, &hints, &servinfo) != 0)
+    return -1;
+
+  for (p = servinfo; p; p = p->ai_next) {
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(servinfo);
+  return fd;
+}
+
+/** Internal function that checks if an address is in a network given
+ *  as address/prefix (or a single address). IPv4 clients connected
+ *  through IPv6 sockets match IPv4 networks.
+ *
+ *  Returns: non-zero if the address is in the network.
+ */
+static int in_network(const struct sockaddr *addr, const char *network, size_t length) {
+
+  char text[INET6_ADDRSTRLEN + 8];
+  unsigned char net[16];
+  const unsigned char *bytes;
+  int family, size;
+
+  if (length >= sizeof(text)) return 0;
+  memcpy(text, network, length);
+  text[length] = '\0';
+
+  char *slash = strchr(text, '/');
+  if (slash) *slash++ = '\0';
+
+  if (inet_pton(AF_INET, text, net) == 1)
+    family = AF_INET, size = 4;
+  else if (inet_pton(AF_INET6, text, net) == 1)
+    family = AF_INET6, size = 16;
+  else
+    return 0;
+
+  int prefix = slash ? atoi(slash) : size * 8;
+  if (prefix < 0 || prefix > size * 8) return 0;
+
+  if (addr->sa_family == AF_INET && family == AF_INET)
+    bytes = (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr;
+  else if (addr->sa_family == AF_INET6) {
+    bytes = ((const struct sockaddr_in6 *) addr)->sin6_addr.s6_addr;
+    if (family == AF_INET) {
+      if (!IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *) addr)->sin6_addr)) return 0;
+      bytes += 12;
+    }
+  } else
+    return 0;
+
+  if (memcmp(bytes, net, prefix / 8)) return 0;
+  if (prefix % 8 == 0) return 1;
+  unsigned char mask = 0xff << (8 - prefix % 8);
+  return (bytes[prefix / 8] & mask) == (net[prefix / 8] & mask);
+}
+
+/** Checks if an address is in one of a list of networks, given as
+ *  addresses or address/prefix pairs separated by commas or spaces
+ *  (e.g., "127.0.0.0/8,::1").
+ *
+ *  Parameters: addr: Address to be checked (e.g., of a client).
+ *              networks: List of networks.
+ *
+ *  Returns: non-zero if the address is in one of the networks.
+ */
+int address_in_networks(const struct sockaddr *addr, const char *networks) {
+
+  for (const char *p = networks; *p; ) {
+    size_t span = strcspn(p, ", ");
+    if (span > 0 && in_network(addr, p, span))
+      return 1;
+    p += span;
+    p += strspn(p, ", ");
+  }
+  return 0;
+}
+
 /** Sends a buffer of data, until all data is sent or an error is
  *  received. This function is used to handle cases where send is able
  *  to send only part of the data. If this is the case, this function
@@ -202,6 +352,152 @@ int send_all(int fd, char buf[], size_t size) {
   return size;
 }
 
+/** Sends the contents of a file, starting at the current file offset,
+ *  until the requested number of bytes is sent or an error is
+ *  received. Data is copied by the kernel directly from the page
+ *  cache into the socket (using sendfile), without passing through
+ *  a user-space buffer.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              file_fd: Descriptor of the file to be sent.
+ *              size: Number of bytes to be sent.
+ *
+ *  Returns: If the data was successfully sent, returns size. If the
+ *           file ended early or there was an error, returns -1.
+ */
+int send_file(int fd, int file_fd, size_t size) {
+  
+  size_t rem = size;
+  while (rem > 0) {
+    ssize_t rv = sendfile(fd, file_fd, NULL, rem);
+    if (rv <= 0)
+      return -1;
+    rem -= rv;
+  }
+  return size;
+}
+
+// Data moving one way between two connections (see splice_connections)
+struct splice_direction {
+  int from, to;
+  int pipe[2];
+  size_t pending; // bytes in the pipe, not yet sent
+  int eof;        // no more data will be read
+  int shut;       // sending side of the destination was shut down
+};
+
+/** Internal function that moves data one way through a pipe: reads
+ *  what can be read without waiting, if asked to, then sends as much
+ *  of what is in the pipe as the destination takes. When the source
+ *  is closed and the pipe is empty, the destination is shut down for
+ *  sending, so the other end sees the close but may still reply.
+ *
+ *  Returns: zero on success, -1 if a connection failed.
+ */
+static int splice_step(struct splice_direction *d, int readable, int writable) {
+
+  if (readable && !d->eof && d->pending == 0) {
+    ssize_t rv = splice(d->from, NULL, d->pipe[1], NULL, SPLICE_CHUNK_SIZE,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rv > 0) {
+      d->pending = rv;
+      writable = 1; // most likely room to send, saves waiting in poll
+    }
+    else if (rv == 0)
+      d->eof = 1;
+    else if (errno != EAGAIN && errno != EINTR)
+      return -1;
+  }
+
+  if (writable && d->pending > 0) {
+    ssize_t rv = splice(d->pipe[0], NULL, d->to, NULL, d->pending,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rv > 0)
+      d->pending -= rv;
+    else if (rv == 0 || (errno != EAGAIN && errno != EINTR))
+      return -1;
+  }
+
+  if (d->eof && d->pending == 0 && !d->shut) {
+    shutdown(d->to, SHUT_WR);
+    d->shut = 1;
+  }
+  return 0;
+}
+
+/** Relays data both ways between two connections until both of them
+ *  are closed (e.g., to hand a client over to another server). Data
+ *  is moved with splice, through a pipe for each direction, so it is
+ *  never copied into the process. A connection closed by one end is
+ *  shut down for sending on the other, so replies still in transit
+ *  are delivered.
+ *
+ *  Parameters: fd1, fd2: Socket file descriptors of the connections.
+ *
+ *  Returns: zero if both connections were closed normally, -1 if one
+ *           of them failed.
+ */
+int splice_connections(int fd1, int fd2) {
+
+  struct splice_direction dir[2] = { { .from = fd1, .to = fd2, .pipe = { -1, -1 } },
+				     { .from = fd2, .to = fd1, .pipe = { -1, -1 } } };
+  int rv = -1;
+
+  if (pipe(dir[0].pipe) < 0 || pipe(dir[1].pipe) < 0)
+    goto done;
+
+  while (!dir[0].shut || !dir[1].shut) {
+    // Each socket is the source of one direction and the destination of the other
+    struct pollfd fds[2];
+    for (int i = 0; i < 2; i++) {
+      fds[i].fd = dir[i].from;
+      fds[i].events = (!dir[i].eof && dir[i].pending == 0 ? POLLIN : 0) |
+	(dir[1 - i].pending > 0 ? POLLOUT : 0);
+    }
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      goto done;
+    }
+
+    if ((fds[0].revents | fds[1].revents) & (POLLERR | POLLNVAL))
+      goto done;
+    for (int i = 0; i < 2; i++)
+      if (splice_step(&dir[i], fds[i].revents & (POLLIN | POLLHUP),
+		      fds[1 - i].revents & (POLLOUT | POLLHUP)) < 0)
+	goto done;
+  }
+  rv = 0;
+
+ done:
+  for (int i = 0; i < 2; i++) {
+    if (dir[i].pipe[0] >= 0) close(dir[i].pipe[0]);
+    if (dir[i].pipe[1] >= 0) close(dir[i].pipe[1]);
+  }
+  return rv;
+}
+
+/** Holds back (or releases) small writes to a socket, so that replies
+ *  to several commands sent at once by a client go out in as few
+ *  packets as possible. While holding is on, data sent with any of the
+ *  send functions (including send_file) is only transmitted when full
+ *  packets can be formed; turning it off transmits everything pending.
+ *  Servers turn it on while there are more commands waiting to be
+ *  read, and off before waiting for the client. Systems without
+ *  TCP_CORK or TCP_NOPUSH send data immediately.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              on: 1 to hold back writes, 0 to release them.
+ */
+void set_send_batching(int fd, int on) {
+  
+#if defined(TCP_CORK)
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+  setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#endif
+}
+
 /** Sends a potentially-formatted string to a socket descriptor. The
  *  string can contain format directives (e.g., %d, %s, %u), which
  *  will be translated using a printf-like behaviour. For example, you
@@ -209,6 +505,12 @@ int send_all(int fd, char buf[], size_t size) {
  *
  *  send_string(fd, "+OK Server ready\r\n");
  *  send_string(fd, "+OK %d messages found\r\n", msg_count);
+ *
+ *  The string is formatted on the stack, or in a temporary buffer if
+ *  it is too long, so this function can be used by several threads at
+ *  the same time. Replies sent for every command should use
+ *  send_fixed or the reply functions below instead, which don't parse
+ *  a format.
  *  
  *  Parameters: fd: Socket file descriptor.
  *              str: String to be sent, including potential
@@ -220,33 +522,121 @@ int send_all(int fd, char buf[], size_t size) {
  */
 int send_string(int fd, const char *str, ...) {
   
-  static char *buf = NULL;
-  static int bufsize = 0;
+  char local[REPLY_BUFFER_SIZE];
+  char *buf = local;
   va_list args;
-  int strsize;
+  int strsize, rv;
   
-  // Start with string length, increase later if needed
-  if (bufsize < strlen(str) + 1) {
-    bufsize = strlen(str) + 1;
-    buf = realloc(buf, bufsize);
-  }
+  va_start(args, str);
+  strsize = vsnprintf(buf, sizeof(local), str, args);
+  va_end(args);
   
-  while (1) {
-    
+  if (strsize < 0)
+    return -1;
+  
+  // String didn't fit, format it again with enough space
+  if (strsize >= sizeof(local)) {
+    buf = malloc(strsize + 1);
+    if (!buf)
+      return -1;
     va_start(args, str);
-    strsize = vsnprintf(buf, bufsize, str, args);
+    vsnprintf(buf, strsize + 1, str, args);
     va_end(args);
-    
-    if (strsize < 0)
-      return -1;
-    
-    // If buffer was enough to fit entire string, send it
-    if (strsize <= bufsize)
-      return send_all(fd, buf, strsize);
-    
-    // Try again with more space
-    bufsize = strsize + 1;
-    buf = realloc(buf, bufsize);
   }
+  
+  rv = send_all(fd, buf, strsize);
+  if (buf != local)
+    free(buf);
+  return rv;
+}
+
+/** Starts building a reply. Replies are built in a buffer provided by
+ *  the caller (usually one per connection), so building them needs no
+ *  allocation and no shared state. Text beyond REPLY_BUFFER_SIZE
+ *  bytes is dropped, and a reply truncated this way is still sent
+ *  with its final CRLF. For example:
+ *
+ *  reply_start(&reply, "+OK ");
+ *  reply_number(&reply, msg_count);
+ *  reply_text(&reply, " messages found\r\n");
+ *  reply_send(fd, &reply);
+ *
+ *  Parameters: reply: Buffer where the reply is built.
+ *              text: Beginning of the reply.
+ */
+void reply_start(struct reply *reply, const char *text) {
+  
+  reply->length = 0;
+  reply->truncated = 0;
+  reply_text(reply, text);
+}
+
+/** Appends a number of bytes to a reply (e.g., part of a command line).
+ *
+ *  Parameters: reply: Reply being built.
+ *              text: Bytes to be appended.
+ *              length: Number of bytes to be appended.
+ */
+void reply_span(struct reply *reply, const char *text, size_t length) {
+  
+  if (length > REPLY_BUFFER_SIZE - reply->length) {
+    length = REPLY_BUFFER_SIZE - reply->length;
+    reply->truncated = 1;
+  }
+  memcpy(reply->data + reply->length, text, length);
+  reply->length += length;
+}
+
+/** Appends a string to a reply.
+ *
+ *  Parameters: reply: Reply being built.
+ *              text: NUL-terminated string to be appended.
+ */
+void reply_text(struct reply *reply, const char *text) {
+  
+  reply_span(reply, text, strlen(text));
 }
 
+/** Appends a number, in decimal, to a reply.
+ *
+ *  Parameters: reply: Reply being built.
+ *              value: Number to be appended.
+ */
+void reply_number(struct reply *reply, long value) {
+  
+  char digits[24];
+  char *p = digits + sizeof(digits);
+  unsigned long n = value < 0 ? -(unsigned long) value : value;
+  
+  // Digits are produced from the last one
+  do {
+    *--p = '0' + n % 10;
+    n /= 10;
+  } while (n);
+  if (value < 0)
+    *--p = '-';
+  
+  reply_span(reply, p, digits + sizeof(digits) - p);
+}
+
+/** Sends a reply built with the functions above. If the reply was
+ *  truncated, its line is ended with CRLF (in the room reserved for
+ *  it), so the client never waits for the rest of the line.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              reply: Reply to be sent.
+ *
+ *  Returns: If the reply was successfully sent, returns the number of
+ *           bytes sent. Otherwise, returns -1.
+ */
+int reply_send(int fd, struct reply *reply) {
+  
+  if (reply->truncated) {
+    if (reply->length > 0 && reply->data[reply->length - 1] == '\r')
+      reply->length--;
+    memcpy(reply->data + reply->length, "\r\n", 2);
+    reply->length += 2;
+    reply->truncated = 0;
+  }
+  return send_all(fd, reply->data, reply->length);
+}
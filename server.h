@@ -8,14 +8,42 @@
 #define _SERVER_H_
 
 #include <stdio.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define REPLY_BUFFER_SIZE 1024
+
+// Reply being built, see reply_start (two extra bytes keep room for
+// the line terminator of a truncated reply)
+struct reply {
+  size_t length;
+  int truncated;
+  char data[REPLY_BUFFER_SIZE + 2];
+};
 
 void run_server(const char *port, void (*handler)(int));
+void set_connection_limit(const char *reply);
+int connect_server(const char *destination, const char *default_port, int timeout);
+int splice_connections(int fd1, int fd2);
+int address_in_networks(const struct sockaddr *addr, const char *networks);
 
 int send_all(int fd, char buf[], size_t size);
+int send_file(int fd, int file_fd, size_t size);
+void set_send_batching(int fd, int on);
 
 // The attribute in this function allows gcc to provided useful
 // warnings when compiling the code.
 int send_string(int fd, const char *str, ...)
   __attribute__ ((format(printf, 2, 3)));
 
+// Sends a reply that never changes, given as a string literal; its
+// length is known at compile time and nothing is formatted
+#define send_fixed(fd, literal) send_all((fd), (char *) "" literal, sizeof(literal) - 1)
+
+void reply_start(struct reply *reply, const char *text);
+void reply_span(struct reply *reply, const char *text, size_t length);
+void reply_text(struct reply *reply, const char *text);
+void reply_number(struct reply *reply, long value);
+int reply_send(int fd, struct reply *reply);
+
 #endif
@@ -0,0 +1,230 @@
+/* shard.c
+ * Mapping of users to mail storage nodes by consistent hashing.
+ *
+ * Notes: When MAIL_SHARD_NODES is set, the servers run as front ends
+ * of a cluster of storage nodes, each holding the mailboxes of some
+ * of the users in its own mail storage. The setting lists the nodes
+ * as name=address pairs, separated by commas (e.g.,
+ * "a=10.0.0.1:25,b=10.0.0.2:25"); the SMTP and POP3 front ends list
+ * the same names with the addresses of their own protocol.
+ *
+ * Users are assigned to nodes with a hash ring: each node is placed
+ * on the ring at MAIL_SHARD_VNODES points (hashes of its name and a
+ * number), and a user belongs to the node of the first point at or
+ * after the hash of the username (wrapping around). Only names are
+ * hashed, so a node can move to another address without moving any
+ * user; when a node is added, it takes over only the users hashed
+ * just before its points, i.e., about 1/N of all users, all of them
+ * from the other nodes, and nothing moves between the old nodes.
+ */
+
+#include "shard.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#define SHARD_MAX_NODES 256
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+struct shard_point {
+  uint64_t hash;
+  unsigned int node;
+};
+
+struct shard_ring {
+  unsigned int node_count;
+  size_t point_count;
+  struct shard_node nodes[SHARD_MAX_NODES];
+  struct shard_point *points;
+};
+
+/** Internal function that hashes a string (case-insensitively, as
+ *  usernames are compared), with 64-bit FNV-1a followed by a final
+ *  mix, so that similar strings (such as the points of a node) are
+ *  spread over the whole ring.
+ */
+static uint64_t hash_string(const char *s, size_t length) {
+
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char) tolower((unsigned char) s[i]);
+    hash *= FNV_PRIME;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/** Internal function that orders points by their position on the
+ *  ring; points at the same position (unlikely) are ordered by node
+ *  name, so all front ends agree on the owner.
+ */
+static const struct shard_ring *sorted_ring;
+static int compare_points(const void *a, const void *b) {
+
+  const struct shard_point *pa = a, *pb = b;
+  if (pa->hash != pb->hash)
+    return pa->hash < pb->hash ? -1 : 1;
+  return strcmp(sorted_ring->nodes[pa->node].name, sorted_ring->nodes[pb->node].name);
+}
+
+/** Internal function that parses one name=address pair of a node
+ *  list into a node.
+ *
+ *  Returns: zero on success, -1 if the pair is malformed.
+ */
+static int parse_node(const char *pair, size_t length, struct shard_node *node) {
+
+  const char *equals = memchr(pair, '=', length);
+  if (!equals) return -1;
+
+  size_t name_length = equals - pair, address_length = length - name_length - 1;
+  if (name_length == 0 || name_length >= SHARD_NAME_MAX ||
+      address_length == 0 || address_length >= SHARD_ADDRESS_MAX)
+    return -1;
+
+  memcpy(node->name, pair, name_length);
+  node->name[name_length] = '\0';
+  memcpy(node->address, equals + 1, address_length);
+  node->address[address_length] = '\0';
+  return 0;
+}
+
+/** Builds the hash ring of a list of nodes. Each node is placed at
+ *  MAIL_SHARD_VNODES points (128 by default).
+ *
+ *  Parameters: nodes: List of nodes, as name=address pairs separated
+ *                     by commas.
+ *
+ *  Returns: the ring, or NULL if the list is empty or malformed, or
+ *           names a node twice.
+ */
+shard_ring_t shard_ring_create(const char *nodes) {
+
+  long vnodes = config_long("MAIL_SHARD_VNODES", 128);
+  if (vnodes < 1) vnodes = 1;
+  if (vnodes > 4096) vnodes = 4096;
+
+  shard_ring_t ring = calloc(1, sizeof(*ring));
+  if (!ring) return NULL;
+
+  for (const char *p = nodes; *p; ) {
+    size_t length = strcspn(p, ",");
+    if (length > 0) {
+      if (ring->node_count == SHARD_MAX_NODES ||
+	  parse_node(p, length, &ring->nodes[ring->node_count]) < 0)
+	goto fail;
+      for (unsigned int i = 0; i < ring->node_count; i++)
+	if (!strcmp(ring->nodes[i].name, ring->nodes[ring->node_count].name))
+	  goto fail;
+      ring->node_count++;
+    }
+    p += length;
+    if (*p == ',') p++;
+  }
+  if (ring->node_count == 0) goto fail;
+
+  ring->points = malloc(ring->node_count * vnodes * sizeof(*ring->points));
+  if (!ring->points) goto fail;
+
+  char point_name[SHARD_NAME_MAX + 16];
+  for (unsigned int n = 0; n < ring->node_count; n++) {
+    for (long i = 0; i < vnodes; i++) {
+      int length = snprintf(point_name, sizeof(point_name), "%s#%ld", ring->nodes[n].name, i);
+      ring->points[ring->point_count++] = (struct shard_point) {
+	.hash = hash_string(point_name, length), .node = n };
+    }
+  }
+
+  sorted_ring = ring;
+  qsort(ring->points, ring->point_count, sizeof(*ring->points), compare_points);
+  return ring;
+
+ fail:
+  shard_ring_destroy(ring);
+  return NULL;
+}
+
+/** Frees a hash ring.
+ *
+ *  Parameters: ring: Ring to be freed (may be NULL).
+ */
+void shard_ring_destroy(shard_ring_t ring) {
+
+  if (!ring) return;
+  free(ring->points);
+  free(ring);
+}
+
+/** Finds the node that owns the mailbox of a user, i.e., the node of
+ *  the first point of the ring at or after the hash of the username.
+ *
+ *  Parameters: ring: Hash ring of the cluster.
+ *              username: User to be looked up.
+ *
+ *  Returns: the node owning the user, valid as long as the ring.
+ */
+const struct shard_node *shard_ring_lookup(shard_ring_t ring, const char *username) {
+
+  uint64_t hash = hash_string(username, strlen(username));
+  size_t low = 0, high = ring->point_count;
+
+  // First point with a hash not below the user's, or the end
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (ring->points[middle].hash < hash)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low == ring->point_count) low = 0;
+
+  return &ring->nodes[ring->points[low].node];
+}
+
+/** Internal function that returns the ring of the cluster set in
+ *  MAIL_SHARD_NODES, built on first use and kept for the lifetime of
+ *  the process (and inherited by forked children).
+ */
+static shard_ring_t cluster_ring(void) {
+
+  static shard_ring_t ring = NULL;
+  static int loaded = 0;
+
+  if (!loaded) {
+    const char *nodes = config_string("MAIL_SHARD_NODES", NULL);
+    loaded = 1;
+    if (nodes && !(ring = shard_ring_create(nodes)))
+      fprintf(stderr, "Invalid MAIL_SHARD_NODES, mailboxes are stored locally\n");
+  }
+  return ring;
+}
+
+/** Returns non-zero if the servers are front ends of a cluster of
+ *  storage nodes (i.e., MAIL_SHARD_NODES is set and valid).
+ */
+int shard_enabled(void) {
+  return cluster_ring() != NULL;
+}
+
+/** Finds the node of the cluster that owns the mailbox of a user.
+ *
+ *  Parameters: username: User to be looked up.
+ *
+ *  Returns: the node owning the user, or NULL if the servers are not
+ *           front ends of a cluster.
+ */
+const struct shard_node *shard_lookup(const char *username) {
+
+  shard_ring_t ring = cluster_ring();
+  return ring ? shard_ring_lookup(ring, username) : NULL;
+}
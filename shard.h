@@ -0,0 +1,27 @@
+/* shard.h
+ * Mapping of users to mail storage nodes by consistent hashing.
+ */
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#define SHARD_NAME_MAX 64
+#define SHARD_ADDRESS_MAX 256
+
+// Node of the storage cluster: its name (which decides the users it
+// owns) and the address of its server (host or host:port)
+struct shard_node {
+  char name[SHARD_NAME_MAX];
+  char address[SHARD_ADDRESS_MAX];
+};
+
+typedef struct shard_ring *shard_ring_t;
+
+shard_ring_t shard_ring_create(const char *nodes);
+void shard_ring_destroy(shard_ring_t ring);
+const struct shard_node *shard_ring_lookup(shard_ring_t ring, const char *username);
+
+int shard_enabled(void);
+const struct shard_node *shard_lookup(const char *username);
+
+#endif
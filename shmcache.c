@@ -0,0 +1,301 @@
+/* shmcache.c
+ * Fixed-size caches shared by all server processes.
+ *
+ * Notes: A cache is a file in the mail storage mapped into every
+ * server process, so data cached by one POP3 session can be used by
+ * any other session in any other process. It holds a fixed number of
+ * fixed-size entries, set by the memory budget and the entry size
+ * when the file is created; data that doesn't fit in an entry is not
+ * cached. Entries are indexed by the hash of their key: a key can
+ * only be stored in the SHMCACHE_PROBES entries that follow its hash
+ * position, so lookups and stores look at those entries only, and a
+ * new key replaces a free entry or the least recently used one among
+ * them.
+ *
+ * Entries are found by a string key and carry a tag chosen by the
+ * caller (e.g., a version number); a lookup with a different tag is a
+ * miss. Entries are protected by a sequence counter that is odd while
+ * the entry is being written. Readers check the counter before and
+ * after copying an entry and treat a change as a miss; writers that
+ * find an entry busy simply don't cache.
+ *
+ * The mailbox listing cache and the message cache (see mailuser.c) are
+ * both caches of this kind, each in its own file.
+ */
+
+#include "shmcache.h"
+#include "mailuser.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SHMCACHE_MAGIC 0x4548434d48530002ULL
+#define SHMCACHE_PROBES 8
+
+struct shmcache_entry {
+  uint32_t seq;
+  uint32_t length;
+  uint64_t tag;
+  uint64_t last_used;
+  uint64_t hash;
+  char key[SHMCACHE_KEY_MAX];
+  char data[];
+};
+
+struct shmcache {
+  uint64_t magic;
+  uint64_t entry_count;
+  uint64_t entry_size;
+  uint64_t clock;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t bytes_served;
+  uint64_t stores;
+  uint64_t evictions;
+  char entries[];
+};
+
+/** Maps a cache into memory, creating it if it doesn't exist yet. The
+ *  budget and entry size are only used when the cache is created; an
+ *  existing cache keeps its geometry until its file is removed. The
+ *  mapping is kept for the lifetime of the process (and inherited by
+ *  forked children).
+ *
+ *  Parameters: file_name: Name of the cache file.
+ *              bytes: Memory budget for the entries.
+ *              entry_size: Size of each entry, including the key.
+ *
+ *  Returns: A shmcache_t object, or NULL if the budget is zero (cache
+ *           disabled) or the cache cannot be mapped.
+ */
+shmcache_t shmcache_open(const char *file_name, long bytes, long entry_size) {
+
+  struct shmcache header;
+  struct stat st;
+
+  if (bytes <= 0 || entry_size < sizeof(struct shmcache_entry) || entry_size > bytes)
+    return NULL;
+
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  int fd = open(file_name, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) return NULL;
+
+  // Serialize creation between processes starting at the same time
+  flock(fd, LOCK_EX);
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(header) ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != SHMCACHE_MAGIC) {
+
+    // Entries are 8-byte aligned; the file is sparse until used
+    entry_size = (entry_size + 7) & ~7L;
+    header = (struct shmcache) { .magic = SHMCACHE_MAGIC,
+				 .entry_count = bytes / entry_size,
+				 .entry_size = entry_size };
+    if (ftruncate(fd, 0) < 0 ||
+	ftruncate(fd, sizeof(header) + header.entry_count * header.entry_size) < 0 ||
+	pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      close(fd);
+      return NULL;
+    }
+  }
+
+  void *map = mmap(NULL, sizeof(header) + header.entry_count * header.entry_size,
+		   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  return map == MAP_FAILED ? NULL : map;
+}
+
+/** Internal function that returns an entry of the cache by position.
+ */
+static struct shmcache_entry *entry_at(shmcache_t cache, uint64_t i) {
+  return (struct shmcache_entry *) (cache->entries + i * cache->entry_size);
+}
+
+/** Returns the largest amount of data that fits in a cache entry.
+ */
+size_t shmcache_max_length(shmcache_t cache) {
+  return cache->entry_size - sizeof(struct shmcache_entry);
+}
+
+/** Internal function that hashes a key with 64-bit FNV-1a.
+ *
+ *  Returns: the hash, never zero (the hash of free entries).
+ */
+static uint64_t hash_key(const char *key) {
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char *p = key; *p; p++) {
+    hash ^= (unsigned char) *p;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash ? hash : 1;
+}
+
+/** Internal function that returns the number of entries a key can be
+ *  stored in, starting at the position of its hash.
+ */
+static uint64_t probe_count(shmcache_t cache) {
+  return cache->entry_count < SHMCACHE_PROBES ? cache->entry_count : SHMCACHE_PROBES;
+}
+
+/** Internal function that finds the entry holding a key among the
+ *  entries it can be stored in.
+ *
+ *  Returns: the entry, or NULL if the key is not in the cache.
+ */
+static struct shmcache_entry *find_entry(shmcache_t cache, const char *key, uint64_t hash) {
+
+  for (uint64_t n = 0, i = hash % cache->entry_count; n < probe_count(cache);
+       n++, i = (i + 1) % cache->entry_count) {
+    struct shmcache_entry *entry = entry_at(cache, i);
+    if (entry->hash == hash && !strncmp(entry->key, key, sizeof(entry->key)))
+      return entry;
+  }
+  return NULL;
+}
+
+/** Looks up data in the cache.
+ *
+ *  Parameters: cache: Cache to be searched.
+ *              key: Key of the data.
+ *              tag: Tag the data was stored with; data stored with
+ *                   any other tag is ignored.
+ *              length: Receives the length of the data.
+ *
+ *  Returns: A copy of the cached data, to be freed by the caller, or
+ *           NULL if the data is not in the cache.
+ */
+void *shmcache_get(shmcache_t cache, const char *key, uint64_t tag, size_t *length) {
+
+  struct shmcache_entry *entry = find_entry(cache, key, hash_key(key));
+  char *data = NULL;
+
+  if (entry) {
+    uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    size_t len = entry->length;
+
+    if (!(seq & 1) && entry->tag == tag && len <= shmcache_max_length(cache) &&
+	(data = malloc(len + 1)) != NULL) {
+      memcpy(data, entry->data, len);
+
+      // Entry rewritten while it was being copied
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq ||
+	  strncmp(entry->key, key, sizeof(entry->key))) {
+	free(data);
+	data = NULL;
+      } else {
+	*length = len;
+      }
+    }
+  }
+
+  if (!data) {
+    __sync_fetch_and_add(&cache->misses, 1);
+    return NULL;
+  }
+
+  __atomic_store_n(&entry->last_used, __sync_add_and_fetch(&cache->clock, 1), __ATOMIC_RELAXED);
+  __sync_fetch_and_add(&cache->hits, 1);
+  __sync_fetch_and_add(&cache->bytes_served, *length);
+  return data;
+}
+
+/** Stores data in the cache, replacing any data stored earlier with
+ *  the same key or, if there is none, a free entry or the least
+ *  recently used one among those the key can be stored in.
+ *  Data larger than an entry, and data for entries being written by
+ *  another process, is not cached.
+ *
+ *  Parameters: cache: Cache where the data will be stored.
+ *              key: Key of the data.
+ *              tag: Tag to be stored with the data.
+ *              data: Data to be stored.
+ *              length: Length of the data.
+ */
+void shmcache_put(shmcache_t cache, const char *key, uint64_t tag, const void *data, size_t length) {
+
+  if (length > shmcache_max_length(cache) || strlen(key) >= SHMCACHE_KEY_MAX)
+    return;
+
+  // Free entries have last_used set to zero, so they are taken first
+  uint64_t hash = hash_key(key);
+  struct shmcache_entry *victim = find_entry(cache, key, hash);
+  if (!victim) {
+    for (uint64_t n = 0, i = hash % cache->entry_count; n < probe_count(cache);
+	 n++, i = (i + 1) % cache->entry_count)
+      if (!victim || entry_at(cache, i)->last_used < victim->last_used)
+	victim = entry_at(cache, i);
+  }
+
+  uint32_t seq = __atomic_load_n(&victim->seq, __ATOMIC_ACQUIRE);
+  if ((seq & 1) || !__sync_bool_compare_and_swap(&victim->seq, seq, seq + 1))
+    return;
+
+  if (victim->key[0] && strcmp(victim->key, key))
+    __sync_fetch_and_add(&cache->evictions, 1);
+
+  strcpy(victim->key, key);
+  victim->hash = hash;
+  victim->tag = tag;
+  victim->length = length;
+  memcpy(victim->data, data, length);
+  victim->last_used = __sync_add_and_fetch(&cache->clock, 1);
+
+  __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+  __sync_fetch_and_add(&cache->stores, 1);
+}
+
+/** Removes data from the cache, if present. If the entry is being
+ *  written by another process at the same time, it is left alone.
+ *
+ *  Parameters: cache: Cache where the data is stored.
+ *              key: Key of the data.
+ */
+void shmcache_remove(shmcache_t cache, const char *key) {
+
+  struct shmcache_entry *entry = find_entry(cache, key, hash_key(key));
+  if (!entry) return;
+
+  uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+  if ((seq & 1) || !__sync_bool_compare_and_swap(&entry->seq, seq, seq + 1))
+    return;
+
+  if (!strncmp(entry->key, key, sizeof(entry->key))) {
+    entry->key[0] = 0;
+    entry->hash = 0;
+    entry->length = 0;
+    entry->last_used = 0;
+  }
+  __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/** Retrieves the cache counters: lookups answered from the cache
+ *  (hits) or not (misses), bytes returned by hits, data stored and
+ *  entries evicted to make room for other keys, as well as the cache
+ *  geometry.
+ *
+ *  Parameters: cache: Cache to be assessed.
+ *              stats: Receives the counters.
+ */
+void shmcache_stats(shmcache_t cache, struct shmcache_stats *stats) {
+
+  stats->hits         = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+  stats->misses       = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+  stats->bytes_served = __atomic_load_n(&cache->bytes_served, __ATOMIC_RELAXED);
+  stats->stores       = __atomic_load_n(&cache->stores, __ATOMIC_RELAXED);
+  stats->evictions    = __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED);
+  stats->entry_count  = cache->entry_count;
+  stats->entry_size   = cache->entry_size;
+  stats->entries_used = 0;
+  for (uint64_t i = 0; i < cache->entry_count; i++)
+    stats->entries_used += entry_at(cache, i)->key[0] != 0;
+}
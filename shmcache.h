@@ -0,0 +1,33 @@
+/* shmcache.h
+ * Fixed-size caches shared by all server processes.
+ */
+
+#ifndef _SHMCACHE_H_
+#define _SHMCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHMCACHE_KEY_MAX 256
+
+typedef struct shmcache *shmcache_t;
+
+struct shmcache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t bytes_served;
+  uint64_t stores;
+  uint64_t evictions;
+  uint64_t entries_used;
+  uint64_t entry_count;
+  uint64_t entry_size;
+};
+
+shmcache_t shmcache_open(const char *file_name, long bytes, long entry_size);
+size_t shmcache_max_length(shmcache_t cache);
+void *shmcache_get(shmcache_t cache, const char *key, uint64_t tag, size_t *length);
+void shmcache_put(shmcache_t cache, const char *key, uint64_t tag, const void *data, size_t length);
+void shmcache_remove(shmcache_t cache, const char *key);
+void shmcache_stats(shmcache_t cache, struct shmcache_stats *stats);
+
+#endif
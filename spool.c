@@ -0,0 +1,360 @@
+/* spool.c
+ * Writes an incoming message to a temporary spool file, optionally
+ * compressing it, and records information about the message.
+ *
+ * Notes: Messages are stored ready to be sent by RETR (CRLF line
+ * endings, dot-stuffed). Information about the message (size, number
+ * of lines, length of the header block) is gathered while it is
+ * written, so the POP3 server never has to scan a message to learn it.
+ *
+ * The first bytes of a message are kept in memory until it is
+ * known whether compression pays off. Messages shorter than that
+ * sample are stored raw. For longer messages the sample is compressed
+ * once to estimate the ratio, and the whole message is then either
+ * compressed as a gzip stream or stored raw. Compressed files can be
+ * read back with zlib's gzread family, which also passes raw files
+ * through unchanged.
+ *
+ * Spool files are created in a directory of their own in the mail
+ * storage, and locked for as long as their spool object exists. Files
+ * left behind by a process that crashed are then the only unlocked
+ * files in that directory, and can be removed without looking at the
+ * rest of the storage (see spool_cleanup).
+ */
+
+#include "spool.h"
+#include "mailuser.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define SPOOL_DIRECTORY MAIL_BASE_DIRECTORY "/.spool"
+#define SPOOL_SAMPLE_SIZE 8192
+#define SPOOL_MAX_RATIO_PERCENT 90
+#define SPOOL_OUT_CHUNK 65536
+
+// gzip wrapper instead of a raw zlib stream, so gzread can read it
+#define SPOOL_GZIP_WINDOW_BITS (15 + 16)
+
+enum spool_state { SPOOL_SAMPLING, SPOOL_RAW, SPOOL_DEFLATE, SPOOL_CLOSED };
+
+struct spool {
+  int fd;
+  enum spool_state state;
+  int compressed;
+  size_t size;
+  size_t lines;
+  size_t header_size;
+  size_t line_len;
+  int header_done;
+  char last_char;
+  size_t sample_len;
+  z_stream zs;
+  char file_name[sizeof(SPOOL_DIRECTORY "/tmpXXXXXX")];
+  char info[SPOOL_INFO_MAX];
+  char sample[SPOOL_SAMPLE_SIZE];
+};
+
+/** Internal function that writes an entire buffer to a file.
+ *
+ *  Returns: zero on success, -1 on failure.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t rv = write(fd, p, len);
+    if (rv <= 0) return -1;
+    p += rv;
+    len -= rv;
+  }
+  return 0;
+}
+
+/** Internal function that feeds data to the compressor and writes any
+ *  compressed output to the spool file.
+ */
+static int deflate_to_file(spool_t sp, const char *data, size_t len, int flush) {
+
+  unsigned char out[SPOOL_OUT_CHUNK];
+
+  sp->zs.next_in  = (Bytef *) data;
+  sp->zs.avail_in = len;
+  do {
+    sp->zs.next_out  = out;
+    sp->zs.avail_out = sizeof(out);
+    if (deflate(&sp->zs, flush) == Z_STREAM_ERROR)
+      return -1;
+    if (write_all(sp->fd, out, sizeof(out) - sp->zs.avail_out) < 0)
+      return -1;
+  } while (sp->zs.avail_out == 0);
+
+  return 0;
+}
+
+/** Internal function that updates the message information with a
+ *  block of (already normalized) message data. Data may be split at
+ *  any point, not only at line boundaries.
+ */
+static void scan_lines(spool_t sp, const char *data, size_t len) {
+
+  const char *start = data, *end = data + len;
+
+  while (data < end) {
+    const char *nl = memchr(data, '\n', end - data);
+    size_t n = (nl ? nl + 1 : end) - data;
+
+    if (nl) {
+      // Header block ends with the first empty line (inclusive)
+      if (!sp->header_done && sp->line_len + n == 2) {
+	sp->header_done = 1;
+	sp->header_size = sp->size + (data - start) + n;
+      }
+      sp->lines++;
+      sp->line_len = 0;
+    } else {
+      sp->line_len += n;
+    }
+    data += n;
+  }
+}
+
+/** Internal function that checks if the sample kept in memory
+ *  compresses well enough for compression to be worth it.
+ */
+static int sample_compresses(spool_t sp) {
+
+  uLongf dest_len = compressBound(sp->sample_len);
+  Bytef *dest = malloc(dest_len);
+  int rv = dest &&
+    compress2(dest, &dest_len, (Bytef *) sp->sample, sp->sample_len, Z_BEST_SPEED) == Z_OK &&
+    dest_len * 100 < sp->sample_len * SPOOL_MAX_RATIO_PERCENT;
+  free(dest);
+  return rv;
+}
+
+/** Internal function that decides, based on the sample, how the
+ *  message will be stored, and writes the sample out.
+ */
+static int flush_sample(spool_t sp) {
+
+  if (config_long("MAIL_COMPRESS", 1) && sample_compresses(sp)) {
+    memset(&sp->zs, 0, sizeof(sp->zs));
+    if (deflateInit2(&sp->zs, Z_BEST_SPEED, Z_DEFLATED, SPOOL_GZIP_WINDOW_BITS,
+		     8, Z_DEFAULT_STRATEGY) == Z_OK) {
+      sp->state = SPOOL_DEFLATE;
+      sp->compressed = 1;
+      return deflate_to_file(sp, sp->sample, sp->sample_len, Z_NO_FLUSH);
+    }
+  }
+
+  sp->state = SPOOL_RAW;
+  return write_all(sp->fd, sp->sample, sp->sample_len);
+}
+
+/** Creates a new, empty, spool file in the spool directory of the
+ *  mail storage. The file is locked until the spool object is
+ *  destroyed.
+ *
+ *  Returns: A spool_t object, or NULL if the file could not be created.
+ */
+spool_t spool_create(void) {
+
+  spool_t sp = malloc(sizeof(struct spool));
+  if (!sp) return NULL;
+
+  // Create directories if they don't exist yet (errors ignored)
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  mkdir(SPOOL_DIRECTORY, 0777);
+
+  strcpy(sp->file_name, SPOOL_DIRECTORY "/tmpXXXXXX");
+  sp->fd = mkstemp(sp->file_name);
+  if (sp->fd < 0 || flock(sp->fd, LOCK_EX) < 0) {
+    if (sp->fd >= 0) {
+      close(sp->fd);
+      unlink(sp->file_name);
+    }
+    free(sp);
+    return NULL;
+  }
+
+  sp->state       = SPOOL_SAMPLING;
+  sp->compressed  = 0;
+  sp->size        = 0;
+  sp->lines       = 0;
+  sp->header_size = 0;
+  sp->line_len    = 0;
+  sp->header_done = 0;
+  sp->last_char   = 0;
+  sp->sample_len  = 0;
+  sp->info[0]     = 0;
+  return sp;
+}
+
+/** Internal function that stores a block of normalized message data,
+ *  keeping it in the sample buffer until the storage format has been
+ *  decided.
+ */
+static int store(spool_t sp, const char *data, size_t len) {
+
+  scan_lines(sp, data, len);
+  sp->size += len;
+  if (len) sp->last_char = data[len - 1];
+
+  if (sp->state == SPOOL_SAMPLING) {
+    size_t n = SPOOL_SAMPLE_SIZE - sp->sample_len;
+    if (n > len) n = len;
+    memcpy(sp->sample + sp->sample_len, data, n);
+    sp->sample_len += n;
+    data += n;
+    len -= n;
+    if (sp->sample_len < SPOOL_SAMPLE_SIZE)
+      return 0;
+    if (flush_sample(sp) < 0)
+      return -1;
+  }
+
+  if (!len) return 0;
+  if (sp->state == SPOOL_DEFLATE)
+    return deflate_to_file(sp, data, len, Z_NO_FLUSH);
+  return write_all(sp->fd, data, len);
+}
+
+/** Appends data to the message being spooled. The message is stored
+ *  in the form RETR sends it: data received over SMTP is already
+ *  dot-stuffed, and lines ending in a bare LF are stored with CRLF, so
+ *  a stored message can be sent to a POP3 client unmodified.
+ *
+ *  Parameters: sp: Spool object.
+ *              data: Message data, as received in the DATA command
+ *                    (dot-stuffed, without the terminating line).
+ *              len: Number of bytes in data.
+ *
+ *  Returns: zero on success, -1 if the data could not be written.
+ */
+int spool_write(spool_t sp, const char *data, size_t len) {
+
+  const char *end = data + len;
+
+  while (data < end) {
+    const char *nl = memchr(data, '\n', end - data);
+    if (!nl)
+      return store(sp, data, end - data);
+
+    int crlf = nl > data ? nl[-1] == '\r' : sp->last_char == '\r';
+    if (crlf) {
+      if (store(sp, data, nl + 1 - data) < 0) return -1;
+    } else {
+      if (store(sp, data, nl - data) < 0 || store(sp, "\r\n", 2) < 0) return -1;
+    }
+    data = nl + 1;
+  }
+  return 0;
+}
+
+/** Finishes writing the message. After this call the file name and
+ *  message information are available. The file stays open, to keep
+ *  its lock, until the spool object is destroyed.
+ *
+ *  Parameters: sp: Spool object.
+ *
+ *  Returns: zero on success, -1 if the message could not be written.
+ */
+int spool_close(spool_t sp) {
+
+  // A last line without line terminator is terminated, so the final "." is on a line of its own
+  int rv = sp->line_len ? store(sp, "\r\n", 2) : 0;
+
+  // Messages that never filled the sample are too small to compress
+  if (sp->state == SPOOL_SAMPLING) {
+    sp->state = SPOOL_RAW;
+    if (write_all(sp->fd, sp->sample, sp->sample_len) < 0) rv = -1;
+  } else if (sp->state == SPOOL_DEFLATE) {
+    if (deflate_to_file(sp, NULL, 0, Z_FINISH) < 0) rv = -1;
+    deflateEnd(&sp->zs);
+  }
+
+  sp->state = SPOOL_CLOSED;
+
+  if (!sp->header_done)
+    sp->header_size = sp->size;
+
+  snprintf(sp->info, sizeof(sp->info),
+	   SPOOL_INFO_SIZE "%zu," SPOOL_INFO_WIRE_SIZE "%zu," SPOOL_INFO_LINES "%zu,"
+	   SPOOL_INFO_HEADER_SIZE "%zu%s",
+	   sp->size, sp->size, sp->lines, sp->header_size,
+	   sp->compressed ? "," SPOOL_INFO_COMPRESSED : "");
+  return rv;
+}
+
+/** Returns the name of the spool file. It will remain valid until the
+ *  spool object is destroyed.
+ */
+const char *spool_filename(spool_t sp) {
+  return sp->file_name;
+}
+
+/** Returns a string describing the spooled message, in the form of
+ *  comma-separated fields (e.g., "S=1234,W=1240,L=30,H=512,Z"). The
+ *  fields are the uncompressed message size (S=), the number of octets
+ *  sent by RETR before the terminating line (W=, the same as S= since
+ *  messages are stored in wire format), the number of lines
+ *  (L=) and the length of the header block, including the empty line
+ *  that ends it (H=). The Z flag indicates the file is compressed.
+ *  Only valid after spool_close.
+ */
+const char *spool_info(spool_t sp) {
+  return sp->info;
+}
+
+/** Removes the spool file and frees all memory used by a spool object.
+ *
+ *  Parameters: sp: Spool object to be destroyed.
+ */
+void spool_destroy(spool_t sp) {
+
+  if (sp->state == SPOOL_DEFLATE)
+    deflateEnd(&sp->zs);
+  unlink(sp->file_name);
+  close(sp->fd);
+  free(sp);
+}
+
+/** Removes spool files left behind by processes that crashed while
+ *  receiving or saving a message. Files of spool objects still in use
+ *  are locked, and are left alone.
+ *
+ *  Returns: Number of files removed.
+ */
+int spool_cleanup(void) {
+
+  char path[PATH_MAX];
+  struct dirent *entry;
+  int removed = 0;
+
+  DIR *dir = opendir(SPOOL_DIRECTORY);
+  if (!dir) return 0;
+
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') continue;
+    if (snprintf(path, sizeof(path), "%s/%s", SPOOL_DIRECTORY, entry->d_name) >= sizeof(path))
+      continue;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) continue;
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0 && unlink(path) == 0)
+      removed++;
+    close(fd);
+  }
+  closedir(dir);
+  return removed;
+}
@@ -0,0 +1,30 @@
+/* spool.h
+ * Writes an incoming message to a temporary spool file, optionally
+ * compressing it, and records information about the message.
+ */
+
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <stddef.h>
+
+// Keys used in the message information string (see spool_info)
+#define SPOOL_INFO_SIZE        "S="
+#define SPOOL_INFO_WIRE_SIZE   "W="
+#define SPOOL_INFO_LINES       "L="
+#define SPOOL_INFO_HEADER_SIZE "H="
+#define SPOOL_INFO_COMPRESSED  "Z"
+
+#define SPOOL_INFO_MAX 128
+
+typedef struct spool *spool_t;
+
+spool_t spool_create(void);
+int spool_write(spool_t sp, const char *data, size_t len);
+int spool_close(spool_t sp);
+const char *spool_filename(spool_t sp);
+const char *spool_info(spool_t sp);
+void spool_destroy(spool_t sp);
+int spool_cleanup(void);
+
+#endif
@@ -0,0 +1,230 @@
+/* usage.c
+ * Shared table of per-user mailbox usage counters.
+ *
+ * Notes: The table is a file in the mail storage mapped into every
+ * server process, so deliveries, expunges and quota checks in
+ * different processes all see the same counters without locking.
+ * It is an open-addressing hash table keyed by a 64-bit hash of the
+ * lowercase user name; slots are claimed and counters updated with
+ * atomic operations. Counters can drift if a process dies half-way
+ * through an update, and are corrected by usage_set (see mailadm
+ * reconcile). Every update also bumps a per-user generation counter,
+ * which tells caches of mailbox contents (see load_user_mail) that the
+ * mailbox has changed; users without a slot have no generation, so
+ * their mailboxes are not cached.
+ *
+ * The table has MAIL_USAGE_SLOTS slots (2^22, about 4 million, by
+ * default), set when the file is created; each takes 32 bytes, but
+ * the file is sparse, so only slots in use take memory and disk
+ * space. A user is looked for in up to USAGE_MAX_PROBES slots, so the
+ * table should have room for about half again as many users as it
+ * will hold; a larger table is created by removing the file and
+ * running mailadm reconcile.
+ */
+
+#include "usage.h"
+#include "mailuser.h"
+#include "config.h"
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define USAGE_FILE_NAME MAIL_BASE_DIRECTORY "/.usage"
+#define USAGE_MAGIC 0x4547415355414d01ULL
+#define USAGE_DEFAULT_SLOTS (1 << 22)
+#define USAGE_MAX_PROBES 64
+
+struct usage_slot {
+  uint64_t key;
+  int64_t  bytes;
+  int64_t  messages;
+  uint64_t generation;
+};
+
+struct usage_table {
+  uint64_t magic;
+  uint64_t slot_count;
+  uint64_t reserved[6];
+  struct usage_slot slots[];
+};
+
+/** Internal function that maps the usage table into memory, creating
+ *  it if it doesn't exist yet. The mapping is kept for the lifetime
+ *  of the process (and inherited by forked children).
+ *
+ *  Returns: the usage table, or NULL if it cannot be mapped.
+ */
+static struct usage_table *usage_table(void) {
+
+  static struct usage_table *table = NULL;
+  static int failed = 0;
+  struct usage_table header;
+  struct stat st;
+
+  if (table || failed) return table;
+  failed = 1;
+
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  int fd = open(USAGE_FILE_NAME, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) return NULL;
+
+  // Serialize creation between processes starting at the same time
+  flock(fd, LOCK_EX);
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(header) ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != USAGE_MAGIC) {
+
+    // Slot count must be a power of two; the file is sparse until used
+    uint64_t slots = 1;
+    while (slots < config_long("MAIL_USAGE_SLOTS", USAGE_DEFAULT_SLOTS)) slots <<= 1;
+
+    header = (struct usage_table) { .magic = USAGE_MAGIC, .slot_count = slots };
+    if (ftruncate(fd, 0) < 0 ||
+	ftruncate(fd, sizeof(header) + slots * sizeof(struct usage_slot)) < 0 ||
+	pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      close(fd);
+      return NULL;
+    }
+  }
+
+  void *map = mmap(NULL, sizeof(header) + header.slot_count * sizeof(struct usage_slot),
+		   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  if (map == MAP_FAILED) return NULL;
+  table = map;
+  failed = 0;
+  return table;
+}
+
+/** Internal function that finds the slot for a user, optionally
+ *  claiming an empty slot if the user is not in the table yet.
+ *
+ *  Returns: the user's slot, or NULL if the user is not found (or, if
+ *           create is set, no slot could be claimed).
+ */
+static struct usage_slot *find_slot(const char *username, int create) {
+
+  struct usage_table *table = usage_table();
+  if (!table) return NULL;
+
+  // 64-bit FNV-1a of the lowercase name; zero marks an empty slot
+  uint64_t key = 0xcbf29ce484222325ULL;
+  for (const char *p = username; *p; p++) {
+    key ^= (unsigned char) tolower((unsigned char) *p);
+    key *= 0x100000001b3ULL;
+  }
+  if (!key) key = 1;
+
+  uint64_t mask = table->slot_count - 1;
+  uint64_t i = key & mask;
+  for (int n = 0; n < USAGE_MAX_PROBES; n++, i = (i + 1) & mask) {
+    struct usage_slot *slot = &table->slots[i];
+    uint64_t slot_key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+    if (slot_key == key)
+      return slot;
+    if (slot_key == 0) {
+      if (!create) return NULL;
+      if (__sync_bool_compare_and_swap(&slot->key, 0, key) ||
+	  __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) == key)
+	return slot;
+    }
+  }
+  return NULL;
+}
+
+/** Retrieves the current mailbox usage of a user. Users not in the
+ *  table (e.g., whose mailbox predates the table and was not
+ *  reconciled yet, or who could not get a slot) have unknown usage,
+ *  and are reported with zero counters and a failure.
+ *
+ *  Parameters: username: Name of the user.
+ *              bytes: Receives the total size of the user's messages.
+ *              messages: Receives the number of messages.
+ *
+ *  Returns: zero on success, -1 if the usage table is not available
+ *           or has no counters for the user.
+ */
+int usage_get(const char *username, int64_t *bytes, int64_t *messages) {
+
+  struct usage_slot *slot = find_slot(username, 0);
+  *bytes    = slot ? __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED) : 0;
+  *messages = slot ? __atomic_load_n(&slot->messages, __ATOMIC_RELAXED) : 0;
+  return slot ? 0 : -1;
+}
+
+/** Adds (or, with negative values, subtracts) to the mailbox usage of
+ *  a user. Errors are ignored, since counters are reconciled later.
+ *
+ *  Parameters: username: Name of the user.
+ *              bytes: Change in the total size of the user's messages.
+ *              messages: Change in the number of messages.
+ */
+void usage_add(const char *username, int64_t bytes, int64_t messages) {
+
+  struct usage_slot *slot = find_slot(username, 1);
+  if (!slot) return;
+  __sync_fetch_and_add(&slot->bytes, bytes);
+  __sync_fetch_and_add(&slot->messages, messages);
+  __sync_fetch_and_add(&slot->generation, 1);
+}
+
+/** Retrieves the generation counter of a user's mailbox. The counter
+ *  changes with every call to usage_add for the user, which happens
+ *  whenever a message is delivered or expunged, so a copy of mailbox
+ *  contents taken while the generation was unchanged is still valid.
+ *
+ *  Users without a slot have no generation: changes to their mailbox
+ *  cannot be tracked (usage_add can't record them either), so copies
+ *  of it must not be kept.
+ *
+ *  Parameters: username: Name of the user.
+ *              generation: Receives the generation counter.
+ *
+ *  Returns: zero on success, -1 if the usage table is not available
+ *           or has no slot for the user.
+ */
+int usage_generation(const char *username, uint64_t *generation) {
+
+  struct usage_slot *slot = find_slot(username, 0);
+  if (!slot) return -1;
+  *generation = __atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE);
+  return 0;
+}
+
+/** Replaces the mailbox usage of a user, typically with values
+ *  computed from the mail storage, but only if the counters still
+ *  hold the values read before those were computed. This way, a
+ *  delivery or expunge that happens during the computation is not
+ *  lost.
+ *
+ *  Parameters: username: Name of the user.
+ *              old_bytes, old_messages: Values read with usage_get
+ *                                       before the new values were
+ *                                       computed.
+ *              bytes, messages: New values.
+ *
+ *  Returns: zero if the counters were replaced, -1 otherwise.
+ */
+int usage_set(const char *username, int64_t old_bytes, int64_t old_messages,
+	      int64_t bytes, int64_t messages) {
+
+  struct usage_slot *slot = find_slot(username, 1);
+  if (!slot) return -1;
+
+  if (!__sync_bool_compare_and_swap(&slot->bytes, old_bytes, bytes))
+    return -1;
+  if (!__sync_bool_compare_and_swap(&slot->messages, old_messages, messages)) {
+    __sync_fetch_and_add(&slot->bytes, old_bytes - bytes);
+    return -1;
+  }
+  __sync_fetch_and_add(&slot->generation, 1);
+  return 0;
+}
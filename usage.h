@@ -0,0 +1,16 @@
+/* usage.h
+ * Shared table of per-user mailbox usage counters.
+ */
+
+#ifndef _USAGE_H_
+#define _USAGE_H_
+
+#include <stdint.h>
+
+int usage_get(const char *username, int64_t *bytes, int64_t *messages);
+void usage_add(const char *username, int64_t bytes, int64_t messages);
+int usage_generation(const char *username, uint64_t *generation);
+int usage_set(const char *username, int64_t old_bytes, int64_t old_messages,
+	      int64_t bytes, int64_t messages);
+
+#endif